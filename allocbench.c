@@ -0,0 +1,437 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <malloc.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "myalloc.h"
+
+/***********************************************************
+*    Replays allocation traces recorded by `alloctrace`    *
+*  against `myalloc`/`myfree` and glibc malloc/free, e.g.  *
+*    ./allocbench gcc.atr sort.atr                         *
+*  Build it with                                           *
+*    gcc -O2 allocbench.c myalloc.c -o allocbench          *
+*        -lpthread                                         *
+*                                                          *
+*    Every thread of the trace gets a thread that makes    *
+*  its calls in order. A thread that frees or reallocates  *
+*  a block of another thread waits until that block is     *
+*  there, which it always was in the recorded program, so  *
+*  the waits cannot deadlock. Each call writes the first   *
+*  byte of its block. Blocks the program never freed are   *
+*  freed after the run.                                    *
+*                                                          *
+*    Each allocator runs the trace twice, each time in a   *
+*  child process of its own so that it starts on a fresh   *
+*  heap and a crash is reported, not fatal. The first run  *
+*  is timed as a whole for calls per second; the second    *
+*  times every call for the median and 99th percentile     *
+*  latency, less the cost of reading the clock, and        *
+*  follows the live bytes and the heap size. The heap is   *
+*  exact for `myalloc`; for glibc it is mallinfo2's arena  *
+*  and mapped bytes, sampled whenever the live bytes       *
+*  reach a new peak and between every `SAMPLE` calls of    *
+*  each thread. Fragmentation is the peak heap over the    *
+*  peak of live bytes of the same run, since threads may   *
+*  not interleave as they did when recorded.               *
+************************************************************/
+
+#define ATRACE_MAGIC "ATRC"
+#define ATRACE_VERSION 1
+#define ATRACE_HEADER_SIZE 16
+
+enum {A_MALLOC, A_CALLOC, A_REALLOC, A_FREE};
+
+// As `alloctrace` writes it
+struct alloc_record {
+    uint64_t id;  // Block allocated, or freed by A_FREE
+    uint64_t old;  // Block a realloc replaces, 0 if none
+    uint64_t size;
+    uint32_t thread;  // Threads are numbered by their first call
+    uint32_t op;
+};
+
+#define SAMPLE 1024
+#define FAILED ((void *)1)  // The allocation of a block returned NULL
+#define FREED ((void *)2)
+
+struct trace {
+    const char *path;
+    struct alloc_record *rec;
+    uint64_t n, max_id, peak_live;  // Live bytes as recorded
+    uint64_t *sizes;  // Of each block
+    int n_threads;
+    uint64_t **calls;  // Records of each thread
+    uint64_t *n_calls;
+};
+
+struct allocator {
+    const char *name;
+    void *(*alloc)(size_t size);
+    void *(*zalloc)(size_t size);
+    void *(*resize)(void *p, size_t old, size_t size);
+    void (*release)(void *p);
+    void (*heap)(size_t *size, size_t *peak);  // NULL if it must be sampled
+    void (*reset)();  // Of the peak
+};
+
+/***********************************************************
+*    The allocators.                                       *
+************************************************************/
+void *my_alloc(size_t size) {
+    return size > 0xFFFFFFFFu ? NULL : myalloc(size);
+}
+
+void *my_zalloc(size_t size) {
+    return mycalloc(1, size);
+}
+
+void *my_resize(void *p, size_t old, size_t size) {
+    return size > 0xFFFFFFFFu ? NULL : myrealloc(p, size);
+}
+
+void *libc_zalloc(size_t size) {
+    return calloc(1, size);
+}
+
+void *libc_resize(void *p, size_t old, size_t size) {
+    return realloc(p, size);
+}
+
+const struct allocator allocators[] = {
+    {"myalloc", my_alloc, my_zalloc, my_resize, myfree, heap_stats, reset_peak},
+    {"glibc", malloc, libc_zalloc, libc_resize, free, NULL, NULL},
+};
+#define N_ALLOCATORS (sizeof(allocators) / sizeof(allocators[0]))
+
+/***********************************************************
+*    Loading a trace.                                      *
+************************************************************/
+int load_trace(struct trace *t, const char *path) {
+    unsigned char head[ATRACE_HEADER_SIZE];
+    FILE *fp = fopen(path, "rb");
+    uint64_t i, live = 0;
+    int k;
+    memset(t, 0, sizeof(*t));
+    t->path = path;
+    if (fp == NULL) {
+        perror(path);
+        return 1;
+    }
+    if (fread(head, 1, ATRACE_HEADER_SIZE, fp) != ATRACE_HEADER_SIZE || memcmp(head, ATRACE_MAGIC, 4) != 0
+        || head[4] != ATRACE_VERSION || head[6] != sizeof(struct alloc_record)) {
+        printf("%s is not an allocation trace\n", path);
+        fclose(fp);
+        return 1;
+    }
+    for (k = 0; k < 8; ++k) t->n |= (uint64_t)head[8 + k] << (8 * k);
+    t->rec = malloc(t->n * sizeof(struct alloc_record));
+    if (t->rec == NULL || fread(t->rec, sizeof(struct alloc_record), t->n, fp) != t->n) {
+        printf("%s is short of its %llu records\n", path, (unsigned long long)t->n);
+        fclose(fp);
+        return 1;
+    }
+    fclose(fp);
+    for (i = 0; i < t->n; ++i) {
+        if (t->rec[i].id > t->max_id) t->max_id = t->rec[i].id;
+        if ((int)t->rec[i].thread >= t->n_threads) t->n_threads = t->rec[i].thread + 1;
+    }
+    // Split the calls by thread, and follow the live bytes in the recorded order
+    t->calls = calloc(t->n_threads, sizeof(uint64_t *));
+    t->n_calls = calloc(t->n_threads, sizeof(uint64_t));
+    t->sizes = calloc(t->max_id + 1, sizeof(uint64_t));
+    for (i = 0; i < t->n; ++i) ++t->n_calls[t->rec[i].thread];
+    for (k = 0; k < t->n_threads; ++k) {
+        t->calls[k] = malloc(t->n_calls[k] * sizeof(uint64_t));
+        t->n_calls[k] = 0;
+    }
+    for (i = 0; i < t->n; ++i) {
+        struct alloc_record *r = &t->rec[i];
+        t->calls[r->thread][t->n_calls[r->thread]++] = i;
+        if (r->op == A_FREE || r->old) live -= t->sizes[r->op == A_FREE ? r->id : r->old];
+        if (r->op != A_FREE) live += t->sizes[r->id] = r->size;
+        if (live > t->peak_live) t->peak_live = live;
+    }
+    return 0;
+}
+
+void free_trace(struct trace *t) {
+    int k;
+    for (k = 0; k < t->n_threads; ++k) free(t->calls[k]);
+    free(t->calls);
+    free(t->n_calls);
+    free(t->sizes);
+    free(t->rec);
+}
+
+/***********************************************************
+*    Replaying.                                            *
+************************************************************/
+struct run {
+    const struct trace *t;
+    const struct allocator *al;
+    void **blocks;  // By id, NULL until allocated
+    int timed;
+    double overhead;  // ns of a clock read
+    uint32_t **latency;  // ns of each call of each thread, when timed
+    size_t live, peak_live;  // Bytes, when timed
+    size_t base, peak_heap;  // Heap bytes before the run, and the peak above them
+};
+
+struct result {
+    double secs;
+    uint32_t p50, p99;
+    size_t peak_heap, peak_live;
+};
+
+struct worker {
+    struct run *run;
+    int thread;
+};
+
+static inline uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// A block of another thread, once that thread has allocated it
+static inline void *wait_block(void **slot) {
+    void *p;
+    while ((p = __atomic_load_n(slot, __ATOMIC_ACQUIRE)) == NULL) sched_yield();
+    return p;
+}
+
+size_t heap_size(struct run *run) {
+    struct mallinfo2 mi;
+    size_t size, peak;
+    if (run->al->heap != NULL) {
+        run->al->heap(&size, &peak);
+        return size;
+    }
+    mi = mallinfo2();
+    return mi.arena + mi.hblkhd;
+}
+
+void sample_heap(struct run *run) {
+    size_t heap = heap_size(run) - run->base, peak = __atomic_load_n(&run->peak_heap, __ATOMIC_RELAXED);
+    while (heap > peak && !__atomic_compare_exchange_n(&run->peak_heap, &peak, heap, 1,
+        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+// Add a call's bytes to the live bytes, sampling the heap at a new peak
+void count_live(struct run *run, long delta) {
+    size_t live = __atomic_add_fetch(&run->live, delta, __ATOMIC_RELAXED);
+    size_t peak = __atomic_load_n(&run->peak_live, __ATOMIC_RELAXED);
+    while (live > peak)
+        if (__atomic_compare_exchange_n(&run->peak_live, &peak, live, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            if (run->al->heap == NULL) sample_heap(run);
+            break;
+        }
+}
+
+void *replay(void *arg) {
+    struct worker *w = arg;
+    struct run *run = w->run;
+    const struct allocator *al = run->al;
+    const struct trace *t = run->t;
+    uint64_t *calls = t->calls[w->thread], n = t->n_calls[w->thread], i, t0 = 0;
+    uint32_t *lat = run->timed ? run->latency[w->thread] : NULL;
+    for (i = 0; i < n; ++i) {
+        const struct alloc_record *r = &t->rec[calls[i]];
+        void *p = NULL, *q = NULL;
+        uint64_t gone = r->op == A_FREE ? r->id : r->old;
+        if (gone) {
+            p = wait_block(&run->blocks[gone]);
+            run->blocks[gone] = FREED;
+            if (p == FAILED) p = NULL;
+        }
+        if (lat != NULL) t0 = now_ns();
+        if (r->op == A_MALLOC) q = al->alloc(r->size);
+        else if (r->op == A_CALLOC) q = al->zalloc(r->size);
+        else if (r->op == A_REALLOC) q = al->resize(p, p != NULL ? t->sizes[r->old] : 0, r->size);
+        else al->release(p);
+        if (lat != NULL) {
+            double ns = now_ns() - t0 - run->overhead;
+            lat[i] = ns > 0 ? ns : 0;
+            // A realloc that failed left the old block
+            count_live(run, (q != NULL ? (long)r->size : 0) - (p != NULL && (q != NULL || r->op == A_FREE) ? (long)t->sizes[gone] : 0));
+            if (al->heap == NULL && i % SAMPLE == 0) sample_heap(run);
+        }
+        if (r->op != A_FREE) {
+            if (q != NULL && r->size > 0) *(volatile char *)q = 1;
+            __atomic_store_n(&run->blocks[r->id], q != NULL ? q : FAILED, __ATOMIC_RELEASE);
+        }
+    }
+    return NULL;
+}
+
+// Run a trace once, return the seconds it took
+double run_trace(struct run *run) {
+    const struct trace *t = run->t;
+    pthread_t *tid = malloc(t->n_threads * sizeof(pthread_t));
+    struct worker *w = malloc(t->n_threads * sizeof(struct worker));
+    uint64_t start, i;
+    size_t size;
+    int k;
+    run->blocks = calloc(t->max_id + 1, sizeof(void *));
+    run->live = run->peak_live = run->peak_heap = 0;
+    if (run->al->reset != NULL) run->al->reset();
+    run->base = heap_size(run);
+    start = now_ns();
+    for (k = 0; k < t->n_threads; ++k) {
+        w[k].run = run;
+        w[k].thread = k;
+        pthread_create(&tid[k], NULL, replay, &w[k]);
+    }
+    for (k = 0; k < t->n_threads; ++k) pthread_join(tid[k], NULL);
+    double secs = (now_ns() - start) / 1e9;
+    if (run->al->heap != NULL) {
+        run->al->heap(&size, &run->peak_heap);
+        run->peak_heap -= run->base;
+    }
+    for (i = 1; i <= t->max_id; ++i)
+        if (run->blocks[i] != NULL && run->blocks[i] != FAILED && run->blocks[i] != FREED)
+            run->al->release(run->blocks[i]);
+    free(run->blocks);
+    free(tid);
+    free(w);
+    return secs;
+}
+
+int compare_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// The usual cost of reading the clock, to take off every timed call
+double clock_overhead() {
+    uint32_t d[1001];
+    int i;
+    for (i = 0; i < 1001; ++i) {
+        uint64_t t0 = now_ns();
+        d[i] = now_ns() - t0;
+    }
+    qsort(d, 1001, sizeof(uint32_t), compare_u32);
+    return d[500];
+}
+
+// Run a trace once and measure it
+void measure(struct run *run, struct result *res) {
+    const struct trace *t = run->t;
+    uint32_t *all;
+    uint64_t n = 0;
+    int k;
+    if (run->timed) {
+        run->latency = malloc(t->n_threads * sizeof(uint32_t *));
+        for (k = 0; k < t->n_threads; ++k) run->latency[k] = malloc(t->n_calls[k] * sizeof(uint32_t) + 1);
+    }
+    res->secs = run_trace(run);
+    res->peak_heap = run->peak_heap;
+    res->peak_live = run->peak_live;
+    if (!run->timed) return;
+    all = malloc(t->n * sizeof(uint32_t) + 1);
+    for (k = 0; k < t->n_threads; ++k) {
+        memcpy(all + n, run->latency[k], t->n_calls[k] * sizeof(uint32_t));
+        n += t->n_calls[k];
+    }
+    qsort(all, n, sizeof(uint32_t), compare_u32);
+    res->p50 = n ? all[n / 2] : 0;
+    res->p99 = n ? all[n * 99 / 100] : 0;
+}
+
+// Measure a run in a child process, so that it starts on a fresh heap; return 0 if it finished
+int measure_apart(struct run *run, struct result *res) {
+    int fds[2], status;
+    ssize_t got;
+    pid_t pid;
+    fflush(stdout);
+    if (pipe(fds) != 0 || (pid = fork()) < 0) {
+        perror("allocbench");
+        exit(1);
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        measure(run, res);
+        _exit(write(fds[1], res, sizeof(*res)) != sizeof(*res));
+    }
+    close(fds[1]);
+    got = read(fds[0], res, sizeof(*res));
+    close(fds[0]);
+    waitpid(pid, &status, 0);
+    return got != sizeof(*res) || !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+}
+
+void bench(const struct trace *t, const struct allocator *al, double overhead) {
+    struct run run = {t, al};
+    struct result first, second;
+    if (measure_apart(&run, &first) == 0) {
+        run.timed = 1;
+        run.overhead = overhead;
+        if (measure_apart(&run, &second) == 0) {
+            printf("%-9s %12.0f %8u %8u %12.2f %8.3f\n", al->name, first.secs > 0 ? t->n / first.secs : 0.0,
+                second.p50, second.p99, second.peak_heap / 1048576.0,
+                second.peak_live ? (double)second.peak_heap / second.peak_live : 0.0);
+            return;
+        }
+    }
+    printf("%-9s failed\n", al->name);
+}
+
+void usage() {
+    printf("usage:./allocbench [-a myalloc,glibc] [-m mmap_threshold] trace.atr ...\n");
+    printf("      traces are recorded with ALLOCTRACE=trace.atr LD_PRELOAD=./alloctrace.so program\n");
+}
+
+int main(int argc, char *argv[]) {
+    int opt, i, use[N_ALLOCATORS];
+    unsigned j;
+    char *names = NULL;
+    for (j = 0; j < N_ALLOCATORS; ++j) use[j] = 1;
+    while ((opt = getopt(argc, argv, "a:m:")) != -1) {
+        if (opt == 'a')
+            names = optarg;
+        else if (opt == 'm')
+            set_mmap_threshold(strtoul(optarg, NULL, 0));
+        else {
+            usage();
+            return 1;
+        }
+    }
+    if (optind >= argc) {
+        usage();
+        return 1;
+    }
+    if (names != NULL) {
+        char *tok;
+        for (j = 0; j < N_ALLOCATORS; ++j) use[j] = 0;
+        for (tok = strtok(names, ","); tok != NULL; tok = strtok(NULL, ",")) {
+            for (j = 0; j < N_ALLOCATORS && strcasecmp(tok, allocators[j].name) != 0; ++j);
+            if (j == N_ALLOCATORS) {
+                printf("Unknown allocator %s\n", tok);
+                return 1;
+            }
+            use[j] = 1;
+        }
+    }
+    double overhead = clock_overhead();
+    for (i = optind; i < argc; ++i) {
+        struct trace t;
+        if (load_trace(&t, argv[i]) != 0) return 1;
+        printf("%s: %llu calls, %d threads, %.2f MB live at peak\n", argv[i], (unsigned long long)t.n,
+            t.n_threads, t.peak_live / 1048576.0);
+        printf("%-9s %12s %8s %8s %12s %8s\n", "allocator", "calls/s", "p50_ns", "p99_ns", "peak_heap_MB",
+            "frag");
+        for (j = 0; j < N_ALLOCATORS; ++j)
+            if (use[j]) bench(&t, &allocators[j], overhead);
+        free_trace(&t);
+    }
+    return 0;
+}
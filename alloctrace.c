@@ -0,0 +1,298 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/***********************************************************
+*    A recorder of the allocation calls of a real program, *
+*  preloaded (LD_PRELOAD=./alloctrace.so). `allocbench`    *
+*  replays the trace against `myalloc` and glibc, e.g.     *
+*    ALLOCTRACE=sort.atr LD_PRELOAD=./alloctrace.so        *
+*         sort -R big.txt > /dev/null                      *
+*    ./allocbench sort.atr                                 *
+*  Build it with                                           *
+*    gcc -O2 -shared -fPIC alloctrace.c -o alloctrace.so   *
+*        -lpthread                                         *
+*                                                          *
+*    malloc, calloc, realloc, free and the aligned forms   *
+*  are passed on to glibc's own entry points (`__libc_`),  *
+*  and every call that succeeds appends a record of the    *
+*  thread, the call, the block and its size. Blocks are    *
+*  numbered in order of allocation, a hash table maps      *
+*  live addresses to their numbers, and a block's lifetime *
+*  is the distance from its allocation to its free. The    *
+*  number of a freed or reallocated block is dropped       *
+*  before glibc gets the address back, so another thread   *
+*  that is handed the same address gets a new number.      *
+*  Aligned allocations are recorded as plain mallocs.      *
+*                                                          *
+*    Records are taken under one lock and written 4096 at  *
+*  a time; the header count covers the records written so *
+*  far, so a crash leaves a short but valid trace. As with *
+*  `pagetrace`, ALLOCTRACE names the output (default       *
+*  alloctrace.bin), a %p in it is replaced by the process  *
+*  id, and a forked child stops recording.                 *
+************************************************************/
+
+#define ATRACE_MAGIC "ATRC"
+#define ATRACE_VERSION 1
+#define ATRACE_HEADER_SIZE 16
+
+enum {A_MALLOC, A_CALLOC, A_REALLOC, A_FREE};
+
+// As `allocbench` reads it
+struct alloc_record {
+    uint64_t id;  // Block allocated, or freed by A_FREE
+    uint64_t old;  // Block a realloc replaces, 0 if none
+    uint64_t size;
+    uint32_t thread;  // Threads are numbered by their first call
+    uint32_t op;
+};
+
+#define RECORDS 4096
+
+struct slot {
+    uintptr_t addr;  // 0 if empty
+    uint64_t id;
+};
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *p, size_t size);
+extern void *__libc_memalign(size_t align, size_t size);
+extern void *__libc_valloc(size_t size);
+extern void *__libc_pvalloc(size_t size);
+extern void __libc_free(void *p);
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct slot *table;  // Open addressing with linear probing
+static size_t capacity, used;
+static struct alloc_record buf[RECORDS];
+static int n_buf;
+static uint64_t next_id = 1, written;
+static int fd = -1, started;
+static int n_threads;
+static __thread int my_thread __attribute__((tls_model("initial-exec"))) = -1;
+
+/***********************************************************
+*    Live blocks. Deleting shifts the rest of the probe    *
+*  run back, so the table needs no tombstones.             *
+************************************************************/
+static size_t hash(uintptr_t addr) {
+    return (addr >> 4) * 0x9E3779B97F4A7C15ULL >> 20;
+}
+
+static void put(uintptr_t addr, uint64_t id) {
+    size_t i;
+    if (2 * (used + 1) > capacity) {
+        size_t old = capacity, j;
+        struct slot *prev = table;
+        capacity = capacity ? 2 * capacity : 1 << 16;
+        table = __libc_calloc(capacity, sizeof(struct slot));
+        used = 0;
+        for (j = 0; j < old; ++j)
+            if (prev[j].addr) put(prev[j].addr, prev[j].id);
+        __libc_free(prev);
+    }
+    for (i = hash(addr) & (capacity - 1); table[i].addr && table[i].addr != addr; i = (i + 1) & (capacity - 1));
+    if (!table[i].addr) ++used;
+    table[i].addr = addr;
+    table[i].id = id;
+}
+
+// Remove an address, return its block or 0 if it was not recorded
+static uint64_t take(uintptr_t addr) {
+    size_t i, j, k;
+    uint64_t id;
+    if (capacity == 0) return 0;
+    for (i = hash(addr) & (capacity - 1); table[i].addr && table[i].addr != addr; i = (i + 1) & (capacity - 1));
+    if (!table[i].addr) return 0;
+    id = table[i].id;
+    for (j = (i + 1) & (capacity - 1); table[j].addr; j = (j + 1) & (capacity - 1)) {
+        k = hash(table[j].addr) & (capacity - 1);
+        // Move it back unless its home lies cyclically in (i, j]
+        if (i <= j ? (i < k && k <= j) : (i < k || k <= j)) continue;
+        table[i] = table[j];
+        i = j;
+    }
+    table[i].addr = 0;
+    --used;
+    return id;
+}
+
+/***********************************************************
+*    Recording, with `lock` held.                          *
+************************************************************/
+static void write_header() {
+    unsigned char head[ATRACE_HEADER_SIZE] = ATRACE_MAGIC;
+    int i;
+    head[4] = ATRACE_VERSION;
+    head[6] = sizeof(struct alloc_record);
+    for (i = 0; i < 8; ++i) head[8 + i] = written >> (8 * i);
+    if (pwrite(fd, head, ATRACE_HEADER_SIZE, 0) != ATRACE_HEADER_SIZE) fd = -1;
+}
+
+static void flush_records() {
+    size_t len = n_buf * sizeof(struct alloc_record);
+    if (fd >= 0 && n_buf > 0) {
+        if (pwrite(fd, buf, len, ATRACE_HEADER_SIZE + written * sizeof(struct alloc_record)) != (ssize_t)len) {
+            perror("alloctrace");
+            fd = -1;
+            return;
+        }
+        written += n_buf;
+        write_header();
+    }
+    n_buf = 0;
+}
+
+static void start() {
+    const char *env = getenv("ALLOCTRACE");
+    char path[4096];
+    size_t i, n = 0;
+    started = 1;
+    // The output path, with %p replaced by the process id
+    if (env == NULL) env = "alloctrace.bin";
+    for (i = 0; env[i] != 0 && n < sizeof(path) - 24; ++i)
+        if (env[i] == '%' && env[i + 1] == 'p') n += sprintf(path + n, "%d", (int)getpid()), ++i;
+        else path[n++] = env[i];
+    path[n] = 0;
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror(path);
+        return;
+    }
+    write_header();
+}
+
+static void record(int op, uint64_t id, uint64_t old, size_t size) {
+    struct alloc_record *r;
+    if (fd < 0) return;
+    if (my_thread < 0) my_thread = n_threads++;
+    r = &buf[n_buf++];
+    r->id = id;
+    r->old = old;
+    r->size = size;
+    r->thread = my_thread;
+    r->op = op;
+    if (n_buf == RECORDS) flush_records();
+}
+
+static void *on_alloc(int op, void *p, size_t size) {
+    if (p == NULL) return p;
+    pthread_mutex_lock(&lock);
+    if (!started) start();
+    if (fd >= 0) {
+        put((uintptr_t)p, next_id);
+        record(op, next_id++, 0, size);
+    }
+    pthread_mutex_unlock(&lock);
+    return p;
+}
+
+/***********************************************************
+*    The wrappers.                                         *
+************************************************************/
+void *malloc(size_t size) {
+    return on_alloc(A_MALLOC, __libc_malloc(size), size);
+}
+
+void *calloc(size_t n, size_t size) {
+    return on_alloc(A_CALLOC, __libc_calloc(n, size), n * size);
+}
+
+void free(void *p) {
+    if (p != NULL) {
+        pthread_mutex_lock(&lock);
+        uint64_t id = fd >= 0 ? take((uintptr_t)p) : 0;
+        if (id) record(A_FREE, id, 0, 0);
+        pthread_mutex_unlock(&lock);
+    }
+    __libc_free(p);
+}
+
+void *realloc(void *p, size_t size) {
+    uint64_t old;
+    void *q;
+    if (p == NULL) return malloc(size);
+    // Drop the block before glibc can hand its address out again
+    pthread_mutex_lock(&lock);
+    old = fd >= 0 ? take((uintptr_t)p) : 0;
+    pthread_mutex_unlock(&lock);
+    q = __libc_realloc(p, size);
+    pthread_mutex_lock(&lock);
+    if (q == NULL && size > 0) {
+    // It failed and `p` is still there
+        if (old && fd >= 0) put((uintptr_t)p, old);
+    }
+    else if (q == NULL) {
+        if (old) record(A_FREE, old, 0, 0);
+    }
+    else if (fd >= 0) {
+        put((uintptr_t)q, next_id);
+        record(A_REALLOC, next_id++, old, size);
+    }
+    pthread_mutex_unlock(&lock);
+    return q;
+}
+
+int posix_memalign(void **out, size_t align, size_t size) {
+    void *p;
+    if (align < sizeof(void *) || (align & (align - 1)) != 0) return EINVAL;
+    if ((p = on_alloc(A_MALLOC, __libc_memalign(align, size), size)) == NULL) return ENOMEM;
+    *out = p;
+    return 0;
+}
+
+void *aligned_alloc(size_t align, size_t size) {
+    return on_alloc(A_MALLOC, __libc_memalign(align, size), size);
+}
+
+void *memalign(size_t align, size_t size) {
+    return on_alloc(A_MALLOC, __libc_memalign(align, size), size);
+}
+
+void *valloc(size_t size) {
+    return on_alloc(A_MALLOC, __libc_valloc(size), size);
+}
+
+void *pvalloc(size_t size) {
+    return on_alloc(A_MALLOC, __libc_pvalloc(size), size);
+}
+
+/***********************************************************
+*    Start and stop.                                       *
+************************************************************/
+static void before_fork() {
+    pthread_mutex_lock(&lock);
+}
+
+static void after_fork_parent() {
+    pthread_mutex_unlock(&lock);
+}
+
+static void after_fork_child() {
+    fd = -1;
+    n_buf = 0;
+    pthread_mutex_unlock(&lock);
+}
+
+__attribute__((constructor)) static void alloctrace_init() {
+    pthread_mutex_lock(&lock);
+    if (!started) start();
+    pthread_mutex_unlock(&lock);
+    pthread_atfork(before_fork, after_fork_parent, after_fork_child);
+}
+
+__attribute__((destructor)) static void alloctrace_fini() {
+    pthread_mutex_lock(&lock);
+    flush_records();
+    if (fd >= 0) close(fd);
+    fd = -1;
+    pthread_mutex_unlock(&lock);
+}
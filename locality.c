@@ -1,26 +1,420 @@
 #include <stdio.h>
 #include <stdlib.h>
-#include <alloca.h>
-#include <malloc.h>
-#include <unistd.h>
-
-int a[10][10000], c[10005], b[10000][10], ans[10][10];
-
-
-int main() {
-    freopen("addresses_locality.txt", "w", stdout);
-    int cnt = 0;
-    for (int i = 0; i < 10; ++i) {
-        for (int j = 0; j < 10; ++j) {
-            for (int k = 0; k < 10000; ++k) {
-                int *x = (int*)sbrk(sizeof(int)), *y = (int*)sbrk(sizeof(int)), *z = (int*)sbrk(sizeof(int));
-                sbrk(256);
-                *x = (long long)(&a[i][k]) % 65536;  *y = (long long)(&b[k][j]) % 65536;  *z = (long long)(&ans[i][j]) % 65536;
-                cnt += 6;
-                printf("%d\n%d\n%d\n", *x % 65536, *y % 65536, *z % 65536);
-                printf("%lld\n%lld\n%lld\n", (long long)(x) % 65536, (long long)(y) % 65536, (long long)(z) % 65536);
-                if (cnt >= 10000) return 0;
+#include <string.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <math.h>
+#include <strings.h>
+
+/***********************************************************
+*    A synthetic trace generator for `vm`. Every pattern   *
+*  is a plain loop that hands addresses to `emit`, which   *
+*  packs them straight into a large output buffer, so the  *
+*  cost per address is a few instructions plus the random  *
+*  numbers the pattern draws. The same seed always gives   *
+*  the same trace.                                         *
+*                                                          *
+*    Patterns, over `footprint` bytes from `base`:         *
+*    seq      every element in turn, wrapping around       *
+*    stride   every `stride` bytes (a page by default)     *
+*    uniform  uniformly random elements                    *
+*    zipf     pages by a Zipf law of skew `skew`, hot      *
+*             pages first, a random element in the page    *
+*    loop     `seq` over the first `ws` bytes only, which  *
+*             defeats LRU once `ws` outgrows memory        *
+*    phase    uniform within a window of `ws` bytes that   *
+*             jumps elsewhere every `phase` accesses       *
+*    ijk, ikj, tiled                                       *
+*             C = A * B for N x N matrices of ints laid    *
+*             out row-major one after the other, with the  *
+*             loop order of the name; tiled is ikj on      *
+*             `tile` x `tile` blocks. The sum of the ijk   *
+*             inner loop stays in a register, so C[i][j]   *
+*             is written once, while ikj updates a row of  *
+*             C in every inner loop.                       *
+*  Matrix patterns repeat the product until `count` is     *
+*  reached, and by default stop after one.                 *
+************************************************************/
+
+#define ELEM 4  // Bytes per element, the matrices hold ints
+#define OUT_BUFFER (1 << 20)
+
+#define TRACE_MAGIC "VMTR"
+#define TRACE_VERSION 1
+#define TRACE_HEADER_SIZE 16
+#define TRACE_WRITES 1
+
+// The output trace, in the text or binary format `vm` reads
+struct out {
+    FILE *fp;
+    int binary, width;  // Binary records of `width` bytes, or text lines
+    uint64_t top;  // Write mark of a binary record
+    uint64_t left;  // Addresses still to emit
+    size_t len;
+    unsigned char buf[OUT_BUFFER];
+};
+
+void flush_out(struct out *o) {
+    if (fwrite(o->buf, 1, o->len, o->fp) != o->len) {
+        perror("write");
+        exit(1);
+    }
+    o->len = 0;
+}
+
+// Format one text line, out of the way of the binary path
+void emit_text(struct out *o, uint64_t addr, int write) {
+    unsigned char *p = o->buf + o->len;
+    char digits[20];
+    int n = 0;
+    if (write) *p++ = 'W', *p++ = ' ';
+    do digits[n++] = '0' + addr % 10; while ((addr /= 10) != 0);
+    while (n > 0) *p++ = digits[--n];
+    *p++ = '\n';
+    o->len = p - o->buf;
+}
+
+// Append one address, return 0 once the trace is complete
+static inline int emit(struct out *o, uint64_t addr, int write) {
+    if (o->width == 4) {
+        uint32_t v = addr | (write ? o->top : 0);
+        memcpy(o->buf + o->len, &v, 4);  // Little-endian host, as in `vm`
+        o->len += 4;
+    } else if (o->binary) {
+        uint64_t v = addr | (write ? o->top : 0);
+        int i;
+        for (i = 0; i < o->width; ++i) o->buf[o->len + i] = v >> (8 * i);
+        o->len += o->width;
+    } else emit_text(o, addr, write);
+    if (o->len > OUT_BUFFER - 32) flush_out(o);
+    return --o->left != 0;
+}
+
+/***********************************************************
+*    xoshiro256** (Blackman and Vigna), seeded through     *
+*  splitmix64 so any seed, 0 included, gives a good state. *
+************************************************************/
+uint64_t rng[4];
+
+uint64_t splitmix64(uint64_t *x) {
+    uint64_t z = (*x += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+void seed_rng(uint64_t seed) {
+    int i;
+    for (i = 0; i < 4; ++i) rng[i] = splitmix64(&seed);
+}
+
+static inline uint64_t rotl(uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+}
+
+static inline uint64_t next_rng() {
+    uint64_t result = rotl(rng[1] * 5, 7) * 9, t = rng[1] << 17;
+    rng[2] ^= rng[0];  rng[3] ^= rng[1];  rng[1] ^= rng[2];  rng[0] ^= rng[3];
+    rng[2] ^= t;
+    rng[3] = rotl(rng[3], 45);
+    return result;
+}
+
+// Uniform in [0, n), by a multiply instead of a division (Lemire)
+static inline uint64_t rand_below(uint64_t n) {
+    return (unsigned __int128)next_rng() * n >> 64;
+}
+
+static inline double rand_unit() {
+    return (next_rng() >> 11) * 0x1.0p-53;
+}
+
+/***********************************************************
+*    Zipf ranks in [1, n] with P(k) proportional to        *
+*  k^-skew, by rejection-inversion (Hoermann and Derflin-  *
+*  ger): O(1) per sample and no table, so the number of    *
+*  pages is not limited by memory.                         *
+************************************************************/
+struct zipf {
+    double skew, n, h_x1, h_n, s;
+};
+
+// log1p(x) / x and expm1(x) / x, with their limits at 0
+double helper1(double x) {
+    return fabs(x) > 1e-8 ? log1p(x) / x : 1 - x * (0.5 - x * (1.0 / 3 - 0.25 * x));
+}
+
+double helper2(double x) {
+    return fabs(x) > 1e-8 ? expm1(x) / x : 1 + x * 0.5 * (1 + x / 3 * (1 + 0.25 * x));
+}
+
+double zipf_h(const struct zipf *z, double x) {
+    return exp(-z->skew * log(x));
+}
+
+double zipf_hint(const struct zipf *z, double x) {
+    double lx = log(x);
+    return helper2((1 - z->skew) * lx) * lx;
+}
+
+double zipf_hint_inv(const struct zipf *z, double x) {
+    double t = x * (1 - z->skew);
+    if (t < -1) t = -1;
+    return exp(helper1(t) * x);
+}
+
+void zipf_init(struct zipf *z, uint64_t n, double skew) {
+    z->skew = skew;
+    z->n = n;
+    z->h_x1 = zipf_hint(z, 1.5) - 1;
+    z->h_n = zipf_hint(z, n + 0.5);
+    z->s = 2 - zipf_hint_inv(z, zipf_hint(z, 2.5) - zipf_h(z, 2));
+}
+
+uint64_t zipf_next(const struct zipf *z) {
+    for (;;) {
+        double u = z->h_n + rand_unit() * (z->h_x1 - z->h_n), x = zipf_hint_inv(z, u);
+        double k = floor(x + 0.5);
+        if (k < 1) k = 1;
+        else if (k > z->n) k = z->n;
+        if (k - x <= z->s || u >= zipf_hint(z, k + 0.5) - zipf_h(z, k)) return k;
+    }
+}
+
+/***********************************************************
+*    The generator's parameters. `write_cut` is the chance *
+*  that an access of a non-matrix pattern is a write,      *
+*  scaled to 2^64; 0 draws no random number at all.        *
+************************************************************/
+struct gen {
+    uint64_t base, footprint, page_size, stride, ws, phase, n, tile;
+    double skew;
+    uint64_t write_cut;
+};
+
+static inline int is_write(const struct gen *g) {
+    return g->write_cut && next_rng() < g->write_cut;
+}
+
+void gen_stride(struct gen *g, struct out *o) {
+    uint64_t off = 0, span = g->ws;  // `seq` and `stride` span the footprint, `loop` the working set
+    while (emit(o, g->base + off, is_write(g)))
+        if ((off += g->stride) >= span) off = 0;
+}
+
+void gen_uniform(struct gen *g, struct out *o) {
+    uint64_t elems = g->footprint / ELEM;
+    while (emit(o, g->base + rand_below(elems) * ELEM, is_write(g)));
+}
+
+void gen_zipf(struct gen *g, struct out *o) {
+    struct zipf z;
+    uint64_t elems = g->page_size / ELEM;
+    zipf_init(&z, g->footprint / g->page_size, g->skew);
+    while (emit(o, g->base + (zipf_next(&z) - 1) * g->page_size + rand_below(elems) * ELEM, is_write(g)));
+}
+
+void gen_phase(struct gen *g, struct out *o) {
+    uint64_t elems = g->ws / ELEM, windows = (g->footprint - g->ws) / g->page_size + 1, i;
+    for (;;) {
+        uint64_t start = g->base + rand_below(windows) * g->page_size;
+        for (i = 0; i < g->phase; ++i)
+            if (!emit(o, start + rand_below(elems) * ELEM, is_write(g))) return;
+    }
+}
+
+#define A(i, j) (a + ((i) * n + (j)) * ELEM)
+#define B(i, j) (b + ((i) * n + (j)) * ELEM)
+#define C(i, j) (c + ((i) * n + (j)) * ELEM)
+
+void gen_ijk(struct gen *g, struct out *o) {
+    uint64_t n = g->n, a = g->base, b = a + n * n * ELEM, c = b + n * n * ELEM, i, j, k;
+    for (;;)
+        for (i = 0; i < n; ++i)
+            for (j = 0; j < n; ++j) {
+                for (k = 0; k < n; ++k)
+                    if (!emit(o, A(i, k), 0) || !emit(o, B(k, j), 0)) return;
+                if (!emit(o, C(i, j), 1)) return;
             }
+}
+
+void gen_ikj(struct gen *g, struct out *o) {
+    uint64_t n = g->n, a = g->base, b = a + n * n * ELEM, c = b + n * n * ELEM, i, j, k;
+    for (;;)
+        for (i = 0; i < n; ++i)
+            for (k = 0; k < n; ++k) {
+                if (!emit(o, A(i, k), 0)) return;
+                for (j = 0; j < n; ++j)
+                    if (!emit(o, B(k, j), 0) || !emit(o, C(i, j), 1)) return;
+            }
+}
+
+void gen_tiled(struct gen *g, struct out *o) {
+    uint64_t n = g->n, t = g->tile, a = g->base, b = a + n * n * ELEM, c = b + n * n * ELEM;
+    uint64_t ii, kk, jj, i, j, k;
+    for (;;)
+        for (ii = 0; ii < n; ii += t)
+            for (kk = 0; kk < n; kk += t)
+                for (jj = 0; jj < n; jj += t)
+                    for (i = ii; i < ii + t && i < n; ++i)
+                        for (k = kk; k < kk + t && k < n; ++k) {
+                            if (!emit(o, A(i, k), 0)) return;
+                            for (j = jj; j < jj + t && j < n; ++j)
+                                if (!emit(o, B(k, j), 0) || !emit(o, C(i, j), 1)) return;
+                        }
+}
+
+struct pattern {
+    const char *name;
+    void (*run)(struct gen *g, struct out *o);
+    int matrix;
+};
+
+const struct pattern patterns[] = {
+    {"seq", gen_stride, 0},
+    {"stride", gen_stride, 0},
+    {"uniform", gen_uniform, 0},
+    {"zipf", gen_zipf, 0},
+    {"loop", gen_stride, 0},
+    {"phase", gen_phase, 0},
+    {"ijk", gen_ijk, 1},
+    {"ikj", gen_ikj, 1},
+    {"tiled", gen_tiled, 1},
+};
+
+uint64_t parse_size(const char *arg) {
+    char *end;
+    uint64_t v = strtoull(arg, &end, 0);
+    if (*end == 'k' || *end == 'K') v <<= 10;
+    else if (*end == 'm' || *end == 'M') v <<= 20;
+    else if (*end == 'g' || *end == 'G') v <<= 30;
+    return v;
+}
+
+void usage() {
+    printf("usage:./loc -p pattern [-n count] [-s seed] [-f text|binary] [-w record_width] output|-\n");
+    printf("      patterns: seq, stride, uniform, zipf, loop, phase, ijk, ikj, tiled\n");
+    printf("      address space: --va-bits bits (default 16), --page-size bytes (default 256),\n");
+    printf("                     --base bytes (default 0), --footprint bytes (default the rest of it)\n");
+    printf("      --stride bytes (default a page), --skew s (zipf, default 0.99),\n");
+    printf("      --ws bytes (loop and phase, default a quarter of the footprint),\n");
+    printf("      --phase n (accesses per phase, default 100000), --writes fraction (default 0)\n");
+    printf("      -N n (matrix size, default 64), --tile t (default 16)\n");
+    printf("      count defaults to 1000000, or one matrix product; output ending in .bin is binary\n");
+}
+
+int main(int argc, char *argv[]) {
+    int opt, va_bits = 16, binary = -1, width = 0, i;
+    uint64_t count = 0, seed = 1;
+    double writes = 0;
+    const struct pattern *pat = NULL;
+    struct gen g = {0, 0, 256, 0, 0, 100000, 64, 16, 0.99, 0};
+    struct option long_opts[] = {
+        {"pattern", required_argument, 0, 'p'},
+        {"count", required_argument, 0, 'n'},
+        {"seed", required_argument, 0, 's'},
+        {"format", required_argument, 0, 'f'},
+        {"va-bits", required_argument, 0, 'V'},
+        {"page-size", required_argument, 0, 'G'},
+        {"base", required_argument, 0, 'b'},
+        {"footprint", required_argument, 0, 'F'},
+        {"stride", required_argument, 0, 'k'},
+        {"skew", required_argument, 0, 'z'},
+        {"ws", required_argument, 0, 'W'},
+        {"phase", required_argument, 0, 'P'},
+        {"writes", required_argument, 0, 'r'},
+        {"tile", required_argument, 0, 'T'},
+        {0, 0, 0, 0}
+    };
+    while ((opt = getopt_long(argc, argv, "p:n:s:f:w:N:", long_opts, NULL)) != -1) {
+        if (opt == 'p') {
+            for (i = 0; i < sizeof(patterns) / sizeof(patterns[0]); ++i)
+                if (strcasecmp(optarg, patterns[i].name) == 0) pat = &patterns[i];
+        }
+        else if (opt == 'n') count = parse_size(optarg);
+        else if (opt == 's') seed = strtoull(optarg, NULL, 0);
+        else if (opt == 'f') binary = strcasecmp(optarg, "binary") == 0 ? 1 : strcasecmp(optarg, "text") == 0 ? 0 : -2;
+        else if (opt == 'w') width = atoi(optarg);
+        else if (opt == 'N') g.n = strtoull(optarg, NULL, 0);
+        else if (opt == 'V') va_bits = atoi(optarg);
+        else if (opt == 'G') g.page_size = parse_size(optarg);
+        else if (opt == 'b') g.base = parse_size(optarg);
+        else if (opt == 'F') g.footprint = parse_size(optarg);
+        else if (opt == 'k') g.stride = parse_size(optarg);
+        else if (opt == 'z') g.skew = atof(optarg);
+        else if (opt == 'W') g.ws = parse_size(optarg);
+        else if (opt == 'P') g.phase = strtoull(optarg, NULL, 0);
+        else if (opt == 'r') writes = atof(optarg);
+        else if (opt == 'T') g.tile = strtoull(optarg, NULL, 0);
+        else {
+            usage();
+            return 1;
         }
     }
+    if (pat == NULL || optind != argc - 1 || binary == -2) {
+        usage();
+        return 1;
+    }
+
+// Fill in the defaults and check that everything fits the address space
+    uint64_t space = va_bits >= 63 ? 1ULL << 63 : 1ULL << va_bits;
+    if (va_bits < 8 || va_bits > 63 || g.page_size < ELEM || (g.page_size & (g.page_size - 1))
+        || g.base >= space) {
+        printf("Invalid address space, page size or base!\n");
+        return 1;
+    }
+    if (g.footprint == 0) g.footprint = space - g.base;
+    if (g.stride == 0) g.stride = strcmp(pat->name, "stride") == 0 ? g.page_size : ELEM;
+    if (strcmp(pat->name, "loop") != 0 && strcmp(pat->name, "phase") != 0) g.ws = g.footprint;
+    else if (g.ws == 0) g.ws = g.footprint / 4;
+    if (pat->matrix) g.footprint = g.ws = 3 * g.n * g.n * ELEM;
+    if (g.footprint > space - g.base || g.footprint < g.page_size || g.ws < ELEM || g.ws > g.footprint
+        || g.phase < 1 || g.n < 1 || g.tile < 1 || g.skew <= 0 || writes < 0 || writes > 1) {
+        printf("The pattern does not fit: footprint, working set, matrices, skew or writes out of range\n");
+        return 1;
+    }
+// One product reads A once per inner loop and B and C in it; tiled ikj rereads A once per column tile
+    if (count == 0 && pat->matrix)
+        count = (2 * g.n + (strcmp(pat->name, "tiled") == 0 ? (g.n + g.tile - 1) / g.tile : 1)) * g.n * g.n;
+    else if (count == 0) count = 1000000;
+    g.write_cut = writes >= 1 ? UINT64_MAX : (uint64_t)(writes * 18446744073709551616.0);
+    int has_writes = pat->matrix || writes > 0;
+
+    struct out *o = calloc(1, sizeof(struct out));
+    const char *path = argv[optind];
+    size_t plen = strlen(path);
+    o->binary = binary >= 0 ? binary : plen > 4 && strcmp(path + plen - 4, ".bin") == 0;
+    o->fp = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+    if (o->fp == NULL) {
+        perror(path);
+        return 1;
+    }
+    o->left = count;
+    if (o->binary) {
+    // The narrowest record that holds every address, and the write mark above it
+        int bits = va_bits + has_writes;
+        if (width == 0) width = bits <= 8 ? 1 : bits <= 16 ? 2 : bits <= 32 ? 4 : 8;
+        if ((width != 1 && width != 2 && width != 4 && width != 8) || 8 * width < bits) {
+            printf("Records of %d bytes cannot hold %d-bit addresses%s\n", width, va_bits,
+                has_writes ? " and a write mark" : "");
+            return 1;
+        }
+        o->width = width;
+        o->top = has_writes ? 1ULL << (8 * width - 1) : 0;
+        unsigned char head[TRACE_HEADER_SIZE] = TRACE_MAGIC;
+        head[4] = TRACE_VERSION;
+        head[6] = width;
+        head[7] = has_writes ? TRACE_WRITES : 0;
+        for (i = 0; i < 8; ++i) head[8 + i] = count >> (8 * i);
+        memcpy(o->buf, head, TRACE_HEADER_SIZE);
+        o->len = TRACE_HEADER_SIZE;
+    }
+    seed_rng(seed);
+    pat->run(&g, o);
+    flush_out(o);
+    if (o->fp != stdout && fclose(o->fp) != 0) {
+        perror(path);
+        return 1;
+    }
+    return 0;
 }
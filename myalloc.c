@@ -1,7 +1,23 @@
+#define _GNU_SOURCE
 #include <unistd.h>
 #include <sys/types.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "myalloc.h"
+
+/* Diagnostics, and the demo in `main`, are compiled in only with
+ * -DMYALLOC_DEBUG, so a normal build is a library that prints nothing.
+ */
+#ifdef MYALLOC_DEBUG
+#define debug(...) printf(__VA_ARGS__)
+#else
+#define debug(...) ((void)0)
+#endif
 
 struct control_block {
     int free;  // Free flag
@@ -9,79 +25,630 @@ struct control_block {
     void *prev;  // Previous block
 };
 
-// Start and end of heap address
-void *start, *end;
-// Address of last control block
-void *tail;
+// Links of a free block, kept in its body right after the control block
+struct free_links {
+    struct control_block *next, *prev;
+};
+#define LINKS(cb) ((struct free_links *)((void *)(cb) + sizeof(struct control_block)))
+
+/* Free blocks are kept in segregated lists by size. Up to SMALL_MAX
+ * bytes every multiple of 16 has a class of its own, so any block on
+ * the list fits exactly; above it a class holds the sizes up to the
+ * next power of two. `nonempty` has a bit for each class with free
+ * blocks, so allocation finds a list with a bit scan, never walking
+ * the heap.
+ */
+#define ALIGN 16
+#define MIN_BLOCK (sizeof(struct control_block) + sizeof(struct free_links))
+#define SMALL_MAX 512
+#define LAST_EXACT (SMALL_MAX / ALIGN)
+#define N_CLASSES (LAST_EXACT + 32 - 9)
+
+/* An arena is a heap with its own free lists and lock. The main arena
+ * is the brk heap; the others are carved from mmap regions of
+ * ARENA_SIZE, aligned to their size and with the arena at the start,
+ * so a block finds its arena by masking its address. Threads are
+ * dealt out to the arenas in turn, up to two per processor, so they
+ * rarely share a lock.
+ */
+#define ARENA_SIZE (1ULL << 30)
+#define MAX_ARENAS 64
+
+struct arena {
+    pthread_mutex_t lock;
+    // Start and end of heap address, and the end of its region
+    void *start, *end, *limit;
+    // Address of last control block
+    void *tail;
+    void *fresh;  // Everything from here to the end of its region is still zero
+    struct control_block *bins[N_CLASSES];
+    uint64_t nonempty;
+    struct control_block *remote;  // Blocks freed by threads of other arenas
+};
+
+struct arena main_arena = {PTHREAD_MUTEX_INITIALIZER};
 int init = 0;
+struct arena *arenas[MAX_ARENAS] = {&main_arena};
+struct arena *spill;  // Grows in place of the main arena once another allocator has taken the break
+int n_arenas, next_arena;
+pthread_mutex_t arenas_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void *st() {return __atomic_load_n(&main_arena.start, __ATOMIC_RELAXED);}
+void *en() {return __atomic_load_n(&main_arena.end, __ATOMIC_RELAXED);}
+
+// Bytes taken from the system by `grow` and `map_block`, and their peak
+size_t heap_bytes, peak_heap_bytes;
+
+void account(long delta) {
+    size_t now = __atomic_add_fetch(&heap_bytes, delta, __ATOMIC_RELAXED);
+    size_t peak = __atomic_load_n(&peak_heap_bytes, __ATOMIC_RELAXED);
+    while (now > peak && !__atomic_compare_exchange_n(&peak_heap_bytes, &peak, now, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+void heap_stats(size_t *size, size_t *peak) {
+    *size = __atomic_load_n(&heap_bytes, __ATOMIC_RELAXED);
+    *peak = __atomic_load_n(&peak_heap_bytes, __ATOMIC_RELAXED);
+}
+
+void reset_peak() {__atomic_store_n(&peak_heap_bytes, __atomic_load_n(&heap_bytes, __ATOMIC_RELAXED), __ATOMIC_RELAXED);}
+
+/* Every thread caches up to TCACHE_MAX freed blocks of each exact
+ * class of its own arena, and takes and returns them without a lock.
+ * Cached blocks still count as used, so the arena does not merge
+ * them. Blocks of other arenas are pushed on their arena's `remote`
+ * stack with a compare-and-swap, and the arena frees them the next
+ * time its lock is taken.
+ */
+#define TCACHE_MAX 16
+// Initial-exec, so that a preloaded copy never allocates to find them
+__thread struct arena *my_arena __attribute__((tls_model("initial-exec")));
+__thread struct control_block *tcache[LAST_EXACT + 1] __attribute__((tls_model("initial-exec")));
+__thread int tcache_count[LAST_EXACT + 1] __attribute__((tls_model("initial-exec")));
+pthread_key_t tcache_key;
+pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+
+int size_class(unsigned size) {
+    if (size <= SMALL_MAX) return size / ALIGN;
+// (512, 1024] is the first class after the exact ones
+    return LAST_EXACT + (32 - __builtin_clz(size - 1)) - 9;
+}
+
+void push_free(struct arena *a, struct control_block *cb) {
+    int c = size_class(cb -> size);
+    LINKS(cb) -> prev = NULL;
+    LINKS(cb) -> next = a -> bins[c];
+    if (a -> bins[c] != NULL) LINKS(a -> bins[c]) -> prev = cb;
+    a -> bins[c] = cb;
+    a -> nonempty |= 1ULL << c;
+}
+
+void unlink_free(struct arena *a, struct control_block *cb) {
+    int c = size_class(cb -> size);
+    struct free_links *l = LINKS(cb);
+    if (l -> prev != NULL) LINKS(l -> prev) -> next = l -> next;
+    else a -> bins[c] = l -> next;
+    if (l -> next != NULL) LINKS(l -> next) -> prev = l -> prev;
+    if (a -> bins[c] == NULL) a -> nonempty &= ~(1ULL << c);
+}
+
+// Cut what a block has beyond `size` bytes off as a free block of its own
+void split(struct arena *a, struct control_block *cb, unsigned size) {
+    if (cb -> size - size < MIN_BLOCK) return;
+    struct control_block *rest = (struct control_block *)((void *)cb + size);
+    rest -> free = 1;
+    rest -> size = cb -> size - size;
+    rest -> prev = cb;
+    cb -> size = size;
+    if (a -> tail == cb) a -> tail = rest;
+    else ((struct control_block *)((void *)rest + rest -> size)) -> prev = rest;
+    push_free(a, rest);
+}
+
+// A free block of at least `size` bytes, taken off its list, or NULL
+struct control_block *take_free(struct arena *a, unsigned size) {
+    int c = size_class(size);
+    uint64_t fits;
+// Blocks of a power-of-two class may be too small, only its first is tried
+    if (c > LAST_EXACT && a -> bins[c] != NULL && a -> bins[c] -> size >= size) {
+        struct control_block *cb = a -> bins[c];
+        unlink_free(a, cb);
+        return cb;
+    }
+    fits = a -> nonempty & (~0ULL << (c > LAST_EXACT ? c + 1 : c));
+    if (fits == 0) return NULL;
+    struct control_block *cb = a -> bins[__builtin_ctzll(fits)];
+    unlink_free(a, cb);
+    return cb;
+}
+
+/* Requests of at least `mmap_threshold` bytes get a mapping of their
+ * own, returned by `myfree` with munmap, so large buffers never
+ * fragment the brk heap. Such blocks are marked MAPPED, and their
+ * `prev` is the start of the mapping, which is the block itself
+ * unless it was placed further in for alignment.
+ */
+#define MAPPED 2
+unsigned mmap_threshold = 128 * 1024;
+
+void set_mmap_threshold(unsigned n_bytes) {mmap_threshold = n_bytes;}
+
+// Pages of free runs this large are handed back with madvise, and a free
+// top this large is cut off the heap, so a heap that grows and shrinks
+// by a few blocks does not ask the system every time
+#define TRIM_THRESHOLD (64 * 1024)
+
+void *map_block(unsigned tot_size) {
+    long page = sysconf(_SC_PAGESIZE);
+// `size` is an int, it must still hold the size rounded to pages
+    if (tot_size > INT_MAX - page + 1) return NULL;
+    tot_size = (tot_size + page - 1) & ~(page - 1);
+    struct control_block *cb = mmap(NULL, tot_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (cb == MAP_FAILED) return NULL;
+    cb -> free = MAPPED;
+    cb -> size = tot_size;
+    cb -> prev = cb;
+    account(tot_size);
+    return cb;
+}
 
-void *st() {return start;}
-void *en() {return end;}
+// The block after `cb` in the heap, or NULL for the tail
+struct control_block *next_block(struct arena *a, struct control_block *cb) {
+    return cb == a -> tail ? NULL : (struct control_block *)((void *)cb + cb -> size);
+}
+
+// Merge free block `next` into `cb` right before it
+void absorb(struct arena *a, struct control_block *cb, struct control_block *next) {
+    struct control_block *after = next_block(a, next);
+    cb -> size += next -> size;
+    if (after == NULL) a -> tail = cb;
+    else after -> prev = cb;
+}
+
+uintptr_t page_up(uintptr_t addr) {
+    long page = sysconf(_SC_PAGESIZE);
+    return (addr + page - 1) & ~(page - 1);
+}
+
+// Give the whole pages of [lo, hi) back
+void discard(uintptr_t lo, uintptr_t hi) {
+    long page = sysconf(_SC_PAGESIZE);
+    lo = page_up(lo);
+    hi &= ~(page - 1);
+    if (hi > lo) madvise((void *)lo, hi - lo, MADV_DONTNEED);
+}
+
+// Give the pages of a free block's body that [lo, hi) touches back, keeping its links
+void trim(struct control_block *cb, uintptr_t lo, uintptr_t hi) {
+    long page = sysconf(_SC_PAGESIZE);
+    uintptr_t body = (uintptr_t)cb + MIN_BLOCK, end = (uintptr_t)cb + cb -> size;
+    lo &= ~(page - 1);
+    hi = (hi + page - 1) & ~(page - 1);
+    discard(lo > body ? lo : body, hi < end ? hi : end);
+}
+
+// A new arena at the start of an aligned region, or NULL
+struct arena *new_arena() {
+    void *region = mmap(NULL, 2 * ARENA_SIZE, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (region == MAP_FAILED) return NULL;
+// Keep the aligned half
+    uintptr_t lo = ((uintptr_t)region + ARENA_SIZE - 1) & ~(ARENA_SIZE - 1);
+    if (lo > (uintptr_t)region) munmap(region, lo - (uintptr_t)region);
+    if (lo + ARENA_SIZE < (uintptr_t)region + 2 * ARENA_SIZE)
+        munmap((void *)(lo + ARENA_SIZE), (uintptr_t)region + ARENA_SIZE - lo);
+    struct arena *a = (struct arena *)lo;
+    pthread_mutex_init(&a -> lock, NULL);
+    a -> start = a -> end = a -> fresh = (void *)lo + ((sizeof(struct arena) + ALIGN - 1) & ~(ALIGN - 1));
+    a -> limit = (void *)lo + ARENA_SIZE;
+    return a;
+}
+
+/* The main arena's bounds are read without its lock, so `grow` and
+ * `shrink` store them atomically. A stale bound cannot misroute a live
+ * block: it lies below the end that was stored before it was handed
+ * out, and the end only comes down over free blocks at the top.
+ */
+struct arena *arena_of(struct control_block *cb) {
+    void *start = __atomic_load_n(&main_arena.start, __ATOMIC_RELAXED), *end = __atomic_load_n(&main_arena.end, __ATOMIC_RELAXED);
+    if ((void *)cb >= start && (void *)cb < end) return &main_arena;
+    return (struct arena *)((uintptr_t)cb & ~(ARENA_SIZE - 1));
+}
+
+/* New memory is zero as the system hands it out, so `fresh` follows
+ * how far an arena has ever been written. It comes down when the top
+ * is given back, to the page boundary above the end, and `grow` tells
+ * its caller where the zero part of the new space starts, so `mycalloc`
+ * clears only what has been used before.
+ */
 
-void *myalloc(unsigned n_bytes) {
+// Extend an arena by `size` bytes, return the new space or NULL, and where it is zero from in `clean`
+void *grow(struct arena *a, unsigned size, void **clean) {
+    void *p = a -> end;
+    if (a != &main_arena) {
+        if (a -> limit - a -> end < size) return NULL;
+    }
+    else {
 // Init if it hasn't
-    if (init == 0) {start = end = sbrk(0);  printf("Init %p\n", start);  init = 1;}
-    void *curr = start, *alloc_address = NULL;
-    struct control_block *curr_block;
-// Compute total size of the block
-    unsigned tot_size = n_bytes + sizeof(struct control_block);
-// Align to 16 bytes
-    tot_size += 16 - (tot_size % 16);
-// Find the first free block which is big enough
-    while (curr != end) {
-        curr_block = (struct control_block *)curr;
-        if (curr_block -> free == 1 && curr_block -> size >= tot_size) {
-            curr_block -> free = 0;
-            alloc_address = curr;
-            break;
+        if (init == 0) {
+            p = sbrk(0);
+            __atomic_store_n(&a -> start, p, __ATOMIC_RELAXED);
+            __atomic_store_n(&a -> end, p, __ATOMIC_RELAXED);
+            a -> fresh = (void *)page_up((uintptr_t)p);
+            debug("Init %p\n", a -> start);
+            init = 1;
         }
-        curr = curr + curr_block -> size;
+        void *got = sbrk(size);
+        if (got == (void*) - 1) return NULL;
+// Someone else has moved the break, the heap would not be contiguous
+        if (got != p) {sbrk(-(intptr_t)size);  return NULL;}
     }
-// Allocate heap address if don't find
-    if (alloc_address == NULL) {
-        if (sbrk(tot_size) == (void*) - 1) return NULL;
-        alloc_address = end;
-        curr_block = (struct control_block *)alloc_address;
+    __atomic_store_n(&a -> end, a -> end + size, __ATOMIC_RELAXED);
+    account(size);
+    if (clean != NULL) *clean = p > a -> fresh ? p : a -> fresh;
+    if (a -> fresh < a -> end) a -> fresh = a -> end;
+    return p;
+}
+
+// Give the top `size` bytes of an arena back, unless someone else has moved the break above them
+int shrink(struct arena *a, unsigned size) {
+    if (a == &main_arena) {
+        if (sbrk(0) != a -> end) return 0;
+        sbrk(-(intptr_t)size);
+    }
+// The page the old end fell in is dropped too, or its dirty start would
+// lie above the new `fresh`
+    else discard((uintptr_t)a -> end - size, page_up((uintptr_t)a -> end));
+    __atomic_store_n(&a -> end, a -> end - size, __ATOMIC_RELAXED);
+    if ((uintptr_t)a -> fresh > page_up((uintptr_t)a -> end)) a -> fresh = (void *)page_up((uintptr_t)a -> end);
+    account(-(long)size);
+    return 1;
+}
+
+/* The `prev` of a control block and its size are the boundary tags of
+ * both neighbors, so a freed block merges with free blocks on either
+ * side in O(1), and no two free blocks are ever adjacent.
+ */
+void arena_free(struct arena *a, struct control_block *cb) {
+// Only the pages of the block itself are trimmed, the rest of a run was when it was freed
+    uintptr_t lo = (uintptr_t)cb, hi = lo + cb -> size;
+// Free the block
+    cb -> free = 1;
+    struct control_block *next = next_block(a, cb), *prev = cb -> prev;
+    if (next != NULL && next -> free == 1) {
+        unlink_free(a, next);
+        absorb(a, cb, next);
+    }
+    if (prev != NULL && prev -> free == 1) {
+        unlink_free(a, prev);
+        absorb(a, prev, cb);
+        cb = prev;
+    }
+    debug("\tend: %p, cb: %p-%p\n", a -> end, cb, (struct control_block *)((long long)cb + cb -> size));
+// If top of the heap is free and long enough, shrink the space of the heap
+    void *below = cb -> prev;
+    if (cb == a -> tail && cb -> size >= TRIM_THRESHOLD && shrink(a, cb -> size)) {
+// The pages of `cb` are gone, its `prev` was read before
+        a -> tail = below;
+        debug("\ttail: %p, end: %p\n", a -> tail, a -> end);
+    }
+    else {
+        if (cb -> size >= TRIM_THRESHOLD) trim(cb, lo, hi);
+        push_free(a, cb);
+    }
+}
+
+// Give what a used block has beyond `size` bytes back to its arena, with the lock held
+void cut(struct arena *a, struct control_block *cb, unsigned size) {
+    if (cb -> size - size < MIN_BLOCK) return;
+    struct control_block *rest = (struct control_block *)((void *)cb + size);
+    rest -> size = cb -> size - size;
+    rest -> prev = cb;
+    cb -> size = size;
+    if (a -> tail == cb) a -> tail = rest;
+    else ((struct control_block *)((void *)rest + rest -> size)) -> prev = rest;
+// Unlike `split`, merge it with a free block after it
+    arena_free(a, rest);
+}
+
+// Free the blocks other threads have left on the remote stack
+void drain_remote(struct arena *a) {
+    struct control_block *cb = __atomic_exchange_n(&a -> remote, NULL, __ATOMIC_ACQUIRE), *next;
+    for (; cb != NULL; cb = next) {
+        next = LINKS(cb) -> next;
+        arena_free(a, cb);
+    }
+}
+
+// Allocate a block of `tot_size` bytes from an arena, with its lock held, and say where it is zero from in `clean`
+struct control_block *arena_alloc(struct arena *a, unsigned tot_size, void **clean) {
+    struct control_block *curr_block;
+    if (__atomic_load_n(&a -> remote, __ATOMIC_RELAXED) != NULL) drain_remote(a);
+// Take a free block from the size classes, leaving what it has to spare
+    if ((curr_block = take_free(a, tot_size)) != NULL) {
         curr_block -> free = 0;
-        curr_block -> size = tot_size;
-        curr_block -> prev = tail;
-        tail = curr_block;
-        end += tot_size;
+        split(a, curr_block, tot_size);
+        *clean = (void *)curr_block + curr_block -> size;
+        return curr_block;
+    }
+// Allocate heap address if don't find
+    if ((curr_block = grow(a, tot_size, clean)) == NULL) return NULL;
+    curr_block -> free = 0;
+    curr_block -> size = tot_size;
+    curr_block -> prev = a -> tail;
+    a -> tail = curr_block;
+    return curr_block;
+}
+
+// Return the blocks the calling thread has cached to its arena
+void flush_cache() {
+    struct arena *a = my_arena;
+    struct control_block *cb;
+    int c;
+    if (a == NULL) return;
+    pthread_mutex_lock(&a -> lock);
+    for (c = 0; c <= LAST_EXACT; ++c)
+        for (; (cb = tcache[c]) != NULL; --tcache_count[c]) {
+            tcache[c] = LINKS(cb) -> next;
+            arena_free(a, cb);
+        }
+    pthread_mutex_unlock(&a -> lock);
+}
+
+void flush_at_exit(void *arg) {flush_cache();}
+
+void make_key() {
+    n_arenas = 2 * sysconf(_SC_NPROCESSORS_ONLN);
+    if (n_arenas > MAX_ARENAS) n_arenas = MAX_ARENAS;
+    if (n_arenas < 1) n_arenas = 1;
+    pthread_key_create(&tcache_key, flush_at_exit);
+}
+
+// The arena that takes over the growth of the main arena, or NULL
+struct arena *spill_arena() {
+    if (spill == NULL) {
+        pthread_mutex_lock(&arenas_lock);
+        if (spill == NULL) spill = new_arena();
+        pthread_mutex_unlock(&arenas_lock);
     }
+    return spill;
+}
+
+// The arena of the calling thread, the first thread gets the main arena
+struct arena *thread_arena() {
+    if (my_arena != NULL) return my_arena;
+    pthread_once(&tcache_once, make_key);
+    int i = __atomic_fetch_add(&next_arena, 1, __ATOMIC_RELAXED) % n_arenas;
+    pthread_mutex_lock(&arenas_lock);
+    if (arenas[i] == NULL) arenas[i] = new_arena();
+    my_arena = arenas[i] != NULL ? arenas[i] : &main_arena;
+    pthread_mutex_unlock(&arenas_lock);
+// Its destructor flushes the cache when the thread exits
+    pthread_setspecific(tcache_key, my_arena);
+    return my_arena;
+}
+
+// Size of the block for `n_bytes`, with its control block, aligned and long enough to be freed
+unsigned block_size(unsigned n_bytes) {
+    unsigned tot_size = (n_bytes + sizeof(struct control_block) + ALIGN - 1) & ~(ALIGN - 1);
+    return tot_size < MIN_BLOCK ? MIN_BLOCK : tot_size;
+}
+
+// `size` is an int
+#define MAX_BYTES (INT_MAX - 2 * ALIGN - sizeof(struct control_block))
+
+// Allocate `n_bytes`, cleared if `zero`
+void *allocate(unsigned n_bytes, int zero) {
+    struct control_block *curr_block;
+    void *clean, *body;  // The block is known to be zero from `clean` on
+    if (n_bytes > MAX_BYTES) return NULL;
+    unsigned tot_size = block_size(n_bytes);
+    struct arena *a = thread_arena();
+    int c = size_class(tot_size);
+    if (n_bytes >= mmap_threshold) {
+        curr_block = map_block(tot_size);
+        clean = curr_block;
+    }
+    else if (c <= LAST_EXACT && tcache[c] != NULL) {
+        curr_block = tcache[c];
+        tcache[c] = LINKS(curr_block) -> next;
+        --tcache_count[c];
+        clean = (void *)curr_block + curr_block -> size;
+    }
+    else {
+        pthread_mutex_lock(&a -> lock);
+        curr_block = arena_alloc(a, tot_size, &clean);
+        pthread_mutex_unlock(&a -> lock);
+// The break is taken, its blocks come back to the spill arena as remote frees
+        if (curr_block == NULL && a == &main_arena && (a = spill_arena()) != NULL) {
+            pthread_mutex_lock(&a -> lock);
+            curr_block = arena_alloc(a, tot_size, &clean);
+            pthread_mutex_unlock(&a -> lock);
+        }
+// The region is full
+        if (curr_block == NULL) {
+            curr_block = map_block(tot_size);
+            clean = curr_block;
+        }
+    }
+    if (curr_block == NULL) return NULL;
 // Return address of first byte
-    printf("Allocate: %p-%p, prev: %p\n", (struct control_block *)alloc_address, alloc_address + ((struct control_block *)alloc_address) -> size, ((struct control_block *)alloc_address) -> prev);
-    alloc_address += sizeof(struct control_block);
-    return alloc_address;
+    debug("Allocate: %p-%p, prev: %p\n", curr_block, (void *)curr_block + curr_block -> size, curr_block -> prev);
+    body = (void *)curr_block + sizeof(struct control_block);
+    if (zero && clean > body) memset(body, 0, (clean < body + n_bytes ? clean : body + n_bytes) - body);
+    return body;
+}
+
+void *myalloc(unsigned n_bytes) {return allocate(n_bytes, 0);}
+
+void *mycalloc(size_t n, size_t size) {
+    size_t n_bytes;
+    if (__builtin_mul_overflow(n, size, &n_bytes) || n_bytes > MAX_BYTES) return NULL;
+    return allocate(n_bytes, 1);
 }
 
 void myfree(void *p) {
-    printf("Free starts.\n");
-    if (p == NULL || p < start + sizeof(struct control_block) || p > end + sizeof(struct control_block)) return;
+    debug("Free starts.\n");
+    if (p == NULL) return;
 // Recover the address of control block
     struct control_block *cb = (struct control_block *)(p - sizeof(struct control_block));
-// Free the block
-    cb -> free = 1;
-    printf("\tend: %p, cb + size: %p\n", end, (struct control_block *)((long long)cb + cb -> size));
-// If top of the heap is free, shrink the space of the heap
-    if (cb == tail) {
-        while (cb != NULL && cb -> free == 1) {
-            int s = cb -> size;
-            printf("\tFree %p-%p\n", cb, (long long)cb + cb -> size);
-            tail = cb -> prev;
-            cb = cb -> prev;
-            sbrk(-s);
-            end = end - s;
-            printf("\ttail: %p, end: %p", tail, end);
-            if (cb != NULL) printf(", free: %d", cb -> free);
-            printf("\n");
-        }
+    if (cb -> free == MAPPED) {
+        size_t len = (void *)cb + cb -> size - cb -> prev;
+        debug("\tUnmap %p-%p\n", cb -> prev, (void *)cb + cb -> size);
+        account(-(long)len);
+        munmap(cb -> prev, len);
+        debug("Free Ends.\n");
+        return;
     }
-    printf("Free Ends.\n");
+// A thread that has not allocated yet has no arena, and every block is remote to it
+    struct arena *a = arena_of(cb);
+    int c = size_class(cb -> size);
+    if (a != my_arena) {
+        struct control_block *head = __atomic_load_n(&a -> remote, __ATOMIC_RELAXED);
+        do LINKS(cb) -> next = head;
+        while (!__atomic_compare_exchange_n(&a -> remote, &head, cb, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+    else if (c <= LAST_EXACT && tcache_count[c] < TCACHE_MAX) {
+        LINKS(cb) -> next = tcache[c];
+        tcache[c] = cb;
+        ++tcache_count[c];
+    }
+    else {
+        pthread_mutex_lock(&a -> lock);
+        if (__atomic_load_n(&a -> remote, __ATOMIC_RELAXED) != NULL) drain_remote(a);
+        arena_free(a, cb);
+        pthread_mutex_unlock(&a -> lock);
+    }
+    debug("Free Ends.\n");
     return;
 }
 
+// Bytes the block of `p` can hold
+unsigned myusable(void *p) {
+    if (p == NULL) return 0;
+    return ((struct control_block *)(p - sizeof(struct control_block))) -> size - sizeof(struct control_block);
+}
+
+/* A block grows in place into the free block after it, or by growing
+ * the arena when it is the tail, and shrinks by giving its end back;
+ * a mapped block is moved with mremap, which remaps its pages without
+ * copying them. Only when none of these works is it copied.
+ */
+void *myrealloc(void *p, unsigned n_bytes) {
+    if (p == NULL) return myalloc(n_bytes);
+    if (n_bytes == 0) {
+        myfree(p);
+        return NULL;
+    }
+    if (n_bytes > MAX_BYTES) return NULL;
+    struct control_block *cb = (struct control_block *)(p - sizeof(struct control_block));
+    unsigned tot_size = block_size(n_bytes), old = myusable(p);
+    if (cb -> free == MAPPED) {
+        size_t len = page_up(tot_size), was = cb -> size;
+        if (n_bytes >= mmap_threshold && cb -> prev == cb && len <= INT_MAX) {
+            void *moved = mremap(cb, was, len, MREMAP_MAYMOVE);
+            if (moved != MAP_FAILED) {
+                account((long)len - (long)was);
+                cb = moved;
+                cb -> size = len;
+                cb -> prev = cb;
+                return (void *)cb + sizeof(struct control_block);
+            }
+        }
+    }
+    else {
+        struct arena *a = arena_of(cb);
+        pthread_mutex_lock(&a -> lock);
+        if (cb -> size < tot_size) {
+            struct control_block *next = next_block(a, cb);
+            if (next != NULL && next -> free == 1) {
+                unlink_free(a, next);
+                absorb(a, cb, next);
+            }
+            if (cb -> size < tot_size && cb == a -> tail && grow(a, tot_size - cb -> size, NULL) != NULL)
+                cb -> size = tot_size;
+        }
+        if (cb -> size >= tot_size) {
+            cut(a, cb, tot_size);
+            pthread_mutex_unlock(&a -> lock);
+            return p;
+        }
+        pthread_mutex_unlock(&a -> lock);
+    }
+    void *q = myalloc(n_bytes);
+    if (q == NULL) return NULL;
+    memcpy(q, p, old < n_bytes ? old : n_bytes);
+    myfree(p);
+    return q;
+}
+
+/* An aligned block is cut from one long enough to hold it anywhere;
+ * what lies before it is freed as a block of its own, or for a mapped
+ * block stays mapped in front of it.
+ */
+void *myalign(unsigned align, unsigned n_bytes) {
+    struct control_block *cb = NULL, *nb;
+    struct arena *a = NULL;
+    uintptr_t body;
+    if (align <= ALIGN) return myalloc(n_bytes);
+    if (n_bytes > MAX_BYTES - align - MIN_BLOCK || (align & (align - 1)) != 0) return NULL;
+    unsigned tot_size = block_size(n_bytes), padded = tot_size + align + MIN_BLOCK;
+    if (n_bytes < mmap_threshold) {
+        a = thread_arena();
+        void *clean;
+        pthread_mutex_lock(&a -> lock);
+        if ((cb = arena_alloc(a, padded, &clean)) == NULL) pthread_mutex_unlock(&a -> lock);
+    }
+    if (cb == NULL) {
+        if ((cb = map_block(padded)) == NULL) return NULL;
+        a = NULL;
+    }
+    body = (uintptr_t)cb + sizeof(struct control_block);
+// The gap before the block must hold a free block, or be empty
+    if (body & (align - 1)) body = ((uintptr_t)cb + sizeof(struct control_block) + MIN_BLOCK + align - 1) & ~(uintptr_t)(align - 1);
+    nb = (struct control_block *)(body - sizeof(struct control_block));
+    if (nb != cb) {
+        nb -> free = cb -> free;
+        nb -> size = cb -> size - ((void *)nb - (void *)cb);
+        if (a == NULL) nb -> prev = cb -> prev;
+        else {
+            nb -> prev = cb;
+            if (a -> tail == cb) a -> tail = nb;
+            else ((struct control_block *)((void *)nb + nb -> size)) -> prev = nb;
+            cb -> size = (void *)nb - (void *)cb;
+            arena_free(a, cb);
+        }
+    }
+    if (a != NULL) {
+        cut(a, nb, tot_size);
+        pthread_mutex_unlock(&a -> lock);
+    }
+    return (void *)body;
+}
+
+/* Every lock, taken before a fork so that the child does not start
+ * with a lock that a thread of the parent held, and released after it.
+ */
+void lock_arenas() {
+    int i;
+    pthread_mutex_lock(&arenas_lock);
+    for (i = 0; i < MAX_ARENAS; ++i)
+        if (arenas[i] != NULL) pthread_mutex_lock(&arenas[i] -> lock);
+    if (spill != NULL) pthread_mutex_lock(&spill -> lock);
+}
+
+void unlock_arenas() {
+    int i;
+    if (spill != NULL) pthread_mutex_unlock(&spill -> lock);
+    for (i = MAX_ARENAS - 1; i >= 0; --i)
+        if (arenas[i] != NULL) pthread_mutex_unlock(&arenas[i] -> lock);
+    pthread_mutex_unlock(&arenas_lock);
+}
+
+#ifdef MYALLOC_DEBUG
 char buff[50];
 
+void print_stack();
+
 // Convenient function for calling `myalloc` and print the stack info via bash command
 void* malloc_and_print(unsigned s, const char *info) {
     printf("%s\n", info);
@@ -104,13 +671,15 @@ int main() {
     char *e = malloc_and_print(sizeof(char), "Allocate char e...");
     d[65500] = 10;
     printf("%d\n", d[65500]);
-    myfree(b);
+    myfree(b);  // Blocks of `b`, `c` and `e` will be kept in the thread cache
     myfree(c);
-    myfree(e);  // Block of `e` will be returned
-    void *f = malloc_and_print(10, "Allocate 10 f...");  // Will be allocated the block belonged to `b`
-    myfree(d);  // Block of `d` and `c` will be returned
-    myfree(f);  // Block of `f`(`b`) will be returned
-    myfree(a);  // Block of `a` will be returned
-    printf("%p %p\n", st(), en());  // Will be equal
+    myfree(e);
+    void *f = malloc_and_print(10, "Allocate 10 f...");  // Will be allocated the block belonged to `e`, cached last
+    myfree(d);  // Mapping of `d` will be unmapped
+    myfree(f);  // Blocks of `f`(`e`) and `a` will be cached too
+    myfree(a);
+    flush_cache();  // Cached blocks will be merged and returned
+    printf("%p %p\n", st(), en());  // One free block of less than TRIM_THRESHOLD is kept between them
     print_stack();
-}
\ No newline at end of file
+}
+#endif
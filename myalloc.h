@@ -0,0 +1,33 @@
+#ifndef MYALLOC_H
+#define MYALLOC_H
+
+#include <stddef.h>
+
+// Allocate `n_bytes`, aligned to 16, or return NULL
+void *myalloc(unsigned n_bytes);
+void myfree(void *p);
+// As calloc, realloc and aligned_alloc; `align` is a power of two
+void *mycalloc(size_t n, size_t size);
+void *myrealloc(void *p, unsigned n_bytes);
+void *myalign(unsigned align, unsigned n_bytes);
+// Bytes the block of `p` can hold, at least as many as were asked for
+unsigned myusable(void *p);
+
+// Return the blocks the calling thread has cached to its arena
+void flush_cache();
+// Requests of at least this many bytes get a mapping of their own, 128 KiB by default
+void set_mmap_threshold(unsigned n_bytes);
+
+// Bytes taken from the system now, and at most since the last `reset_peak`
+void heap_stats(size_t *size, size_t *peak);
+void reset_peak();
+
+// Take every lock of the allocator before a fork, and release them after it in both processes
+void lock_arenas();
+void unlock_arenas();
+
+// Start and end of the brk heap
+void *st();
+void *en();
+
+#endif
@@ -0,0 +1,91 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "myalloc.h"
+
+/***********************************************************
+*    The C allocation functions on top of `myalloc`, so    *
+*  that a real program runs on it when preloaded, e.g.     *
+*    LD_PRELOAD=./mymalloc.so sort -R big.txt > /dev/null  *
+*  Build it with                                           *
+*    gcc -O2 -shared -fPIC -fvisibility=hidden mymalloc.c  *
+*        myalloc.c -o mymalloc.so -lpthread                *
+*  -fvisibility=hidden keeps the allocator's own names     *
+*  (`init`, `split`, `grow`...) out of the dynamic symbol  *
+*  table, so a program with a function of the same name    *
+*  cannot take their place; only the functions below are  *
+*  exported. glibc calls them for its own allocations too. *
+*                                                          *
+*    Sizes `myalloc` cannot represent fail with ENOMEM, as *
+*  glibc's do. Allocation in the child of a fork is safe:  *
+*  every lock of the allocator is taken across the fork.   *
+************************************************************/
+
+#define EXPORT __attribute__((visibility("default")))
+
+EXPORT void *malloc(size_t size) {
+    void *p = size > UINT32_MAX ? NULL : myalloc(size);
+    if (p == NULL) errno = ENOMEM;
+    return p;
+}
+
+EXPORT void free(void *p) {
+    myfree(p);
+}
+
+EXPORT void *calloc(size_t n, size_t size) {
+    void *p = mycalloc(n, size);
+    if (p == NULL) errno = ENOMEM;
+    return p;
+}
+
+EXPORT void *realloc(void *p, size_t size) {
+    void *q = size > UINT32_MAX ? NULL : myrealloc(p, size);
+    if (q == NULL && size > 0) errno = ENOMEM;
+    return q;
+}
+
+EXPORT void *memalign(size_t align, size_t size) {
+    void *p = NULL;
+    // glibc takes any alignment, rounded up to a power of two
+    if (align > 1 && (align & (align - 1)) != 0) align = (size_t)1 << (64 - __builtin_clzll(align));
+    if (align <= UINT32_MAX && size <= UINT32_MAX) p = myalign(align, size);
+    if (p == NULL) errno = ENOMEM;
+    return p;
+}
+
+EXPORT void *aligned_alloc(size_t align, size_t size) {
+    if (align == 0 || (align & (align - 1)) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return memalign(align, size);
+}
+
+EXPORT int posix_memalign(void **out, size_t align, size_t size) {
+    void *p;
+    if (align < sizeof(void *) || (align & (align - 1)) != 0) return EINVAL;
+    if ((p = memalign(align, size)) == NULL) return ENOMEM;
+    *out = p;
+    return 0;
+}
+
+EXPORT void *valloc(size_t size) {
+    return memalign(sysconf(_SC_PAGESIZE), size);
+}
+
+EXPORT void *pvalloc(size_t size) {
+    long page = sysconf(_SC_PAGESIZE);
+    return memalign(page, (size + page - 1) & ~(page - 1));
+}
+
+EXPORT size_t malloc_usable_size(void *p) {
+    return myusable(p);
+}
+
+__attribute__((constructor)) static void mymalloc_init() {
+    pthread_atfork(lock_arenas, unlock_arenas, unlock_arenas);
+}
@@ -0,0 +1,869 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <signal.h>
+#include <ucontext.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <dirent.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/utsname.h>
+#include <sys/random.h>
+
+/***********************************************************
+*    A page-access tracer for real programs, preloaded     *
+*  (LD_PRELOAD=./pagetrace.so) or linked in with the       *
+*  program. It writes a binary trace that `vm` replays as  *
+*  it is, for example                                      *
+*    ./vm /dev/null pagetrace.bin --va-bits 48             *
+*         --page-size 4096 -p LRU -n 1024                  *
+*  Build it with                                           *
+*    gcc -O2 -shared -fPIC -Wl,-z,now pagetrace.c          *
+*        -o pagetrace.so -ldl -lpthread                    *
+*  (or add the file and the flags to the program's link);  *
+*  -z now binds every symbol at load time, which keeps the *
+*  dynamic linker out of the fault handler.                *
+*                                                          *
+*    Every `PAGETRACE_INTERVAL` milliseconds (default 10)  *
+*  a background thread reads /proc/self/maps and takes     *
+*  away all access to the heap and to anonymous private    *
+*  mappings, one mprotect call per region. The first touch *
+*  of a page then raises SIGSEGV; the handler records the  *
+*  page and gives it back read access on a read or full    *
+*  access on a write, so each interval records the first   *
+*  read and the first write of every page it touches, the  *
+*  writes marked as in `vm`'s binary format. Thread stacks,*
+*  bss and the tracer's own memory are never protected.    *
+*                                                          *
+*    Records go to a buffer per thread, which the owning   *
+*  thread appends to the file by reserving space with an   *
+*  atomic add and a pwrite, so no locks are taken on a     *
+*  fault. The trace keeps the order of faults within a     *
+*  thread; buffers of different threads interleave in      *
+*  chunks of `RECORDS`.                                    *
+*                                                          *
+*    The kernel does not raise SIGSEGV for user memory it  *
+*  reads or writes itself, it fails the system call with   *
+*  EFAULT. So the tracer wraps the common calls that hand  *
+*  the kernel a buffer: read and write in their vectored,  *
+*  positional and socket forms, fread and fwrite (large    *
+*  transfers skip the stdio buffer), open, stat and other  *
+*  calls on paths, readdir, poll, epoll_wait and wait. They*
+*  touch their buffers first and keep them unprotected     *
+*  until the call returns. The standard streams and every  *
+*  fopen'ed file get a stdio buffer of the tracer's own,   *
+*  and exec and spawn calls unprotect everything. Other    *
+*  system calls on traced memory may still fail.           *
+*                                                          *
+*    PAGETRACE names the output (default pagetrace.bin),   *
+*  a %p in it is replaced by the process id so that the    *
+*  children of a traced shell do not share one file. The   *
+*  record count in the header is brought up to date every  *
+*  interval and at exit.                                   *
+************************************************************/
+
+#define TRACE_MAGIC "VMTR"
+#define TRACE_VERSION 1
+#define TRACE_HEADER_SIZE 16
+#define TRACE_WRITES 1
+#define WRITE_MARK (1ULL << 63)
+
+#define RECORDS 4096  // Records per thread buffer
+#define MAX_THREADS 65536
+#define MAX_REGIONS 8192
+#define MAX_IGNORED 4096
+#define MAX_PINNED 256
+#define MAX_EXITING 256
+#define OWN_SIZE (256UL << 20)  // Address space reserved for the tracer's own memory
+#define MAPS_BUFFER (1 << 16)
+#define STDIO_BUFFER 8192
+
+struct region {
+    uintptr_t start, end;
+};
+
+// The traced regions, sorted, as the handler sees them
+struct table {
+    int n;
+    struct region r[MAX_REGIONS];
+};
+
+struct tbuf {
+    int n;
+    uint64_t rec[RECORDS];
+};
+
+static struct table *tables[2], *volatile current;
+static struct region ignored[MAX_IGNORED];  // Never traced: our memory, thread stacks, mprotect'ed ranges
+static int n_ignored;
+static struct region pinned[MAX_PINNED];  // Buffers of system calls in progress, empty if `end` is 0
+static pid_t exiting[MAX_EXITING];  // Threads on their way out, re-arming waits for them
+static int n_exiting;
+static pthread_key_t exit_key;
+static char *own, *maps_buf;
+static size_t own_used;
+static struct tbuf **buffers;
+static int n_buffers;
+static __thread struct tbuf *my_buf __attribute__((tls_model("initial-exec")));
+
+static int fd = -1;
+static volatile int tracing, stopping;
+static int paused;  // Calls in progress that start a program, re-arming waits for them
+static pid_t owner;
+static uint64_t file_end = TRACE_HEADER_SIZE, file_done = TRACE_HEADER_SIZE, dropped;
+static uintptr_t page_size, main_tcb;
+static long interval_ms = 10;
+static struct sigaction prev_segv;
+static int installed;
+static pthread_mutex_t scan_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// The next definition of a wrapped function, looked up on first use
+static void **real_slot(void **slot, const char *name) {
+    if (*slot == NULL) *slot = dlsym(RTLD_NEXT, name);
+    return slot;
+}
+#define REAL(name) (*(__typeof__(&real_##name))real_slot((void **)&real_##name, #name))
+static int (*real_sigaction)(int, const struct sigaction *, struct sigaction *);
+static sighandler_t (*real_signal)(int, sighandler_t);
+static int (*real_sigprocmask)(int, const sigset_t *, sigset_t *);
+static int (*real_pthread_sigmask)(int, const sigset_t *, sigset_t *);
+static int (*real_pthread_create)(pthread_t *, const pthread_attr_t *, void *(*)(void *), void *);
+static FILE *(*real_fopen)(const char *, const char *);
+static FILE *(*real_fopen64)(const char *, const char *);
+static FILE *(*real_fdopen)(int, const char *);
+
+// The tracer calls the kernel directly, never through its own wrappers below
+static int raw_mprotect(uintptr_t start, size_t len, int prot) {
+    return syscall(SYS_mprotect, start, len, prot);
+}
+
+static void raw_pwrite(const void *buf, size_t len, uint64_t at) {
+    while (len > 0) {
+        ssize_t n = syscall(SYS_pwrite64, fd, buf, len, at);
+        if (n <= 0 && errno != EINTR) return;
+        if (n > 0) buf = (const char *)buf + n, len -= n, at += n;
+    }
+}
+
+// Hold off every signal but SIGSEGV on this thread
+static void hold_signals(sigset_t *old) {
+    sigset_t all;
+    sigfillset(&all);
+    sigdelset(&all, SIGSEGV);
+    REAL(pthread_sigmask)(SIG_BLOCK, &all, old);
+}
+
+// The scan lock is taken with signals held off, or a handler of the program
+// that calls a wrapped function would wait for it on the thread that holds it
+static void lock_scan(sigset_t *old) {
+    hold_signals(old);
+    pthread_mutex_lock(&scan_lock);
+}
+
+static void unlock_scan(const sigset_t *old) {
+    pthread_mutex_unlock(&scan_lock);
+    REAL(pthread_sigmask)(SIG_SETMASK, old, NULL);
+}
+
+// A bump allocator over one reserved mapping, safe in the handler
+static void *own_alloc(size_t size) {
+    size = (size + page_size - 1) & ~(page_size - 1);
+    size_t at = __atomic_fetch_add(&own_used, size, __ATOMIC_RELAXED);
+    return at + size <= OWN_SIZE ? own + at : NULL;
+}
+
+static void ignore(uintptr_t start, uintptr_t end) {
+    int i = __atomic_fetch_add(&n_ignored, 1, __ATOMIC_RELAXED);
+    if (i >= MAX_IGNORED) return;
+    ignored[i].start = start & ~(page_size - 1);
+    ignored[i].end = (end + page_size - 1) & ~(page_size - 1);
+}
+
+static struct region *find_region(struct table *t, uintptr_t addr) {
+    int lo = 0, hi = t->n - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (addr < t->r[mid].start) hi = mid - 1;
+        else if (addr >= t->r[mid].end) lo = mid + 1;
+        else return &t->r[mid];
+    }
+    return NULL;
+}
+
+/***********************************************************
+*    Recording. The header count only ever covers records  *
+*  that are fully written, so a crash leaves a short but   *
+*  valid trace.                                            *
+************************************************************/
+static void write_header() {
+    unsigned char head[TRACE_HEADER_SIZE] = TRACE_MAGIC;
+    uint64_t done = __atomic_load_n(&file_done, __ATOMIC_ACQUIRE);
+    uint64_t count = (done - TRACE_HEADER_SIZE) / 8;
+    int i;
+    head[4] = TRACE_VERSION;
+    head[6] = 8;
+    head[7] = TRACE_WRITES;
+    for (i = 0; i < 8; ++i) head[8 + i] = count >> (8 * i);
+    if (done == __atomic_load_n(&file_end, __ATOMIC_ACQUIRE)) raw_pwrite(head, TRACE_HEADER_SIZE, 0);
+}
+
+static void flush_buf(struct tbuf *b) {
+    size_t len = b->n * sizeof(uint64_t);
+    if (len == 0) return;
+    uint64_t at = __atomic_fetch_add(&file_end, len, __ATOMIC_RELAXED);
+    raw_pwrite(b->rec, len, at);
+    __atomic_fetch_add(&file_done, len, __ATOMIC_RELEASE);
+    b->n = 0;
+}
+
+static void record(uint64_t rec) {
+    struct tbuf *b = my_buf;
+    if (b == NULL) {
+        b = my_buf = own_alloc(sizeof(struct tbuf));
+        if (b == NULL) {
+            __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        int i = __atomic_fetch_add(&n_buffers, 1, __ATOMIC_RELAXED);
+        if (i < MAX_THREADS) buffers[i] = b;
+    }
+    b->rec[b->n++] = rec;
+    if (b->n == RECORDS) flush_buf(b);
+}
+
+/***********************************************************
+*    The SIGSEGV handler. A fault outside the traced       *
+*  regions, or on an unmapped address, belongs to the      *
+*  program and goes to the handler it installed, or kills  *
+*  it as it would have without the tracer. When the kernel *
+*  runs out of mappings for the split regions, the whole   *
+*  region is given back until the next interval.           *
+************************************************************/
+static int fault_is_write(void *ctx) {
+#if defined(__x86_64__)
+    return (((ucontext_t *)ctx)->uc_mcontext.gregs[REG_ERR] & 2) != 0;
+#else
+    return 1;  // No way to tell, so grant full access at once
+#endif
+}
+
+static void chain(int sig, siginfo_t *si, void *ctx) {
+    struct sigaction dfl;
+    if (prev_segv.sa_flags & SA_SIGINFO) prev_segv.sa_sigaction(sig, si, ctx);
+    else if (prev_segv.sa_handler != SIG_DFL && prev_segv.sa_handler != SIG_IGN) prev_segv.sa_handler(sig);
+    else {
+    // Fault again with the default action, for the usual crash and core dump
+        memset(&dfl, 0, sizeof(dfl));
+        dfl.sa_handler = SIG_DFL;
+        REAL(sigaction)(SIGSEGV, &dfl, NULL);
+    }
+}
+
+static void on_fault(int sig, siginfo_t *si, void *ctx) {
+    int saved = errno;
+    uintptr_t addr = (uintptr_t)si->si_addr, page = addr & ~(page_size - 1);
+    struct table *t = current;
+    struct region *r = t != NULL && si->si_code == SEGV_ACCERR ? find_region(t, addr) : NULL;
+    if (r == NULL) {
+        chain(sig, si, ctx);
+        errno = saved;
+        return;
+    }
+    int write = fault_is_write(ctx);
+    if (tracing) record(page | (write ? WRITE_MARK : 0));
+    if (raw_mprotect(page, page_size, write ? PROT_READ | PROT_WRITE : PROT_READ) != 0)
+        raw_mprotect(r->start, r->end - r->start, PROT_READ | PROT_WRITE);
+    errno = saved;
+}
+
+/***********************************************************
+*    Scanning. A mapping is traced if it is private, either*
+*  the heap or anonymous, and readable and writable, or if *
+*  it lies in a region traced last interval (the pieces we *
+*  protected ourselves show up as ---p and r--p). Anony-   *
+*  mous memory right after a file mapping is that file's   *
+*  bss and is left alone, and so is the mapping with the   *
+*  main thread's TLS, which the handler itself uses (errno *
+*  and the thread's buffer). Ignored ranges are cut out.   *
+*  Pinned ranges stay in the table and are only skipped   *
+*  when it is protected, so the handler still knows their  *
+*  pages when the program touches them after the call.     *
+************************************************************/
+static void add_region(struct table *t, uintptr_t start, uintptr_t end, int from) {
+    int i, n = n_ignored < MAX_IGNORED ? n_ignored : MAX_IGNORED;
+    for (i = from; i < n; ++i) {
+        const struct region *c = &ignored[i];
+        if (c->start < end && start < c->end) {
+            if (start < c->start) add_region(t, start, c->start, i + 1);
+            if (c->end < end) add_region(t, c->end, end, i + 1);
+            return;
+        }
+    }
+    if (t->n > 0 && t->r[t->n - 1].end == start) t->r[t->n - 1].end = end;
+    else if (t->n < MAX_REGIONS) {
+        t->r[t->n].start = start;
+        t->r[t->n++].end = end;
+    }
+}
+
+static int overlaps(const struct table *t, uintptr_t start, uintptr_t end) {
+    int i;
+    for (i = 0; t != NULL && i < t->n; ++i)
+        if (t->r[i].start < end && start < t->r[i].end) return 1;
+    return 0;
+}
+
+static void scan_line(struct table *t, const struct table *old, char *line, uintptr_t *prev_end, int *prev_file) {
+    char perms[5] = "", path[32] = "";
+    unsigned long start, end, offset, inode;
+    unsigned dev_major, dev_minor;
+    int file;
+    if (sscanf(line, "%lx-%lx %4s %lx %x:%x %lu %31s", &start, &end, perms, &offset,
+               &dev_major, &dev_minor, &inode, path) < 7) return;
+    file = inode != 0 || (path[0] != 0 && path[0] != '[');
+    int anon = !file && (path[0] == 0 || strcmp(path, "[heap]") == 0);
+    int ours = overlaps(old, start, end);
+    int bss = path[0] == 0 && !ours && *prev_file && *prev_end == start;
+    int tls = start <= main_tcb && main_tcb < end;
+    if (anon && perms[3] == 'p' && !bss && !tls
+        && (strcmp(perms, "rw-p") == 0 || (ours && (strcmp(perms, "---p") == 0 || strcmp(perms, "r--p") == 0))))
+        add_region(t, start, end, 0);
+    *prev_end = end;
+    *prev_file = file;
+}
+
+static void scan(struct table *t, const struct table *old) {
+    uintptr_t prev_end = 0;
+    int prev_file = 0, len = 0, maps = syscall(SYS_openat, AT_FDCWD, "/proc/self/maps", O_RDONLY | O_CLOEXEC);
+    t->n = 0;
+    if (maps < 0) return;
+    for (;;) {
+        ssize_t n = syscall(SYS_read, maps, maps_buf + len, MAPS_BUFFER - 1 - len);
+        if (n <= 0) break;
+        len += n;
+        maps_buf[len] = 0;
+        char *line = maps_buf, *nl;
+        while ((nl = strchr(line, '\n')) != NULL) {
+            *nl = 0;
+            scan_line(t, old, line, &prev_end, &prev_file);
+            line = nl + 1;
+        }
+        len -= line - maps_buf;
+        memmove(maps_buf, line, len);
+    }
+    syscall(SYS_close, maps);
+}
+
+// Take all access to a traced range away, except to the pinned buffers in it
+static void protect(uintptr_t start, uintptr_t end, int from) {
+    int i;
+    for (i = from; i < MAX_PINNED; ++i) {
+        uintptr_t pin_end = __atomic_load_n(&pinned[i].end, __ATOMIC_ACQUIRE);
+        if (pinned[i].start < end && start < pin_end) {
+            if (start < pinned[i].start) protect(start, pinned[i].start, i + 1);
+            if (pin_end < end) protect(pin_end, end, i + 1);
+            return;
+        }
+    }
+    raw_mprotect(start, end - start, PROT_NONE);
+}
+
+// Publish a fresh table, then protect it, so the handler always knows a protected page
+static void rearm() {
+    struct table *t = current == tables[0] ? tables[1] : tables[0];
+    int i;
+    scan(t, current);
+    current = t;
+    for (i = 0; i < t->n; ++i) protect(t->r[i].start, t->r[i].end, 0);
+}
+
+static void release_all() {
+    struct table *t = current;
+    int i;
+    for (i = 0; t != NULL && i < t->n; ++i)
+        raw_mprotect(t->r[i].start, t->r[i].end - t->r[i].start, PROT_READ | PROT_WRITE);
+}
+
+// The number of exiting threads still alive, forgetting those that are gone
+static int still_exiting() {
+    int i = 0;
+    while (i < n_exiting)
+        if (syscall(SYS_tgkill, owner, exiting[i], 0) != 0 && errno == ESRCH) exiting[i] = exiting[--n_exiting];
+        else ++i;
+    return n_exiting;
+}
+
+static void *rearm_loop(void *arg) {
+    struct timespec ts = {interval_ms / 1000, interval_ms % 1000 * 1000000};
+    hold_signals(NULL);  // The program's signals go to its own threads
+    while (!stopping) {
+        nanosleep(&ts, NULL);
+        pthread_mutex_lock(&scan_lock);
+        if (!stopping && tracing && !__atomic_load_n(&paused, __ATOMIC_RELAXED) && still_exiting() == 0) {
+            rearm();
+            write_header();
+        }
+        pthread_mutex_unlock(&scan_lock);
+    }
+    return NULL;
+}
+
+/***********************************************************
+*    Wrappers. The program's own SIGSEGV handler is kept   *
+*  behind ours, and the program cannot block SIGSEGV,      *
+*  neither with its signal mask nor while its other        *
+*  handlers run (a shell blocks every signal around its    *
+*  critical sections, and a fault there would kill it).    *
+*  Ranges it mprotects are no longer traced, and a new     *
+*  thread's stack is ignored before the thread runs (a     *
+*  protected stack could not take the signal). Starting a  *
+*  thread also gives all traced memory back until the next *
+*  interval: glibc runs the new thread with every signal   *
+*  blocked while it reads the locale, which setlocale may  *
+*  have put on the heap. Exiting does the same, as glibc   *
+*  then frees the thread's TLS with the signals blocked,   *
+*  and re-arming waits until the thread is gone.           *
+************************************************************/
+int sigaction(int sig, const struct sigaction *act, struct sigaction *old) {
+    struct sigaction keep;
+    if (sig != SIGSEGV && installed && act != NULL) {
+        keep = *act;
+        sigdelset(&keep.sa_mask, SIGSEGV);
+        act = &keep;
+    }
+    if (sig != SIGSEGV || !installed) return REAL(sigaction)(sig, act, old);
+    if (old != NULL) *old = prev_segv;
+    if (act != NULL) prev_segv = *act;
+    return 0;
+}
+
+sighandler_t signal(int sig, sighandler_t handler) {
+    if (sig != SIGSEGV || !installed) return REAL(signal)(sig, handler);
+    sighandler_t old = prev_segv.sa_flags & SA_SIGINFO ? SIG_DFL : prev_segv.sa_handler;
+    memset(&prev_segv, 0, sizeof(prev_segv));
+    prev_segv.sa_handler = handler;
+    return old;
+}
+
+static const sigset_t *keep_segv(int how, const sigset_t *set, sigset_t *keep) {
+    if (set == NULL || !installed || how == SIG_UNBLOCK) return set;
+    *keep = *set;
+    sigdelset(keep, SIGSEGV);
+    return keep;
+}
+
+int sigprocmask(int how, const sigset_t *set, sigset_t *old) {
+    sigset_t keep;
+    return REAL(sigprocmask)(how, keep_segv(how, set, &keep), old);
+}
+
+int pthread_sigmask(int how, const sigset_t *set, sigset_t *old) {
+    sigset_t keep;
+    return REAL(pthread_sigmask)(how, keep_segv(how, set, &keep), old);
+}
+
+int mprotect(void *addr, size_t len, int prot) {
+    if (prot != (PROT_READ | PROT_WRITE)) ignore((uintptr_t)addr, (uintptr_t)addr + len);
+    return raw_mprotect((uintptr_t)addr, len, prot);
+}
+
+struct start {
+    void *(*fn)(void *);
+    void *arg;
+    sigset_t mask;  // The creator's, the thread starts with it
+    sem_t ready;
+};
+
+static void *start_thread(void *p) {
+    struct start *s = p;
+    void *(*fn)(void *) = s->fn, *arg = s->arg;
+    pthread_attr_t attr;
+    void *stack;
+    size_t size;
+    if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+        if (pthread_attr_getstack(&attr, &stack, &size) == 0)
+            ignore((uintptr_t)stack, (uintptr_t)stack + size);
+        pthread_attr_destroy(&attr);
+    }
+    pthread_setspecific(exit_key, s);  // Any value but NULL, for `thread_exit` to run
+    REAL(pthread_sigmask)(SIG_SETMASK, &s->mask, NULL);
+    sem_post(&s->ready);
+    return fn(arg);
+}
+
+// Runs with the thread's key destructors, before glibc blocks its signals
+static void thread_exit(void *unused) {
+    sigset_t mask;
+    lock_scan(&mask);
+    if (n_exiting < MAX_EXITING) exiting[n_exiting++] = syscall(SYS_gettid);
+    release_all();
+    unlock_scan(&mask);
+}
+
+int pthread_create(pthread_t *thread, const pthread_attr_t *attr, void *(*fn)(void *), void *arg) {
+    struct start s = {fn, arg};
+    int ret;
+    if (!tracing) return REAL(pthread_create)(thread, attr, fn, arg);
+    sem_init(&s.ready, 0, 0);
+    lock_scan(&s.mask);
+    release_all();
+    ret = REAL(pthread_create)(thread, attr, start_thread, &s);
+    if (ret == 0)
+        while (sem_wait(&s.ready) != 0);
+    unlock_scan(&s.mask);
+    sem_destroy(&s.ready);
+    return ret;
+}
+
+/* Fault the pages the kernel is about to access, so that it finds them
+ * accessible, and pin them until the call returns: a read from a pipe
+ * may block across many intervals. Holding the scan lock keeps a
+ * re-arm from slipping in between the scan and the touch.
+ */
+static int pin(uintptr_t buf, size_t len, int write) {
+    uintptr_t p, end = buf + len;
+    struct table *t;
+    sigset_t mask;
+    int slot = -1, i;
+    if (!tracing || len == 0) return -1;
+    lock_scan(&mask);
+    for (i = 0; i < MAX_PINNED && slot < 0; ++i)
+        if (pinned[i].end == 0) slot = i;
+    if (slot >= 0) {
+        pinned[slot].start = buf & ~(page_size - 1);
+        pinned[slot].end = (end + page_size - 1) & ~(page_size - 1);
+    }
+    t = current;
+    for (p = buf & ~(page_size - 1); t != NULL && p < end; p += page_size) {
+        char *c = (char *)(p < buf ? buf : p);
+        if (find_region(t, p) == NULL) continue;
+        if (write) __atomic_fetch_add(c, 0, __ATOMIC_RELAXED);
+        else (void)*(volatile char *)c;
+    }
+    unlock_scan(&mask);
+    return slot;
+}
+
+static void unpin(int slot) {
+    if (slot >= 0) __atomic_store_n(&pinned[slot].end, 0, __ATOMIC_RELEASE);
+}
+
+// Out of line, so the NULL check survives the nonnull declarations of the wrapped calls
+__attribute__((noinline)) static size_t path_len(const char *path) {
+    return path != NULL ? strlen(path) + 1 : 0;
+}
+#define PATH(p) path_len(p)
+
+// A wrapper that pins one or two buffers around the call
+#define WRAP2(ret, name, params, args, buf1, len1, write1, buf2, len2, write2) \
+ret name params { \
+    static ret (*real_##name) params; \
+    int slot1 = pin((uintptr_t)(buf1), len1, write1), slot2 = pin((uintptr_t)(buf2), len2, write2); \
+    ret r = REAL(name) args; \
+    unpin(slot1); \
+    unpin(slot2); \
+    return r; \
+}
+#define WRAP(ret, name, params, args, buf, len, write) WRAP2(ret, name, params, args, buf, len, write, NULL, 0, 0)
+
+WRAP(ssize_t, read, (int fd, void *buf, size_t n), (fd, buf, n), buf, n, 1)
+WRAP(ssize_t, write, (int fd, const void *buf, size_t n), (fd, buf, n), buf, n, 0)
+WRAP(ssize_t, pread, (int fd, void *buf, size_t n, off_t off), (fd, buf, n, off), buf, n, 1)
+WRAP(ssize_t, pwrite, (int fd, const void *buf, size_t n, off_t off), (fd, buf, n, off), buf, n, 0)
+WRAP(ssize_t, pread64, (int fd, void *buf, size_t n, off_t off), (fd, buf, n, off), buf, n, 1)
+WRAP(ssize_t, pwrite64, (int fd, const void *buf, size_t n, off_t off), (fd, buf, n, off), buf, n, 0)
+WRAP(ssize_t, recv, (int fd, void *buf, size_t n, int flags), (fd, buf, n, flags), buf, n, 1)
+WRAP(ssize_t, send, (int fd, const void *buf, size_t n, int flags), (fd, buf, n, flags), buf, n, 0)
+WRAP(ssize_t, recvfrom, (int fd, void *buf, size_t n, int flags, struct sockaddr *from, socklen_t *len),
+     (fd, buf, n, flags, from, len), buf, n, 1)
+WRAP(ssize_t, sendto, (int fd, const void *buf, size_t n, int flags, const struct sockaddr *to, socklen_t len),
+     (fd, buf, n, flags, to, len), buf, n, 0)
+WRAP(size_t, fread, (void *buf, size_t size, size_t n, FILE *fp), (buf, size, n, fp), buf, size * n, 1)
+WRAP(size_t, fwrite, (const void *buf, size_t size, size_t n, FILE *fp), (buf, size, n, fp), buf, size * n, 0)
+#undef fread_unlocked
+#undef fwrite_unlocked
+WRAP(size_t, fread_unlocked, (void *buf, size_t size, size_t n, FILE *fp), (buf, size, n, fp), buf, size * n, 1)
+WRAP(size_t, fwrite_unlocked, (const void *buf, size_t size, size_t n, FILE *fp), (buf, size, n, fp), buf, size * n, 0)
+WRAP(int, epoll_wait, (int fd, struct epoll_event *ev, int n, int timeout), (fd, ev, n, timeout),
+     ev, n > 0 ? n * sizeof(*ev) : 0, 1)
+WRAP(int, poll, (struct pollfd *fds, nfds_t n, int timeout), (fds, n, timeout), fds, n * sizeof(*fds), 1)
+
+// Paths, and what the kernel writes back for them
+WRAP(int, access, (const char *path, int mode), (path, mode), path, PATH(path), 0)
+WRAP(int, faccessat, (int dir, const char *path, int mode, int flags), (dir, path, mode, flags), path, PATH(path), 0)
+WRAP(int, unlink, (const char *path), (path), path, PATH(path), 0)
+WRAP(int, rmdir, (const char *path), (path), path, PATH(path), 0)
+WRAP(int, mkdir, (const char *path, mode_t mode), (path, mode), path, PATH(path), 0)
+WRAP(int, chdir, (const char *path), (path), path, PATH(path), 0)
+WRAP(DIR *, opendir, (const char *path), (path), path, PATH(path), 0)
+WRAP2(int, rename, (const char *from, const char *to), (from, to), from, PATH(from), 0, to, PATH(to), 0)
+WRAP2(ssize_t, readlink, (const char *path, char *buf, size_t n), (path, buf, n), path, PATH(path), 0, buf, n, 1)
+WRAP2(ssize_t, readlinkat, (int dir, const char *path, char *buf, size_t n), (dir, path, buf, n),
+      path, PATH(path), 0, buf, n, 1)
+WRAP(char *, getcwd, (char *buf, size_t n), (buf, n), buf, buf != NULL ? n : 0, 1)
+WRAP2(int, stat, (const char *path, struct stat *st), (path, st), path, PATH(path), 0, st, sizeof(*st), 1)
+WRAP2(int, lstat, (const char *path, struct stat *st), (path, st), path, PATH(path), 0, st, sizeof(*st), 1)
+WRAP2(int, stat64, (const char *path, struct stat64 *st), (path, st), path, PATH(path), 0, st, sizeof(*st), 1)
+WRAP2(int, lstat64, (const char *path, struct stat64 *st), (path, st), path, PATH(path), 0, st, sizeof(*st), 1)
+WRAP2(int, fstatat, (int dir, const char *path, struct stat *st, int flags), (dir, path, st, flags),
+      path, PATH(path), 0, st, sizeof(*st), 1)
+WRAP2(int, fstatat64, (int dir, const char *path, struct stat64 *st, int flags), (dir, path, st, flags),
+      path, PATH(path), 0, st, sizeof(*st), 1)
+WRAP(int, fstat, (int fd, struct stat *st), (fd, st), st, sizeof(*st), 1)
+WRAP(int, fstat64, (int fd, struct stat64 *st), (fd, st), st, sizeof(*st), 1)
+
+WRAP(int, uname, (struct utsname *u), (u), u, sizeof(*u), 1)
+WRAP(ssize_t, getrandom, (void *buf, size_t n, unsigned flags), (buf, n, flags), buf, n, 1)
+
+WRAP(pid_t, wait, (int *status), (status), status, sizeof(int), 1)
+WRAP(pid_t, waitpid, (pid_t pid, int *status, int options), (pid, status, options), status, sizeof(int), 1)
+WRAP2(pid_t, wait4, (pid_t pid, int *status, int options, struct rusage *ru), (pid, status, options, ru),
+      status, sizeof(int), 1, ru, sizeof(*ru), 1)
+WRAP(int, waitid, (idtype_t type, id_t id, siginfo_t *info, int options), (type, id, info, options),
+     info, sizeof(*info), 1)
+
+/* The kernel reads the arguments and environment of a new program from
+ * anywhere in memory, so starting one gives all traced memory back
+ * and re-arming pauses until the call returns (system and popen wait
+ * for the child); a successful exec ends the trace anyway.
+ */
+#define WRAP_EXEC(ret, name, params, args) \
+ret name params { \
+    static ret (*real_##name) params; \
+    sigset_t mask; \
+    lock_scan(&mask); \
+    __atomic_fetch_add(&paused, 1, __ATOMIC_RELAXED); \
+    release_all(); \
+    unlock_scan(&mask); \
+    ret r = REAL(name) args; \
+    __atomic_fetch_sub(&paused, 1, __ATOMIC_RELAXED); \
+    return r; \
+}
+
+WRAP_EXEC(int, execve, (const char *path, char *const argv[], char *const envp[]), (path, argv, envp))
+WRAP_EXEC(int, execv, (const char *path, char *const argv[]), (path, argv))
+WRAP_EXEC(int, execvp, (const char *file, char *const argv[]), (file, argv))
+WRAP_EXEC(int, execvpe, (const char *file, char *const argv[], char *const envp[]), (file, argv, envp))
+WRAP_EXEC(int, fexecve, (int fd, char *const argv[], char *const envp[]), (fd, argv, envp))
+WRAP_EXEC(int, posix_spawn, (pid_t *pid, const char *path, const posix_spawn_file_actions_t *actions,
+          const posix_spawnattr_t *attr, char *const argv[], char *const envp[]), (pid, path, actions, attr, argv, envp))
+WRAP_EXEC(int, posix_spawnp, (pid_t *pid, const char *file, const posix_spawn_file_actions_t *actions,
+          const posix_spawnattr_t *attr, char *const argv[], char *const envp[]), (pid, file, actions, attr, argv, envp))
+WRAP_EXEC(int, system, (const char *command), (command))
+WRAP_EXEC(FILE *, popen, (const char *command, const char *mode), (command, mode))
+
+#define WRAP_OPEN(name, params, args) \
+int name params { \
+    static int (*real_##name) params; \
+    mode_t mode = 0; \
+    va_list ap; \
+    if ((flags & O_CREAT) || (flags & O_TMPFILE) == O_TMPFILE) { \
+        va_start(ap, flags); \
+        mode = va_arg(ap, mode_t); \
+        va_end(ap); \
+    } \
+    int slot = pin((uintptr_t)path, PATH(path), 0), r = REAL(name) args; \
+    unpin(slot); \
+    return r; \
+}
+
+WRAP_OPEN(open, (const char *path, int flags, ...), (path, flags, mode))
+WRAP_OPEN(open64, (const char *path, int flags, ...), (path, flags, mode))
+WRAP_OPEN(openat, (int dir, const char *path, int flags, ...), (dir, path, flags, mode))
+WRAP_OPEN(openat64, (int dir, const char *path, int flags, ...), (dir, path, flags, mode))
+
+/* readdir fills the buffer inside the DIR from the kernel; glibc's
+ * struct __dirstream keeps that buffer's size after the fd and the lock.
+ */
+static size_t dir_size(DIR *dir) {
+    size_t allocation = *(size_t *)((char *)dir + 2 * sizeof(int));
+    return 8 * sizeof(size_t) + (allocation <= (1 << 20) ? allocation : 32768);
+}
+
+WRAP(struct dirent *, readdir, (DIR *dir), (dir), dir, dir_size(dir), 1)
+WRAP(struct dirent64 *, readdir64, (DIR *dir), (dir), dir, dir_size(dir), 1)
+
+// Vectored calls pin the vector and every buffer in it, and a message header too
+static void pin_iov(const struct iovec *iov, int n, int write, int *slots) {
+    int i;
+    slots[0] = pin((uintptr_t)iov, n > 0 ? n * sizeof(*iov) : 0, 0);
+    for (i = 0; i < n; ++i) slots[i + 1] = pin((uintptr_t)iov[i].iov_base, iov[i].iov_len, write);
+}
+
+static void unpin_all(const int *slots, int n) {
+    int i;
+    for (i = 0; i < n; ++i) unpin(slots[i]);
+}
+
+#define WRAP_IOV(ret, name, params, args, iov, n, write) \
+ret name params { \
+    static ret (*real_##name) params; \
+    int slots[(n) > 0 && (n) <= IOV_MAX ? (n) + 1 : 1]; \
+    if ((n) > 0 && (n) <= IOV_MAX) pin_iov(iov, n, write, slots); \
+    else slots[0] = -1; \
+    ret r = REAL(name) args; \
+    unpin_all(slots, sizeof(slots) / sizeof(slots[0])); \
+    return r; \
+}
+
+WRAP_IOV(ssize_t, readv, (int fd, const struct iovec *iov, int n), (fd, iov, n), iov, n, 1)
+WRAP_IOV(ssize_t, writev, (int fd, const struct iovec *iov, int n), (fd, iov, n), iov, n, 0)
+WRAP_IOV(ssize_t, preadv, (int fd, const struct iovec *iov, int n, off_t off), (fd, iov, n, off), iov, n, 1)
+WRAP_IOV(ssize_t, pwritev, (int fd, const struct iovec *iov, int n, off_t off), (fd, iov, n, off), iov, n, 0)
+
+#define WRAP_MSG(name, params, args, write) \
+ssize_t name params { \
+    static ssize_t (*real_##name) params; \
+    int n = msg->msg_iovlen <= IOV_MAX ? msg->msg_iovlen : 0, slots[n + 4]; \
+    slots[0] = pin((uintptr_t)msg, sizeof(*msg), write); \
+    slots[1] = pin((uintptr_t)msg->msg_name, msg->msg_namelen, write); \
+    slots[2] = pin((uintptr_t)msg->msg_control, msg->msg_controllen, write); \
+    pin_iov(msg->msg_iov, n, write, slots + 3); \
+    ssize_t r = REAL(name) args; \
+    unpin_all(slots, n + 4); \
+    return r; \
+}
+
+WRAP_MSG(recvmsg, (int fd, struct msghdr *msg, int flags), (fd, msg, flags), 1)
+WRAP_MSG(sendmsg, (int fd, const struct msghdr *msg, int flags), (fd, msg, flags), 0)
+
+// stdio reads and writes its buffer from inside libc, past the wrappers, so give it one we never protect
+static FILE *own_stdio(FILE *fp) {
+    char *buf = fp != NULL && installed ? own_alloc(STDIO_BUFFER) : NULL;
+    if (buf != NULL) setvbuf(fp, buf, isatty(fileno(fp)) ? _IOLBF : _IOFBF, STDIO_BUFFER);
+    return fp;
+}
+
+FILE *fopen(const char *path, const char *mode) {
+    return own_stdio(REAL(fopen)(path, mode));
+}
+
+FILE *fopen64(const char *path, const char *mode) {
+    return own_stdio(REAL(fopen64)(path, mode));
+}
+
+FILE *fdopen(int fd, const char *mode) {
+    return own_stdio(REAL(fdopen)(fd, mode));
+}
+
+/***********************************************************
+*    Start and stop. A forked child inherits the protected *
+*  pages but not the thread that re-arms them, so it stops *
+*  tracing and gets its memory back; only the process that *
+*  opened the trace writes to it.                          *
+************************************************************/
+static sigset_t fork_mask;
+
+static void before_fork() {
+    lock_scan(&fork_mask);
+}
+
+static void after_fork_parent() {
+    unlock_scan(&fork_mask);
+}
+
+static void after_fork_child() {
+    tracing = 0;
+    stopping = 1;
+    release_all();
+    unlock_scan(&fork_mask);
+}
+
+__attribute__((constructor)) static void pagetrace_init() {
+    const char *env = getenv("PAGETRACE"), *iv = getenv("PAGETRACE_INTERVAL");
+    char path[4096];
+    struct sigaction sa;
+    sigset_t mask;
+    pthread_t tid;
+    size_t i, n = 0;
+
+    page_size = sysconf(_SC_PAGESIZE);
+    main_tcb = (uintptr_t)pthread_self();
+    if (iv != NULL && atol(iv) > 0) interval_ms = atol(iv);
+    own = mmap(NULL, OWN_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (own == MAP_FAILED) {
+        perror("pagetrace");
+        return;
+    }
+    ignore((uintptr_t)own, (uintptr_t)own + OWN_SIZE);
+    tables[0] = own_alloc(sizeof(struct table));
+    tables[1] = own_alloc(sizeof(struct table));
+    buffers = own_alloc(MAX_THREADS * sizeof(struct tbuf *));
+    maps_buf = own_alloc(MAPS_BUFFER);
+
+    // The output path, with %p replaced by the process id
+    if (env == NULL) env = "pagetrace.bin";
+    for (i = 0; env[i] != 0 && n < sizeof(path) - 24; ++i)
+        if (env[i] == '%' && env[i + 1] == 'p') n += sprintf(path + n, "%d", (int)getpid()), ++i;
+        else path[n++] = env[i];
+    path[n] = 0;
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror(path);
+        return;
+    }
+    owner = getpid();
+    write_header();
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = on_fault;
+    sa.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigfillset(&sa.sa_mask);  // No handler of the program runs on top of ours, with SIGSEGV blocked
+    if (REAL(sigaction)(SIGSEGV, &sa, &prev_segv) != 0) {
+        perror("pagetrace: sigaction");
+        return;
+    }
+    installed = 1;
+    own_stdio(stdin);
+    own_stdio(stdout);
+    pthread_atfork(before_fork, after_fork_parent, after_fork_child);
+    pthread_key_create(&exit_key, thread_exit);
+
+    tracing = 1;
+    if (pthread_create(&tid, NULL, rearm_loop, NULL) != 0) {  // Through the wrapper, so its stack is ignored
+        tracing = 0;
+        printf("pagetrace: cannot start the re-arming thread\n");
+        return;
+    }
+    pthread_detach(tid);
+    lock_scan(&mask);
+    rearm();
+    unlock_scan(&mask);
+}
+
+__attribute__((destructor)) static void pagetrace_fini() {
+    sigset_t mask;
+    int i, n;
+    if (fd < 0 || getpid() != owner) return;
+    lock_scan(&mask);
+    stopping = 1;
+    tracing = 0;
+    release_all();
+    unlock_scan(&mask);
+    n = n_buffers < MAX_THREADS ? n_buffers : MAX_THREADS;
+    for (i = 0; i < n; ++i)
+        if (buffers[i] != NULL) flush_buf(buffers[i]);
+    write_header();
+    if (dropped)
+        fprintf(stderr, "pagetrace: %llu faults not recorded, out of buffer space\n", (unsigned long long)dropped);
+    close(fd);
+    fd = -1;
+}
@@ -5,390 +5,4113 @@
 #include <fcntl.h>
 #include <getopt.h>
 #include <unistd.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <strings.h>
+#include <pthread.h>
+#include <signal.h>
+#include <errno.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
-// Number of virtual pages
-#define V_PAGES 256
-// Mask used to take the virtual page segment from address
-#define VPAGE_MASK V_PAGES - 1
+/***********************************************************
+*    The address geometry is set from the command line     *
+*  (`--page-size`, `--va-bits`) and then never changes,    *
+*  so all simulations share it. The defaults are the 16-   *
+*  bit address space of 256 pages of 256 bytes.            *
+************************************************************/
+// Offset bit used to take the offset segment from address
+int OFFSET = 8;
+// Virtual address bits
+int VA_BITS = 16;
 // Page size
-#define PAGE_SIZE 256
+uint64_t PAGE_SIZE = 256;
 // Mask used to take the offset segment from address
-#define OFFSET_MASK PAGE_SIZE - 1
-// Backing-store size
-#define BS_SIZE V_PAGES * PAGE_SIZE
-
-// Number of physical pages
-int P_PAGES = 256;
-// Mask used to take the physical page segment from address
-#define PPAGE_MASK (P_PAGES - 1)
+uint64_t OFFSET_MASK = 255;
+// Number of virtual pages
+uint64_t V_PAGES = 256;
+// Mask used to take the virtual page segment from address
+uint64_t VPAGE_MASK = 255;
+// Largest address space a flat page table may cover
+#define MAX_FLAT_PAGES (1 << 24)
+
+/* Huge pages are 2^HUGE_BITS pages, backing the regions whose
+ * bit is set in `huge_map`, see `mark_huge` and its neighbours.
+ */
+int HUGE_BITS = 0;  // 0 without huge pages
+uint64_t HUGE_SIZE = 0;
+uint64_t *huge_map;  // One bit per huge page of the address space
+uint64_t n_huge_pages;  // Number of bits set in `huge_map`
+// Set in the keys of huge pages where they share a TLB with small ones
+#define HUGE_TAG (1ULL << 63)
+
+static inline int is_huge(uint64_t page) {
+    uint64_t h = page >> HUGE_BITS;
+    return huge_map != NULL && ((huge_map[h >> 6] >> (h & 63)) & 1);
+}
+
+// Key of the page, small or huge, that holds logical page `page`
+static inline uint64_t page_key(uint64_t page) {
+    return is_huge(page) ? HUGE_TAG | page >> HUGE_BITS : page;
+}
+
+/* With several processes, the keys of physical pages (and of
+ * TLB terms, if ASID-tagged) carry the process id from bit
+ * PID_SHIFT up, just above the logical page.
+ */
+int PID_SHIFT = 63;
+uint64_t PAGE_KEY_MASK = UINT64_MAX;  // Takes the logical page from a key
+
 // Main memory size
-#define MM_SIZE (P_PAGES * PAGE_SIZE)
-// TLB size
-#define TLB_SIZE 16
-// Offset bit used to take the offset segment from address
-#define OFFSET 8
+#define MM_SIZE(s) ((size_t)(s)->p_pages * PAGE_SIZE)
 
-// Replacement Strategy 
-//Valid Options: fifo, FIFO, lru, LRU
-char* RS = "FIFO";
+void set_geometry(int page_bits, int va_bits) {
+    OFFSET = page_bits;
+    VA_BITS = va_bits;
+    PAGE_SIZE = 1ULL << page_bits;
+    OFFSET_MASK = PAGE_SIZE - 1;
+    V_PAGES = 1ULL << (va_bits - page_bits);
+    VPAGE_MASK = V_PAGES - 1;
+}
 
-struct TLB {
-    int phy;  // Physical page
-    int log;  // Logical page
-    char prev;  // Index of the previous TLB term in double linked-list
-    char next;  // Index of the next TLB term in double linked-list
-} tlb[TLB_SIZE];
-int tlb_head, tlb_tail, tlb_size;
+// Max-heap of items keyed by their next use, see the OPT methods
+struct opt_heap {
+    int *item;  // Items in heap order
+    int *pos;  // Position of every item in `item`, -1 if absent
+    uint32_t *key;  // Next use of every item
+    int size;
+};
 
+struct policy;
+struct policy_ops;
+struct page_table;
+struct page_table_ops;
+struct tlb;
+struct series;
+struct wset;
 
-struct PAGE {
-    int phy;  // Physical page
-    short prev;  // Index of the previous PT term in double linked-list
-    short next;  // Index of the next PT term in double linked-list
-} pt[V_PAGES];
-int pt_head, pt_tail, pt_size;
+// A stream of the stride prefetcher
+struct stream {
+    uint64_t last;  // Last page
+    int64_t stride;
+    int conf;  // Times in a row the stride was confirmed
+    uint64_t used;  // Last use, 0 if never
+};
+#define N_STREAMS 16
 
-char *mm;  // Main memory
-char *bs;  // Backing-store file
-FILE *fp;  // Address file pointer
+// A level of the data cache, see `cache_access`
+#define MAX_CACHES 3
+struct cache {
+    uint64_t size;  // Bytes
+    int ways, repl;
+    double ns;  // Latency of a lookup
+    struct tlb *t;  // Its sets, keyed by physical line
+    uint64_t accesses, hits;
+};
 
+// A process of a multiprogrammed run
+struct proc {
+    struct page_table *pt;
+    struct policy *frames;  // Its own pages, with local replacement
+    uint64_t accesses, tlb_hit, stlb_hit, page_fault;
+};
 
 /***********************************************************
-*    Here we implement the find and the replace method of  *
-*  both TLB and page table.                                *
+*    Everything one simulation touches lives in a `struct  *
+*  sim`, so several configurations can be simulated in the *
+*  same process (see `run_sweep`). Only the backing store  *
+*  and the trace are shared, and both are read-only.       *
 ************************************************************/
+struct sim {
+// Configuration
+    const struct policy_ops *tlb_ops, *pt_ops;  // Replacement policies
+    int p_pages;  // Number of physical pages
+    int tlb_entries;  // TLB size
+    int tlb_ways, tlb_repl;  // Set-associative TLB, `tlb_ways` is 0 if fully associative
+    int stlb_entries, stlb_ways, stlb_repl;  // Second-level TLB, none if `stlb_entries` is 0
+    const struct page_table_ops *pt_type;  // Kind of page table
+    int huge_frames, htlb_entries;  // Huge frames, and entries of a separate huge page TLB or 0
+    int prefetch, prefetch_depth;  // Prefetcher and how many pages it reads ahead
+    int clean_first;  // Victims drawn looking for a clean one, 0 to take the first
+    double read_cost, write_cost;  // Microseconds to read or write one page
+    int resize;  // Dynamic frame allocation, RESIZE_NONE to keep all frames
+    uint64_t resize_interval, ws_tau;  // Accesses between revisions, working set window
+    double pff_high, pff_low;  // Fault rates that grow or shrink the allocation
+    int n_procs, local, asid;  // Processes, local replacement, ASID-tagged rather than flushed TLB
+    uint64_t quantum;  // Accesses per time slice
+    int n_caches, line_bits;  // Data cache levels, none if `n_caches` is 0, and their line size
+    double mem_ns, stlb_ns, walk_ns;  // Latencies of memory, an STLB hit and a page walk reference
+// TLBs, their keys are logical pages
+    struct tlb *tlb, *stlb;
+// Page table, the keys of `frames` are the logical pages held by physical pages
+    struct page_table *pt;
+    struct policy *frames;
+    int *free_frames, n_free_frames;  // Unused physical pages
+    char *mm;  // Main memory
+    char *bs;  // Private copy of the backing store that dirty pages are written back to
+    unsigned char *dirty, *hdirty;  // Dirty bit of every physical page and huge frame
+// The same for huge pages, whose frames start at page `huge_base` of main memory
+    struct tlb *htlb;
+    struct page_table *hpt;
+    struct policy *hframes;
+    int *free_hframes, n_free_hframes;
+    uint64_t huge_base;
+// Readahead state, `pf_flag` marks the physical pages prefetched and not used yet
+    unsigned char *pf_flag;
+    struct stream streams[N_STREAMS];
+    uint64_t ra_start, ra_marker, ra_prev;
+    int ra_size;
+// OPT bookkeeping
+    const uint32_t *next_use;  // Next-use index of the trace
+    uint64_t now;  // Index of the current access in the trace
+    struct series *series;  // Time series output, NULL if none
+// Multiprogramming, `pt` and (with local replacement) `frames` are those of process `cur`
+    struct proc *procs, *proc_stats;
+    int cur;
+    uint64_t page_tag, tlb_tag;  // Process id as put in page and TLB keys
+    uint64_t switches;  // Context switches
+    uint64_t mark[4];  // Counters at the last context switch
+// Dynamic frame allocation
+    int alloc, peak_alloc;  // Frames the small pages may take, and the most they have held
+    uint64_t resize_at, resize_faults;  // Next revision, faults at the last one
+    uint64_t alloc_accesses;  // Sum of `alloc` over all accesses, for the average
+    struct wset *ws;  // Working set, NULL unless resizing by it
+    struct cache caches[MAX_CACHES];  // L1 first
+// Results
+    uint64_t accesses, tlb_hit, stlb_hit, page_fault;
+    uint64_t huge_accesses, huge_tlb_hit, huge_fault;  // The part of the above on huge pages
+    uint64_t pf_issued, pf_used, pf_polluted;  // Pages prefetched, used, evicted before use
+    uint64_t writes, wb_sync, wb_async, wb_bytes;  // Write accesses, write-backs on eviction and in the background
+    double stall_us, background_us;  // Estimated I/O time the accesses waited for, and did not
+    uint64_t walk_refs, pt_bytes;  // Page walk references, page table size at the end
+    double secs;  // Wall time spent in the main loop
+};
+
+int bs_fd;  // Backing-store file, every simulation maps its own writable copy
+uint64_t bs_size;  // Backing-store size, pages past its end read as zeros
 
 
 /***********************************************************
-*    In `tlb_find_fifo`, we just search for the required   *
-*  logical page. If exists, return the corresponding phy-  *
-*  sical page; otherwise return -1.                        *
+*    Besides the plain text format (one decimal address    *
+*  per line), the simulator reads a binary trace format.   *
+*  A binary trace starts with a 16-byte header:            *
+*    bytes 0-3   magic "VMTR"                              *
+*    bytes 4-5   version (little-endian)                   *
+*    byte  6     record width in bytes (1, 2, 4 or 8)      *
+*    byte  7     flags, bit 0 TRACE_WRITES                 *
+*    bytes 8-15  record count (little-endian)              *
+*  followed by `count` fixed-width little-endian records,  *
+*  one logical address each. With TRACE_WRITES, the top    *
+*  bit of a record marks a write and the address is the    *
+*  bits below it. A text line marks a write by putting W   *
+*  (or R, for a read) before the address. Records handed   *
+*  to the simulator carry the write mark in WRITE_BIT, so  *
+*  addresses are at most 63 bits. A binary trace is mmap'ed*
+*  just like the backing store, and the main loop walks it *
+*  in batches of `BATCH` addresses, so no parsing happens  *
+*  on the hot path.                                        *
+*                                                          *
+*    Standard input (`-`), a pipe or a FIFO cannot be      *
+*  mapped or rewound. Such a stream is read STREAM_BUFFER  *
+*  bytes at a time, and a batch ends early when the input  *
+*  has no more for now, so a live producer is simulated as *
+*  it goes. The header of a binary stream may give a count *
+*  of 0, records are read up to the end of the input.      *
 ************************************************************/
-int tlb_find_fifo(int log) {
+#define TRACE_MAGIC "VMTR"
+#define TRACE_VERSION 1
+#define TRACE_HEADER_SIZE 16
+#define TRACE_WRITES 1
+#define WRITE_BIT (1ULL << 63)
+// Number of addresses handed to the main loop at a time
+#define BATCH 4096
+#define STREAM_BUFFER (1 << 20)
+
+struct trace {
+    FILE *fp;  // Text trace, NULL for a binary one
+    const unsigned char *map;  // Mapped binary trace, header included
+    size_t map_size;
+    const unsigned char *data;  // First record
+    int width;  // Bytes per binary record
+    int flags;
+    uint64_t count;  // Number of binary records
+    uint64_t pos;  // Index of the next binary record
+// Streamed input, the bytes read and not consumed yet are sbuf[soff, slen)
+    int stream, fd, eof;
+    unsigned char *sbuf;
+    size_t soff, slen;
+};
+
+// Read a `width`-byte little-endian integer
+uint64_t load_le(const unsigned char *p, int width) {
+    uint64_t v = 0;
     int i;
-    for (i = 0; i < tlb_size; ++i) {
-        if (tlb[i].log == log) return tlb[i].phy;
-    }
-    return -1;
+    for (i = width - 1; i >= 0; --i) v = (v << 8) | p[i];
+    return v;
 }
 
-/***********************************************************
-*    In tlb_replace_fifo, we also just replace the earli-  *
-*  est TLB term, which is followed by `tlb_tail`. We also  *
-*  use variable `tlb_size` to keep track of the TLB size.  *
-*  If TLB is not null, the searching in `tlb_find_fifo`    *
-*  will shrink a little.                                   *
-************************************************************/
-void tlb_replace_fifo(int log, int phy) {
-    if (tlb_size < TLB_SIZE) ++tlb_size;  // Track the TLB size
-    tlb[tlb_tail].log = log;
-    tlb[tlb_tail].phy = phy;
-    tlb_tail = (tlb_tail + 1) % TLB_SIZE;  // Circular growth
+// Write `v` as a `width`-byte little-endian integer
+void store_le(unsigned char *p, uint64_t v, int width) {
+    int i;
+    for (i = 0; i < width; ++i) {
+        p[i] = v & 0xff;
+        v >>= 8;
+    }
 }
 
 /***********************************************************
-*    We use a double linked-list to maintain the access of *
-*  TLB terms. The recently visited term will be closer to  *
-*  the head of the list. Once we find a TLB term, we need  *
-*  to move it to the head.                                 *
+*    `trace_open` tells the two formats apart by the magic *
+*  number. A binary trace is checked against its header so *
+*  that a truncated file is rejected up front instead of   *
+*  faulting in the middle of a run.                        *
 ************************************************************/
+void trace_header(struct trace *t, const unsigned char *head, const char *path) {
+    t->width = head[6];
+    t->flags = head[7];
+    t->count = load_le(head + 8, 8);
+    if (load_le(head + 4, 2) != TRACE_VERSION
+        || (t->width != 1 && t->width != 2 && t->width != 4 && t->width != 8)) {
+        printf("%s: unsupported trace version or record width\n", path);
+        exit(1);
+    }
+}
 
-/* The change of the linkage:
- *   1. (head = p -> next) : return
- *   2. (prev -> p -> next) : (prev -> next) && (p -> head) && (head = p)
- *   3. (prev -> p = tail) : (p -> head) && (head = p) && (tail = prev)
+/* Read more of a stream behind what is left, return 0 at its end, or
+ * -1 if a stop signal cut the read short. Nothing is taken then, so a
+ * record split by the end of the buffer is left whole for the next run.
  */
-int tlb_find_lru(int log) {
-// Find the logical page through the linked-list
-    int i = tlb_head;
-    while (i != -1 && tlb[i].log != log) {
-        i = tlb[i].next;
-    }
-    if (i == -1) return -1;  // If not find, return -1
-    if (i == tlb_head) return tlb[i].phy;  // If it is already the head, return
-    tlb[tlb[i].prev].next = tlb[i].next;  // Link the previous node to the next node
-    if (i != tlb_tail)
-        tlb[tlb[i].next].prev = tlb[i].prev;  // Link the next node to the previous node
-    else
-        tlb_tail = tlb[i].prev;  // Update `tlb_tail` if needed
-    tlb[i].next = tlb_head;  // Link the current node to the head
-    tlb[i].prev = -1;
-    tlb[tlb_head].prev = i;  // Link the old head node to the current node
-    tlb_head = i;  // Update `tlb_head`
-    return tlb[i].phy;
-}
-
-/***********************************************************
-*  When we need to replace, there are three situations:    *
-*    1. When TLB is empty, initialize the linked-list      *
-*    2. When TLB is neither empty nor full, link the new   *
-*    node to the head                                      *
-*    3. When TLB is full, replace the tail of the linked-  *
-*    list, and link it to the head                         *
-************************************************************/
+int stream_fill(struct trace *t) {
+    memmove(t->sbuf, t->sbuf + t->soff, t->slen - t->soff);
+    t->slen -= t->soff;
+    t->soff = 0;
+    ssize_t r = read(t->fd, t->sbuf + t->slen, STREAM_BUFFER - t->slen);
+    if (r < 0 && errno == EINTR) return -1;
+    if (r <= 0) return 0;
+    t->slen += r;
+    return 1;
+}
 
-/* The change of the linkage:
- *   1. (empty) : (head = p = tail)
- *   2. (not empty) && (not full) : (p -> head) && (head = p)
- *   3. (full) && (p -> tail) : (q replace tail) && (tail = p) && (q -> head) && (head = q)
- */
+int stream_open(struct trace *t, int fd, const char *path) {
+    t->stream = 1;
+    t->fd = fd;
+    t->sbuf = malloc(STREAM_BUFFER);
+    while (t->slen < 4 && stream_fill(t));
+    if (t->slen < 4 || memcmp(t->sbuf, TRACE_MAGIC, 4) != 0) return 0;  // Text
+    while (t->slen < TRACE_HEADER_SIZE && stream_fill(t));
+    if (t->slen < TRACE_HEADER_SIZE) {
+        printf("%s: trace is truncated\n", path);
+        exit(1);
+    }
+    trace_header(t, t->sbuf, path);
+    t->soff = TRACE_HEADER_SIZE;
+    return 0;
+}
 
-void tlb_replace_lru(int log, int phy) {
-// If empty, initialize the linked-list
-    if (tlb_size == 0) {
-        tlb_head = tlb_tail = 0;  tlb_size = 1;
-        tlb[0].log = log;  tlb[0].phy = phy;
-        return;
+int trace_open(struct trace *t, const char *path) {
+    unsigned char head[TRACE_HEADER_SIZE];
+    struct stat st;
+    memset(t, 0, sizeof(*t));
+    int fd = strcmp(path, "-") == 0 ? 0 : open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0) return -1;
+    if (!S_ISREG(st.st_mode)) return stream_open(t, fd, path);
+    FILE *fp = fdopen(fd, "r");
+    if (fp == NULL) return -1;
+    if (fread(head, 1, TRACE_HEADER_SIZE, fp) != TRACE_HEADER_SIZE
+        || memcmp(head, TRACE_MAGIC, 4) != 0) {
+    // Not a binary trace, read it as text
+        rewind(fp);
+        setvbuf(fp, NULL, _IOFBF, STREAM_BUFFER);
+        t->fp = fp;
+        return 0;
     }
-// If not full, link the new node to the head
-    if (tlb_size < TLB_SIZE) {
-        tlb[tlb_head].prev = tlb_size;
-        tlb[tlb_size].next = tlb_head;
-        tlb[tlb_size].log = log;
-        tlb[tlb_size].phy = phy;
-        tlb_head = tlb_size;
-        ++tlb_size;
-        return;
+    trace_header(t, head, path);
+    if ((uint64_t)st.st_size < TRACE_HEADER_SIZE + t->count * t->width) {
+        printf("%s: trace is truncated\n", path);
+        exit(1);
+    }
+    t->map_size = st.st_size;
+    t->map = mmap(0, t->map_size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+    fclose(fp);
+    if (t->map == MAP_FAILED) return -1;
+    madvise((void *)t->map, t->map_size, MADV_SEQUENTIAL);
+    t->data = t->map + TRACE_HEADER_SIZE;
+    return 0;
+}
+
+// Read one text record, an address optionally after R or W
+int text_record(FILE *fp, uint64_t *rec) {
+    long long v;
+    char rw = 0;
+    if (fscanf(fp, " %c", &rw) != 1) return 0;
+    if (rw != 'W' && rw != 'w' && rw != 'R' && rw != 'r') ungetc(rw, fp);
+    if (fscanf(fp, "%lld", &v) != 1) return 0;
+    *rec = (uint64_t)v | (rw == 'W' || rw == 'w' ? WRITE_BIT : 0);
+    return 1;
+}
+
+// Decode `n` binary records at `p` into `buf`
+void decode_records(const unsigned char *p, int width, int flags, uint64_t *buf, int n) {
+    int i;
+    switch (width) {  // Constant widths let the loads be a single move
+        case 1: for (i = 0; i < n; ++i) buf[i] = p[i]; break;
+        case 2: for (i = 0; i < n; ++i) buf[i] = load_le(p + 2 * i, 2); break;
+        case 4: for (i = 0; i < n; ++i) buf[i] = load_le(p + 4 * i, 4); break;
+        default: for (i = 0; i < n; ++i) buf[i] = load_le(p + 8 * i, 8); break;
+    }
+    if ((flags & TRACE_WRITES) && width < 8) {
+        uint64_t top = 1ULL << (8 * width - 1);
+        for (i = 0; i < n; ++i)
+            if (buf[i] & top) buf[i] ^= top | WRITE_BIT;
     }
-// If full, replace tail and link it to the head
-    int i = tlb_tail;
-    tlb[tlb[i].prev].next = -1;  // Unlink tail
-    tlb_tail = tlb[i].prev;  // Update `tlb_tail`
-    tlb[i].next = tlb_head;  // Link new node to head
-    tlb[i].prev = -1;
-    tlb[tlb_head].prev = i;  // Link head to new node
-    tlb_head = i;  // Update `tlb_head`
-    tlb[i].log = log;  tlb[i].phy = phy;  // Update term
-}
-
-/* PS: Since the TLB is implemented by an array, we can just
- *   SWAP the current term and the head term to simulate the
- *   'recent used' feature, and thus can be free from double
- *   linked-list.
- * 
- * e.g. when (access p) && (prev -> p -> next) : (SWAP p and head)
+}
+
+// Decode the `n` records starting at `pos` into `buf`
+void trace_read_at(const struct trace *t, uint64_t pos, uint64_t *buf, int n) {
+    decode_records(t->data + pos * t->width, t->width, t->flags, buf, n);
+}
+
+// The records of a binary stream that are already in, at least one
+int stream_binary(struct trace *t, uint64_t *buf, int n) {
+    while (t->slen - t->soff < (size_t)t->width)
+        if (stream_fill(t) <= 0) return 0;
+    size_t avail = (t->slen - t->soff) / t->width;
+    if (avail < (size_t)n) n = avail;
+    decode_records(t->sbuf + t->soff, t->width, t->flags, buf, n);
+    t->soff += (size_t)n * t->width;
+    return n;
+}
+
+/* The records of a text stream that are already in, as `text_record`
+ * reads them. A record cut by the end of the buffer waits for more,
+ * anything that is not a record ends the trace.
  */
+int stream_text(struct trace *t, uint64_t *buf, int n) {
+    int i = 0;
+    for (;;) {
+        while (i < n) {
+            unsigned char *p = t->sbuf + t->soff, *end = t->sbuf + t->slen;
+            uint64_t rec = 0, v = 0;
+            int neg = 0, digits = 0;
+            while (p < end && (*p == ' ' || (*p >= '\t' && *p <= '\r'))) ++p;
+            if (p < end && (*p == 'W' || *p == 'w')) rec = WRITE_BIT, ++p;
+            else if (p < end && (*p == 'R' || *p == 'r')) ++p;
+            while (p < end && (*p == ' ' || (*p >= '\t' && *p <= '\r'))) ++p;
+            if (p < end && (*p == '-' || *p == '+')) neg = *p++ == '-';
+            for (; p < end && *p >= '0' && *p <= '9'; ++p, ++digits) v = 10 * v + (*p - '0');
+            if (p == end && !t->eof) break;  // May go on in the next read
+            if (digits == 0) {
+                t->eof = 1;
+                t->soff = t->slen;
+                return i;
+            }
+            buf[i++] = rec | (neg ? -v : v);
+            t->soff = p - t->sbuf;
+        }
+        if (i > 0 || t->eof) return i;
+        int r = stream_fill(t);
+        if (r < 0) return 0;
+        if (r == 0) t->eof = 1;
+    }
+}
+
+// Fill `buf` with at most `n` addresses, return how many were read
+int trace_read(struct trace *t, uint64_t *buf, int n) {
+    int i = 0;
+    if (t->stream) return t->width ? stream_binary(t, buf, n) : stream_text(t, buf, n);
+    if (t->fp != NULL) {
+        while (i < n && text_record(t->fp, &buf[i])) ++i;
+        return i;
+    }
+    if ((uint64_t)n > t->count - t->pos) n = t->count - t->pos;
+    trace_read_at(t, t->pos, buf, n);
+    t->pos += n;
+    return n;
+}
 
+// Skip the first `n` records
+void trace_skip(struct trace *t, uint64_t n) {
+    uint64_t buf[BATCH];
+    int k;
+    if (t->fp == NULL && !t->stream) {
+        t->pos = n < t->count ? n : t->count;
+        return;
+    }
+    for (; n > 0 && (k = trace_read(t, buf, n < BATCH ? n : BATCH)) > 0; n -= k);
+}
 
+void stream_close(struct trace *t) {
+    free(t->sbuf);
+    if (t->fd != 0) close(t->fd);
+    t->stream = 0;
+}
 
 /***********************************************************
-*    Since the index of a logical page is fixed in a page  *
-*  table, we can no longer use the style in what TLB uses. *
-*  Instead, we use a single linked-list to implement the   *
-*  FIFO page table replacement. In `pt_find_fifo`, we can  *
-*  directly return the needed page.                        *
+*    A text trace or a stream can only be read front to    *
+*  back, once. When several simulations replay the same    *
+*  trace, it is read into memory first and then looks      *
+*  exactly like a binary trace with 8-byte records.        *
 ************************************************************/
+int trace_load(struct trace *t) {
+    if (t->fp == NULL && !t->stream) return 0;
+    uint64_t cap = 1 << 16, *a = malloc(cap * sizeof(uint64_t)), count = 0;
+    int n;
+    for (;;) {
+        if (count + BATCH > cap) a = realloc(a, (cap *= 2) * sizeof(uint64_t));
+        if (a == NULL) return -1;
+        if ((n = trace_read(t, a + count, BATCH)) == 0) break;
+        count += n;
+    }
+    if (t->fp != NULL) fclose(t->fp);
+    if (t->stream) stream_close(t);
+    t->fp = NULL;
+    t->data = (const unsigned char *)a;  // Little-endian host
+    t->width = 8;
+    t->flags = TRACE_WRITES;  // The write mark already sits in the top bit
+    t->count = count;
+    t->pos = 0;
+    return 0;
+}
+
+void trace_close(struct trace *t) {
+    if (t->fp != NULL) fclose(t->fp);
+    if (t->stream) stream_close(t);
+    if (t->map != NULL) munmap((void *)t->map, t->map_size);
+    else if (t->data != NULL) free((void *)t->data);
+}
 
-int pt_find_fifo(int log) {
-    return pt[log].phy;
+/***********************************************************
+*    `convert_trace` turns a text trace into a binary one. *
+*  The records are streamed to the output, and the count   *
+*  and flags in the header are patched once the input is   *
+*  exhausted. Once a trace has writes, the top bit of each *
+*  record is the write mark, so no address may use it.     *
+************************************************************/
+int convert_trace(const char *in, const char *out, int width) {
+    FILE *ifp = fopen(in, "r"), *ofp = fopen(out, "w");
+    if (ifp == NULL || ofp == NULL) {
+        printf("Cannot open %s\n", ifp == NULL ? in : out);
+        return 1;
+    }
+    unsigned char head[TRACE_HEADER_SIZE] = TRACE_MAGIC, rec[8];
+    store_le(head + 4, TRACE_VERSION, 2);
+    head[6] = width;
+    fwrite(head, 1, TRACE_HEADER_SIZE, ofp);
+    uint64_t count = 0, limit = width == 8 ? UINT64_MAX : (1ULL << (8 * width)) - 1, v;
+    uint64_t top = 1ULL << (8 * width - 1), used = 0;  // Address bits used so far
+    int writes = 0;
+    while (text_record(ifp, &v)) {
+        uint64_t addr = v & ~WRITE_BIT;
+        used |= addr;
+        writes |= (v & WRITE_BIT) != 0;
+        if (addr > limit || (writes && (used & top))) {
+            printf("Address %llu does not fit in %d bytes, try a wider -w\n",
+                (unsigned long long)addr, width);
+            return 1;
+        }
+        store_le(rec, addr | (v & WRITE_BIT ? top : 0), width);
+        fwrite(rec, 1, width, ofp);
+        ++count;
+    }
+    head[7] = writes ? TRACE_WRITES : 0;
+    store_le(head + 8, count, 8);
+    fseek(ofp, 0, SEEK_SET);
+    fwrite(head, 1, TRACE_HEADER_SIZE, ofp);
+    fclose(ifp);
+    if (fclose(ofp) != 0) {
+        perror(out);
+        return 1;
+    }
+    printf("Converted %llu addresses%s\n", (unsigned long long)count, writes ? " with writes" : "");
+    return 0;
 }
 
+
 /***********************************************************
-*  When we need to replace, there are three situations:    *
-*    1. When physical page is empty, initialize the list   *
-*    2. When physical page is neither empty nor full, link *
-*    the new node to the tail                              *
-*    3. When physical page is full, delete the node at the *
-*    head, allocate the physical page to the new logical   *
-*    page, and link the new node to the tail.              *
+*    A growable hash map from logical pages to integers,   *
+*  for the per-page bookkeeping of whole-trace passes (the *
+*  OPT next-use index, the LRU sweep). A flat array per    *
+*  page would not fit a 48-bit address space.              *
 ************************************************************/
+struct page_map {
+    uint64_t *page;  // Page in each bucket, NO_PAGE if empty
+    int64_t *value;
+    uint64_t mask, size;  // Bucket mask, number of pages stored
+};
+#define NO_PAGE UINT64_MAX
 
-void pt_replace_fifo(int log) {
-// If empty, initialize the list
-    if (pt_size == 0) {
-        pt[log].phy = 0;
-        pt_head = pt_tail = log;  pt_size = 1;
-        return;
+void pmap_init(struct page_map *m, uint64_t n) {
+    uint64_t buckets = 16, i;
+    while (buckets < 2 * n) buckets <<= 1;
+    m->page = malloc(buckets * sizeof(uint64_t));
+    m->value = malloc(buckets * sizeof(int64_t));
+    for (i = 0; i < buckets; ++i) m->page[i] = NO_PAGE;
+    m->mask = buckets - 1;
+    m->size = 0;
+}
+
+void pmap_free(struct page_map *m) {
+    free(m->page);  free(m->value);
+}
+
+static inline uint64_t pmap_bucket(const struct page_map *m, uint64_t page) {
+    return (page * 0x9E3779B97F4A7C15ULL >> 20) & m->mask;
+}
+
+// Value slot of `page`, added with value `init` if absent
+int64_t *pmap_get(struct page_map *m, uint64_t page, int64_t init) {
+    uint64_t b = pmap_bucket(m, page);
+    while (m->page[b] != page) {
+        if (m->page[b] == NO_PAGE) {
+            if (2 * (m->size + 1) > m->mask + 1) {
+            // Keep the load under 1/2: rehash into twice the buckets
+                struct page_map old = *m;
+                uint64_t i;
+                pmap_init(m, m->mask + 1);
+                for (i = 0; i <= old.mask; ++i)
+                    if (old.page[i] != NO_PAGE) *pmap_get(m, old.page[i], 0) = old.value[i];
+                pmap_free(&old);
+                return pmap_get(m, page, init);
+            }
+            m->page[b] = page;
+            m->value[b] = init;
+            ++m->size;
+            break;
+        }
+        b = (b + 1) & m->mask;
     }
-// If not full, link the new node to the tail
-    if (pt_size < P_PAGES) {
-        pt[log].phy = pt_size;
-        pt[pt_tail].next = log;
-        pt_tail = log;
-        ++pt_size;
-        return;
+    return &m->value[b];
+}
+
+/* Remove `page` if present. Later pages of its probe run move back
+ * into the hole unless their own bucket lies after it, so lookups
+ * never stop short at an empty bucket.
+ */
+void pmap_del(struct page_map *m, uint64_t page) {
+    uint64_t b = pmap_bucket(m, page), j;
+    while (m->page[b] != page) {
+        if (m->page[b] == NO_PAGE) return;
+        b = (b + 1) & m->mask;
+    }
+    for (j = (b + 1) & m->mask; m->page[j] != NO_PAGE; j = (j + 1) & m->mask) {
+        uint64_t home = pmap_bucket(m, m->page[j]);
+        if (((j - home) & m->mask) < ((j - b) & m->mask)) continue;
+        m->page[b] = m->page[j];
+        m->value[b] = m->value[j];
+        b = j;
     }
-    // Delete the node at the head
-    int i = pt_head, phy = pt[i].phy;
-    pt_head = pt[i].next;
-    pt[i].phy = pt[i].next = -1;
-    // Allocate the physical page to the new node
-    pt[log].phy = phy;
-    // Append the node to the tail
-    pt[pt_tail].next = log;
-    pt_tail = log;
+    m->page[b] = NO_PAGE;
+    --m->size;
+}
+
+/***********************************************************
+*    A checkpoint is the state of a simulation written to  *
+*  a file (`--checkpoint`) and read back into a fresh one  *
+*  (`--restore`). Each part of the state has one function  *
+*  for both ways, so saving and restoring cannot drift     *
+*  apart: `ck_io` writes or reads a field, `ck_check`      *
+*  writes a value of the configuration or reads it back    *
+*  and rejects the checkpoint if it differs.               *
+************************************************************/
+struct ckpt {
+    FILE *fp;
+    int save;  // Writing the state out rather than reading it back
+    int bad;  // Short read or write, or a configuration mismatch
+};
+
+void ck_io(struct ckpt *ck, void *p, size_t size) {
+    if (ck->bad || size == 0) return;
+    if ((ck->save ? fwrite(p, 1, size, ck->fp) : fread(p, 1, size, ck->fp)) != size) ck->bad = 1;
 }
+#define CK(ck, field) ck_io(ck, &(field), sizeof(field))
 
+void ck_check(struct ckpt *ck, uint64_t v) {
+    uint64_t saved = v;
+    ck_io(ck, &saved, sizeof(saved));
+    if (saved != v) ck->bad = 1;
+}
 
 /***********************************************************
-*    Similar to `tlb_find_lru`, we use double linked-list  *
-*  to maintain the access time. There is one difference:   *
-*  we no longer need to search for the logical page in the *
-*  linked-list, instead we can directly use it as an index.*
+*    A working set W(t, tau) is the set of distinct pages  *
+*  among the last `tau` accesses. `wset` keeps those       *
+*  accesses in a ring, and how often each page occurs in   *
+*  it, so every access updates the size in O(1).          *
 ************************************************************/
+struct wset {
+    uint64_t *ring;
+    uint64_t tau, count, size;  // Window, accesses seen, distinct pages in `ring`
+    struct page_map in_ring;  // Times every page occurs in `ring`
+};
 
-/* The change of the linkage:
- *   1. (head = p -> next) : return
- *   2. (prev -> p -> next) : (prev -> next) && (p -> head) && (head = p)
- *   3. (prev -> p = tail) : (p -> head) && (head = p) && (tail = prev)
+void wset_init(struct wset *w, uint64_t tau) {
+    w->ring = malloc(tau * sizeof(uint64_t));
+    w->tau = tau;
+    w->count = w->size = 0;
+    pmap_init(&w->in_ring, 1024);
+}
+
+void wset_free(struct wset *w) {
+    free(w->ring);
+    pmap_free(&w->in_ring);
+}
+
+void wset_add(struct wset *w, uint64_t page) {
+    uint64_t slot = w->count++ % w->tau;
+    if (w->count > w->tau && --*pmap_get(&w->in_ring, w->ring[slot], 0) == 0) --w->size;
+    w->ring[slot] = page;
+    if ((*pmap_get(&w->in_ring, page, 0))++ == 0) ++w->size;
+}
+
+void wset_ckpt(struct wset *w, struct ckpt *ck) {
+    uint64_t i, n;
+    ck_check(ck, w->tau);
+    CK(ck, w->count);
+    n = w->count < w->tau ? w->count : w->tau;
+    ck_io(ck, w->ring, n * sizeof(uint64_t));
+    if (ck->save || ck->bad) return;
+    for (i = 0; i < n; ++i)  // The counts follow from the ring
+        if ((*pmap_get(&w->in_ring, w->ring[i], 0))++ == 0) ++w->size;
+}
+
+// Dynamic frame allocation, see `resize_frames`
+enum { RESIZE_NONE, RESIZE_PFF, RESIZE_WS };
+const char *resize_names[] = {"none", "pff", "ws"};
+
+/***********************************************************
+*    Here we implement the replacement policies of both    *
+*  TLB and page table.                                     *
+*                                                          *
+*    Both are a fixed number of slots (TLB terms or phy-   *
+*  sical pages) that hold keys (logical pages). A policy   *
+*  only decides which slot to give up when a new key has   *
+*  to come in, and is written against `struct policy_ops`: *
+*    init     set up the policy's own state                *
+*    lookup   find the slot holding a key, -1 if none      *
+*    on_hit   a key was found in its slot                  *
+*    on_miss  a key was just placed in a slot              *
+*    evict    choose a victim slot and drop it             *
+*    remove   drop a given slot (TLB shootdown)            *
+*    touch    the page table page in a slot was accessed   *
+*             through the TLB, only OPT cares              *
+*    stats    print policy-specific counters               *
+*    ckpt     save or restore the policy's own state       *
+*  The bookkeeping every policy needs, the key held by     *
+*  each slot and a hash index from keys to slots, lives in *
+*  `struct policy`, the head of every policy's state. The  *
+*  page table is its own index, so the physical pages are  *
+*  managed without one and never call `lookup`.            *
+************************************************************/
+#define NO_KEY UINT64_MAX
+
+// Open-addressing hash from keys to slots, the keys themselves live in `keys`
+struct keyindex {
+    int *slot;  // Slot stored in each bucket, -1 if empty
+    unsigned mask;
+    const uint64_t *keys;
+};
+
+struct policy;
+
+struct policy_ops {
+    const char *name;
+    size_t size;  // Size of the policy's state, `struct policy` included
+    int needs_next_use;  // Needs the next-use index of the trace
+    void (*init)(struct policy *p);
+    int (*lookup)(struct policy *p, uint64_t key);
+    void (*on_hit)(struct policy *p, int slot);
+    void (*on_miss)(struct policy *p, int slot);
+    int (*evict)(struct policy *p, uint64_t incoming);
+    void (*remove)(struct policy *p, int slot);
+    void (*touch)(struct policy *p, int slot);
+    void (*stats)(struct policy *p, FILE *out, const char *who);
+    void (*destroy)(struct policy *p);
+    void (*ckpt)(struct policy *p, struct ckpt *ck);
+};
+
+struct policy {
+    const struct policy_ops *ops;
+    struct sim *s;
+    int cap;  // Number of slots
+    int used;  // Number of occupied slots
+    uint64_t *key;  // Key held by each slot, NO_KEY if free
+    struct keyindex index;
+};
+
+unsigned key_hash(uint64_t key) {
+    return (key * 0x9E3779B97F4A7C15ULL) >> 32;
+}
+
+void index_init(struct keyindex *x, int n, const uint64_t *keys) {
+    unsigned size = 4;
+    while (size < 2 * (unsigned)n) size <<= 1;  // Keep the load factor under 1/2
+    x->slot = malloc(size * sizeof(int));
+    memset(x->slot, -1, size * sizeof(int));
+    x->mask = size - 1;
+    x->keys = keys;
+}
+
+int index_find(const struct keyindex *x, uint64_t key) {
+    unsigned b = key_hash(key) & x->mask;
+    int i;
+    while ((i = x->slot[b]) != -1) {
+        if (x->keys[i] == key) return i;
+        b = (b + 1) & x->mask;
+    }
+    return -1;
+}
+
+void index_put(struct keyindex *x, uint64_t key, int slot) {
+    unsigned b = key_hash(key) & x->mask;
+    while (x->slot[b] != -1) b = (b + 1) & x->mask;
+    x->slot[b] = slot;
+}
+
+/* Linear probing cannot just empty a bucket: the following
+ * buckets of the same run are shifted back into the hole
+ * unless they already sit at or after their home bucket.
  */
+void index_del(struct keyindex *x, uint64_t key) {
+    unsigned b = key_hash(key) & x->mask, next;
+    while (x->keys[x->slot[b]] != key) b = (b + 1) & x->mask;
+    for (next = (b + 1) & x->mask; x->slot[next] != -1; next = (next + 1) & x->mask) {
+        unsigned home = key_hash(x->keys[x->slot[next]]) & x->mask;
+        // Move `next` into the hole if its home is not in (b, next]
+        if (((next - home) & x->mask) >= ((next - b) & x->mask)) {
+            x->slot[b] = x->slot[next];
+            b = next;
+        }
+    }
+    x->slot[b] = -1;
+}
+
+// The default `lookup`, every policy but ARC's ghosts is happy with it
+int policy_find(struct policy *p, uint64_t key) {
+    return index_find(&p->index, key);
+}
+
+struct policy *policy_new(const struct policy_ops *ops, struct sim *s, int cap, int indexed) {
+    struct policy *p = calloc(1, ops->size);
+    int i;
+    p->ops = ops;  p->s = s;  p->cap = cap;
+    p->key = malloc(cap * sizeof(uint64_t));
+    for (i = 0; i < cap; ++i) p->key[i] = NO_KEY;
+    if (indexed) index_init(&p->index, cap, p->key);
+    if (ops->init != NULL) ops->init(p);
+    return p;
+}
+
+void policy_free(struct policy *p) {
+    if (p->ops->destroy != NULL) p->ops->destroy(p);
+    free(p->index.slot);
+    free(p->key);
+    free(p);
+}
 
-int pt_find_lru(int log) {
-    if (pt[log].phy == -1) return -1;  // If not exist, return -1
-    int i = log;
-    if (i == pt_head) return pt[i].phy;  // If it is head, return
-    pt[pt[i].prev].next = pt[i].next;  // Link prev to next
-    if (i != pt_tail)
-        pt[pt[i].next].prev = pt[i].prev;  // Link next to prev
-    else
-        pt_tail = pt[i].prev;  // Update `pt_tail` if needed
-    pt[i].next = pt_head;  // Link current to head
-    pt[i].prev = -1;
-    pt[pt_head].prev = i;  // Link old head to current
-    pt_head = i;  // Update `pt_head`
-    return pt[i].phy;
+// Place `key` in the free slot `slot`
+void policy_insert(struct policy *p, int slot, uint64_t key) {
+    p->key[slot] = key;
+    if (p->index.slot != NULL) index_put(&p->index, key, slot);
+    ++p->used;
+    p->ops->on_miss(p, slot);
 }
 
+// Free a slot for `incoming`, return it and the key it held
+int policy_evict(struct policy *p, uint64_t incoming, uint64_t *victim) {
+    int slot = p->ops->evict(p, incoming);
+    *victim = p->key[slot];
+    if (p->index.slot != NULL) index_del(&p->index, p->key[slot]);
+    p->key[slot] = NO_KEY;
+    --p->used;
+    return slot;
+}
+
+void policy_remove(struct policy *p, int slot) {
+    p->ops->remove(p, slot);
+    if (p->index.slot != NULL) index_del(&p->index, p->key[slot]);
+    p->key[slot] = NO_KEY;
+    --p->used;
+}
+
+extern const struct policy_ops policies[];
+
+void policy_ckpt(struct policy *p, struct ckpt *ck) {
+    ck_check(ck, p->ops - policies);
+    ck_check(ck, p->cap);
+    CK(ck, p->used);
+    ck_io(ck, p->key, p->cap * sizeof(uint64_t));
+    if (p->index.slot != NULL) ck_io(ck, p->index.slot, (p->index.mask + 1) * sizeof(int));
+    if (p->ops->ckpt != NULL) p->ops->ckpt(p, ck);
+}
+
+
 /***********************************************************
-*  When we need to replace, there are three situations:    *
-*    1. When PT is empty, initialize the linked-list       *
-*    2. When PT is neither empty nor full, link the new    *
-*    node to the head                                      *
-*    3. When PT is full, drop the tail of the linked-list, *
-*    allocate the physical page to the new node, and link  *
-*    it to the head                                        *
+*    Most policies keep their slots in a double linked-    *
+*  list. The recently inserted (or used) slot is closer to *
+*  the head of the list, the victim is taken at the tail.  *
 ************************************************************/
+struct dlist {
+    int *prev;  // Index of the previous slot in the list, -1 at the head
+    int *next;  // Index of the next slot in the list, -1 at the tail
+    int head, tail, size;
+};
+
+void dl_init(struct dlist *l, int n) {
+    l->prev = malloc(n * sizeof(int));
+    l->next = malloc(n * sizeof(int));
+    l->head = l->tail = -1;
+    l->size = 0;
+}
+
+void dl_free(struct dlist *l) {
+    free(l->prev);  free(l->next);
+}
 
 /* The change of the linkage:
  *   1. (empty) : (head = p = tail)
- *   2. (not empty) && (not full) : (p -> head) && (head = p)
- *   3. (full) && (p -> tail) && (new q) : (q->phy = tail->phy) && (tail = p) && (q -> head) && (head = q)
+ *   2. (not empty) : (p -> head) && (head = p)
  */
+void dl_push_front(struct dlist *l, int i) {
+    l->prev[i] = -1;
+    l->next[i] = l->head;
+    if (l->head != -1) l->prev[l->head] = i;
+    else l->tail = i;
+    l->head = i;
+    ++l->size;
+}
 
-void pt_replace_lru(int log) {
-// If empty, initialize the list
-    if (pt_size == 0) {
-        pt[log].phy = 0;
-        pt_head = pt_tail = log;  pt_size = 1;
-        return;
+/* The change of the linkage:
+ *   (prev -> p -> next) : (prev -> next), where a missing prev
+ *   or next means p was the head or the tail
+ */
+void dl_unlink(struct dlist *l, int i) {
+    if (l->prev[i] != -1) l->next[l->prev[i]] = l->next[i];
+    else l->head = l->next[i];
+    if (l->next[i] != -1) l->prev[l->next[i]] = l->prev[i];
+    else l->tail = l->prev[i];
+    --l->size;
+}
+
+int dl_pop_back(struct dlist *l) {
+    int i = l->tail;
+    dl_unlink(l, i);
+    return i;
+}
+
+void dl_move_front(struct dlist *l, int i) {
+    if (i == l->head) return;
+    dl_unlink(l, i);
+    dl_push_front(l, i);
+}
+
+void dl_ckpt(struct dlist *l, int n, struct ckpt *ck) {
+    ck_io(ck, l->prev, n * sizeof(int));
+    ck_io(ck, l->next, n * sizeof(int));
+    CK(ck, l->head);  CK(ck, l->tail);  CK(ck, l->size);
+}
+
+
+/***********************************************************
+*    FIFO, LRU and second chance share one state: a list   *
+*  of slots in insertion (FIFO, second chance) or access   *
+*  (LRU) order, plus reference bits for second chance.     *
+************************************************************/
+struct list_policy {
+    struct policy base;
+    struct dlist l;
+    char *ref;  // Reference bit of every slot, second chance only
+    uint64_t chances;  // Number of second chances given
+};
+
+void list_init(struct policy *p) {
+    struct list_policy *lp = (struct list_policy *)p;
+    dl_init(&lp->l, p->cap);
+    lp->ref = calloc(p->cap, 1);
+}
+
+void list_destroy(struct policy *p) {
+    struct list_policy *lp = (struct list_policy *)p;
+    dl_free(&lp->l);
+    free(lp->ref);
+}
+
+void list_push(struct policy *p, int slot) {
+    dl_push_front(&((struct list_policy *)p)->l, slot);
+}
+
+int list_pop(struct policy *p, uint64_t incoming) {
+    return dl_pop_back(&((struct list_policy *)p)->l);
+}
+
+void list_unlink(struct policy *p, int slot) {
+    dl_unlink(&((struct list_policy *)p)->l, slot);
+}
+
+void list_ckpt(struct policy *p, struct ckpt *ck) {
+    struct list_policy *lp = (struct list_policy *)p;
+    dl_ckpt(&lp->l, p->cap, ck);
+    ck_io(ck, lp->ref, p->cap);
+    CK(ck, lp->chances);
+}
+
+// FIFO ignores hits, the oldest slot is always the victim
+void fifo_hit(struct policy *p, int slot) {}
+
+// LRU moves a hit slot to the head, so the tail is the least recently used
+void lru_hit(struct policy *p, int slot) {
+    dl_move_front(&((struct list_policy *)p)->l, slot);
+}
+
+/***********************************************************
+*    Second chance is FIFO with a reference bit: an old    *
+*  slot that was used since it was queued gets its bit     *
+*  cleared and is queued again instead of being evicted.   *
+************************************************************/
+void sc_hit(struct policy *p, int slot) {
+    ((struct list_policy *)p)->ref[slot] = 1;
+}
+
+void sc_miss(struct policy *p, int slot) {
+    struct list_policy *lp = (struct list_policy *)p;
+    lp->ref[slot] = 1;  // Loading a page is a reference to it
+    dl_push_front(&lp->l, slot);
+}
+
+int sc_evict(struct policy *p, uint64_t incoming) {
+    struct list_policy *lp = (struct list_policy *)p;
+    while (lp->ref[lp->l.tail]) {
+        int i = dl_pop_back(&lp->l);
+        lp->ref[i] = 0;
+        dl_push_front(&lp->l, i);
+        ++lp->chances;
     }
-// If not full, link the node to the head
-    if (pt_size < P_PAGES) {
-        pt[log].phy = pt_size;
-        pt[pt_head].prev = log;
-        pt[log].next = pt_head;
-        pt_head = log;
-        ++pt_size;
-        return;
+    return dl_pop_back(&lp->l);
+}
+
+void sc_stats(struct policy *p, FILE *out, const char *who) {
+    fprintf(out, "%s second chances = %llu\n", who,
+        (unsigned long long)((struct list_policy *)p)->chances);
+}
+
+
+/***********************************************************
+*    CLOCK makes the same choices as second chance, but    *
+*  the way hardware-assisted kernels do it: the slots stay *
+*  where they are, and a hand sweeps over them clearing    *
+*  reference bits until it finds one that is clear. A new  *
+*  page lands right behind the hand, which is where second *
+*  chance would queue it.                                  *
+************************************************************/
+struct clock_policy {
+    struct policy base;
+    char *ref;  // Reference bit of every slot
+    int hand;
+    uint64_t cleared;  // Reference bits cleared by the hand
+};
+
+void clock_init(struct policy *p) {
+    ((struct clock_policy *)p)->ref = calloc(p->cap, 1);
+}
+
+void clock_destroy(struct policy *p) {
+    free(((struct clock_policy *)p)->ref);
+}
+
+void clock_hit(struct policy *p, int slot) {
+    ((struct clock_policy *)p)->ref[slot] = 1;
+}
+
+int clock_evict(struct policy *p, uint64_t incoming) {
+    struct clock_policy *cp = (struct clock_policy *)p;
+    for (;;) {
+        int i = cp->hand;
+        cp->hand = (cp->hand + 1) % p->cap;
+        if (p->key[i] == NO_KEY) continue;  // Free slot, nothing to evict
+        if (!cp->ref[i]) return i;
+        cp->ref[i] = 0;
+        ++cp->cleared;
     }
-    // Delete the tail node of the list
-    int i = pt_tail, phy = pt[i].phy;
-    pt[pt[i].prev].next = -1;
-    pt_tail = pt[i].prev;
-    pt[i].phy = pt[i].prev = pt[i].next = -1;
-    // Allocate the physical page to the new page
-    pt[log].phy = phy;
-    // Append the node to the head of the list
-    pt[log].next = pt_head;
-    pt[log].prev = -1;
-    pt[pt_head].prev = log;
-    pt_head = log;
-}
-
-// Function pointers
-
-int (*tlb_find)(int);
-void (*tlb_replace)(int, int);
-int (*pt_find)(int);
-void (*pt_replace)(int);
-
-void Init(int argc, const char *argv[]) {
-    int bs_fd = open(argv[1], O_RDONLY);
-    // mmap(start, length, prot, flags, fd, offset)
-    bs = mmap(0, BS_SIZE, PROT_READ, MAP_PRIVATE, bs_fd, 0);
+}
 
-    fp = fopen(argv[2], "r");
-// Initialize page table and TLB
-    int i = 0;
-    pt_head = -1;  pt_tail = -1;  pt_size = 0;
-    for (; i < V_PAGES; ++i) {
-        pt[i].phy = -1;  pt[i].prev = -1;  pt[i].next = -1;
+void clock_remove(struct policy *p, int slot) {
+    ((struct clock_policy *)p)->ref[slot] = 0;
+}
+
+void clock_stats(struct policy *p, FILE *out, const char *who) {
+    fprintf(out, "%s reference bits cleared = %llu\n", who,
+        (unsigned long long)((struct clock_policy *)p)->cleared);
+}
+
+void clock_ckpt(struct policy *p, struct ckpt *ck) {
+    struct clock_policy *cp = (struct clock_policy *)p;
+    ck_io(ck, cp->ref, p->cap);
+    CK(ck, cp->hand);  CK(ck, cp->cleared);
+}
+
+
+/***********************************************************
+*    For OPT and LFU the victim is the extreme of a key,   *
+*  so the slots sit in a heap. This is a max-heap; LFU     *
+*  stores inverted counts to get the least frequent first. *
+************************************************************/
+void heap_init(struct opt_heap *h, int n_items) {
+    h->item = malloc(n_items * sizeof(int));
+    h->pos = malloc(n_items * sizeof(int));
+    h->key = malloc(n_items * sizeof(uint32_t));
+    memset(h->pos, -1, n_items * sizeof(int));
+    h->size = 0;
+}
+
+void heap_free(struct opt_heap *h) {
+    free(h->item);  free(h->pos);  free(h->key);
+}
+
+void heap_swap(struct opt_heap *h, int i, int j) {
+    int t = h->item[i];
+    h->item[i] = h->item[j];  h->item[j] = t;
+    h->pos[h->item[i]] = i;  h->pos[h->item[j]] = j;
+}
+
+void heap_sift(struct opt_heap *h, int i) {
+// Up while the parent is smaller, then down while a child is larger
+    while (i > 0 && h->key[h->item[(i - 1) / 2]] < h->key[h->item[i]]) {
+        heap_swap(h, i, (i - 1) / 2);
+        i = (i - 1) / 2;
     }
+    for (;;) {
+        int c = 2 * i + 1;
+        if (c >= h->size) break;
+        if (c + 1 < h->size && h->key[h->item[c + 1]] > h->key[h->item[c]]) ++c;
+        if (h->key[h->item[c]] <= h->key[h->item[i]]) break;
+        heap_swap(h, i, c);
+        i = c;
+    }
+}
 
-    tlb_head = -1;  tlb_tail = -1;  tlb_size = 0;
-    for (i = 0; i < TLB_SIZE; ++i) {
-        tlb[i].prev = -1;  tlb[i].next = -1;
+// Insert `item`, or move it if it is already in the heap
+void heap_update(struct opt_heap *h, int item, uint32_t key) {
+    h->key[item] = key;
+    if (h->pos[item] == -1) {
+        h->item[h->size] = item;
+        h->pos[item] = h->size++;
     }
+    heap_sift(h, h->pos[item]);
+}
 
-	int opt;
-	char *string = "n:p:";
-	while((opt = getopt(argc, argv, string))!= -1)
-	{
-		// printf("%c %s\n", opt, optarg);
-		if (opt == 'n')
-			P_PAGES = atoi(optarg);
-		else if (opt == 'p')
-			RS = optarg;
-	}
-	mm = malloc(MM_SIZE);
+void heap_remove(struct opt_heap *h, int item) {
+    int i = h->pos[item];
+    heap_swap(h, i, --h->size);
+    h->pos[item] = -1;
+    if (i < h->size) heap_sift(h, i);
+}
 
-// Choose methods
-	if (strcmp(RS, "lru") == 0 || strcmp(RS, "LRU") == 0)
-	{
-		tlb_find = tlb_find_lru;
-		tlb_replace = tlb_replace_lru;
-		pt_find = pt_find_lru;
-		pt_replace = pt_replace_lru;
-	}
-	else if (strcmp(RS, "fifo") == 0 || strcmp(RS, "FIFO") == 0)
-	{
-		tlb_find = tlb_find_fifo;
-		tlb_replace = tlb_replace_fifo;
-		pt_find = pt_find_fifo;
-		pt_replace = pt_replace_fifo;
-	}
-	else
-	{
-		printf("Invalid strategy!\n");
-		exit(1);
-	}
+int heap_pop(struct opt_heap *h) {
+    int top = h->item[0];
+    heap_remove(h, top);
+    return top;
 }
 
-int main(int argc, const char *argv[]) {
-    if (argc < 3) {
-		printf("usage:./vm bs addresses.txt -p replacement_strategy -n n_physical_pages\n");
-        return 1;
-    }
-	//printf("%s %s\n", argv[1], argv[2]);
-    Init(argc,argv);
+struct heap_policy {
+    struct policy base;
+    struct opt_heap h;
+    uint32_t *count;  // LFU reference counts
+    uint64_t refs, agings;  // LFU references since the last aging, agings done
+};
 
-    int logical_address, tlb_hit = 0, page_fault = 0;
-    while (fscanf(fp, "%d", &logical_address) != EOF) {
-        int offset = logical_address & OFFSET_MASK;  // Take offset
-        int logical_page = (logical_address >> OFFSET) & VPAGE_MASK;  // Take logical page
-        int physical_page = tlb_find(logical_page);  // Find physical page in TLB
-        // TLB hit
-        if (physical_page != -1) {
-            ++tlb_hit;
+void heap_policy_init(struct policy *p) {
+    struct heap_policy *hp = (struct heap_policy *)p;
+    heap_init(&hp->h, p->cap);
+    hp->count = calloc(p->cap, sizeof(uint32_t));
+}
+
+void heap_policy_destroy(struct policy *p) {
+    struct heap_policy *hp = (struct heap_policy *)p;
+    heap_free(&hp->h);
+    free(hp->count);
+}
+
+int heap_policy_evict(struct policy *p, uint64_t incoming) {
+    return heap_pop(&((struct heap_policy *)p)->h);
+}
+
+void heap_policy_remove(struct policy *p, int slot) {
+    heap_remove(&((struct heap_policy *)p)->h, slot);
+}
+
+void heap_policy_ckpt(struct policy *p, struct ckpt *ck) {
+    struct heap_policy *hp = (struct heap_policy *)p;
+    ck_io(ck, hp->h.item, p->cap * sizeof(int));
+    ck_io(ck, hp->h.pos, p->cap * sizeof(int));
+    ck_io(ck, hp->h.key, p->cap * sizeof(uint32_t));
+    CK(ck, hp->h.size);
+    ck_io(ck, hp->count, p->cap * sizeof(uint32_t));
+    CK(ck, hp->refs);  CK(ck, hp->agings);
+}
+
+/***********************************************************
+*    OPT (Belady) evicts the page whose next use is the    *
+*  farthest in the future. Before the run, `build_next_use`*
+*  walks the trace backwards once and records for every    *
+*  access the index of the next access to the same page    *
+*  (NO_NEXT_USE if there is none). During the run, a slot  *
+*  is keyed on the next use of its page, so both updating  *
+*  a slot and choosing the victim cost O(log n) instead of *
+*  a rescan.                                               *
+*                                                          *
+*    The page table only hears about TLB misses, but OPT   *
+*  must compare the real next uses of all resident pages,  *
+*  so it also implements `touch` to hear about TLB hits.   *
+************************************************************/
+#define NO_NEXT_USE UINT32_MAX
+
+uint32_t *build_next_use(const struct trace *t) {
+    struct page_map last;  // Index of the next access to every page seen so far
+    uint32_t *next;
+    uint64_t buf[BATCH], pos = t->count;
+    int i;
+    if (t->count >= NO_NEXT_USE) {
+        printf("Trace is too long for OPT\n");
+        exit(1);
+    }
+    // The index can be far larger than memory wants to hold at once, let it page
+    next = mmap(0, t->count * sizeof(uint32_t) + 1, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (next == MAP_FAILED) {
+        perror("next-use index");
+        exit(1);
+    }
+    pmap_init(&last, 1024);
+    while (pos > 0) {
+        int n = pos < BATCH ? pos : BATCH;
+        pos -= n;
+        trace_read_at(t, pos, buf, n);
+        for (i = n - 1; i >= 0; --i) {
+            int64_t *l = pmap_get(&last, page_key((buf[i] >> OFFSET) & VPAGE_MASK), NO_NEXT_USE);
+            next[pos + i] = *l;
+            *l = pos + i;
         }
-        // TLB miss
-        else {
-            physical_page = pt_find(logical_page);  // Find physical page in page table
-            // page fault
+    }
+    pmap_free(&last);
+    return next;
+}
+
+void opt_use(struct policy *p, int slot) {
+    heap_update(&((struct heap_policy *)p)->h, slot, p->s->next_use[p->s->now]);
+}
+
+/***********************************************************
+*    LFU evicts the slot with the fewest references. Pure  *
+*  LFU never forgets, so a page that was hot long ago      *
+*  would stay forever; with aging, all counts are halved   *
+*  every LFU_AGE_PERIOD * capacity references.             *
+************************************************************/
+#define LFU_AGE_PERIOD 8
+
+void lfu_count(struct policy *p, int slot, uint32_t count) {
+    struct heap_policy *hp = (struct heap_policy *)p;
+    int i;
+    hp->count[slot] = count;
+    heap_update(&hp->h, slot, UINT32_MAX - count);
+    if (++hp->refs < (uint64_t)LFU_AGE_PERIOD * p->cap) return;
+    hp->refs = 0;
+    ++hp->agings;
+    for (i = 0; i < p->cap; ++i) {
+        if (p->key[i] == NO_KEY) continue;
+        hp->count[i] >>= 1;
+        heap_update(&hp->h, i, UINT32_MAX - hp->count[i]);
+    }
+}
+
+void lfu_hit(struct policy *p, int slot) {
+    uint32_t c = ((struct heap_policy *)p)->count[slot];
+    lfu_count(p, slot, c < UINT32_MAX - 1 ? c + 1 : c);
+}
+
+void lfu_miss(struct policy *p, int slot) {
+    lfu_count(p, slot, 1);
+}
+
+void lfu_stats(struct policy *p, FILE *out, const char *who) {
+    fprintf(out, "%s LFU agings = %llu\n", who,
+        (unsigned long long)((struct heap_policy *)p)->agings);
+}
+
+
+/***********************************************************
+*    ARC (Megiddo and Modha) splits the resident slots in  *
+*  T1, seen once recently, and T2, seen at least twice.    *
+*  It also remembers the keys recently evicted from either *
+*  list in the ghost lists B1 and B2. A miss that hits a   *
+*  ghost in B1 means T1 was too small, so the target size  *
+*  `p` of T1 grows; a ghost hit in B2 shrinks it. The      *
+*  victim comes from T1 when T1 is over its target.        *
+*                                                          *
+*    Ghosts need no slot, so they are kept in a separate   *
+*  pool of 2 * capacity nodes with their own hash index.   *
+************************************************************/
+struct arc_policy {
+    struct policy base;
+    struct dlist t1, t2;  // Resident slots, most recent at the head
+    char *in_t2;  // Whether each resident slot is on T2
+    struct dlist b1, b2;  // Ghost nodes, most recent at the head
+    uint64_t *ghost;  // Key of every ghost node, NO_KEY if free
+    char *in_b2;  // Whether each ghost node is on B2
+    struct keyindex gindex;
+    int *gfree, n_gfree;  // Free ghost nodes
+    int p;  // Target size of T1
+    int adapted;  // `p` was already adapted for the incoming key
+    uint64_t b1_hits, b2_hits;
+};
+
+void arc_init(struct policy *p) {
+    struct arc_policy *a = (struct arc_policy *)p;
+    int n = 2 * p->cap, i;
+    dl_init(&a->t1, p->cap);  dl_init(&a->t2, p->cap);
+    dl_init(&a->b1, n);  dl_init(&a->b2, n);
+    a->in_t2 = calloc(p->cap, 1);
+    a->in_b2 = calloc(n, 1);
+    a->ghost = malloc(n * sizeof(uint64_t));
+    a->gfree = malloc(n * sizeof(int));
+    for (i = 0; i < n; ++i) {
+        a->ghost[i] = NO_KEY;
+        a->gfree[i] = n - 1 - i;
+    }
+    a->n_gfree = n;
+    index_init(&a->gindex, n, a->ghost);
+}
+
+void arc_destroy(struct policy *p) {
+    struct arc_policy *a = (struct arc_policy *)p;
+    dl_free(&a->t1);  dl_free(&a->t2);  dl_free(&a->b1);  dl_free(&a->b2);
+    free(a->in_t2);  free(a->in_b2);  free(a->ghost);  free(a->gfree);
+    free(a->gindex.slot);
+}
+
+void arc_drop_ghost(struct arc_policy *a, int g) {
+    dl_unlink(a->in_b2[g] ? &a->b2 : &a->b1, g);
+    index_del(&a->gindex, a->ghost[g]);
+    a->ghost[g] = NO_KEY;
+    a->gfree[a->n_gfree++] = g;
+}
+
+void arc_add_ghost(struct arc_policy *a, uint64_t key, int to_b2) {
+    if (a->n_gfree == 0)  // Make room, oldest ghost of the longer list first
+        arc_drop_ghost(a, a->b1.size > a->b2.size ? a->b1.tail : a->b2.tail);
+    int g = a->gfree[--a->n_gfree];
+    a->ghost[g] = key;
+    a->in_b2[g] = to_b2;
+    index_put(&a->gindex, key, g);
+    dl_push_front(to_b2 ? &a->b2 : &a->b1, g);
+}
+
+// Move the target size of T1 towards the list whose ghost was hit
+void arc_adapt(struct arc_policy *a, uint64_t key) {
+    int g = index_find(&a->gindex, key), b1 = a->b1.size, b2 = a->b2.size;
+    if (a->adapted || g == -1) return;
+    if (!a->in_b2[g]) {
+        a->p += b1 >= b2 ? 1 : b2 / b1;
+        if (a->p > a->base.cap) a->p = a->base.cap;
+    } else {
+        a->p -= b2 >= b1 ? 1 : b1 / b2;
+        if (a->p < 0) a->p = 0;
+    }
+    a->adapted = 1;
+}
+
+void arc_hit(struct policy *p, int slot) {
+    struct arc_policy *a = (struct arc_policy *)p;
+    dl_unlink(a->in_t2[slot] ? &a->t2 : &a->t1, slot);
+    dl_push_front(&a->t2, slot);
+    a->in_t2[slot] = 1;
+}
+
+void arc_miss(struct policy *p, int slot) {
+    struct arc_policy *a = (struct arc_policy *)p;
+    uint64_t key = p->key[slot];
+    int g = index_find(&a->gindex, key);
+    arc_adapt(a, key);
+    a->adapted = 0;
+    if (g != -1) {
+    // Seen before: the key goes straight to T2
+        if (a->in_b2[g]) ++a->b2_hits; else ++a->b1_hits;
+        arc_drop_ghost(a, g);
+        dl_push_front(&a->t2, slot);
+        a->in_t2[slot] = 1;
+        return;
+    }
+    dl_push_front(&a->t1, slot);
+    a->in_t2[slot] = 0;
+// Keep |T1| + |B1| <= c and the whole directory within 2c
+    while (a->t1.size + a->b1.size > p->cap && a->b1.size > 0)
+        arc_drop_ghost(a, a->b1.tail);
+    while (a->t1.size + a->t2.size + a->b1.size + a->b2.size > 2 * p->cap && a->b2.size > 0)
+        arc_drop_ghost(a, a->b2.tail);
+}
+
+int arc_evict(struct policy *p, uint64_t incoming) {
+    struct arc_policy *a = (struct arc_policy *)p;
+    int g = index_find(&a->gindex, incoming), slot;
+    arc_adapt(a, incoming);
+    if (a->t1.size > 0 && (a->t1.size > a->p || a->t2.size == 0
+        || (g != -1 && a->in_b2[g] && a->t1.size == a->p))) {
+        slot = dl_pop_back(&a->t1);
+        arc_add_ghost(a, p->key[slot], 0);
+    } else {
+        slot = dl_pop_back(&a->t2);
+        arc_add_ghost(a, p->key[slot], 1);
+    }
+    return slot;
+}
+
+void arc_remove(struct policy *p, int slot) {
+    struct arc_policy *a = (struct arc_policy *)p;
+    dl_unlink(a->in_t2[slot] ? &a->t2 : &a->t1, slot);
+}
+
+void arc_stats(struct policy *p, FILE *out, const char *who) {
+    struct arc_policy *a = (struct arc_policy *)p;
+    fprintf(out, "%s ARC target T1 size = %d, B1 ghost hits = %llu, B2 ghost hits = %llu\n",
+        who, a->p, (unsigned long long)a->b1_hits, (unsigned long long)a->b2_hits);
+}
+
+void arc_ckpt(struct policy *p, struct ckpt *ck) {
+    struct arc_policy *a = (struct arc_policy *)p;
+    int n = 2 * p->cap;
+    dl_ckpt(&a->t1, p->cap, ck);  dl_ckpt(&a->t2, p->cap, ck);
+    dl_ckpt(&a->b1, n, ck);  dl_ckpt(&a->b2, n, ck);
+    ck_io(ck, a->in_t2, p->cap);
+    ck_io(ck, a->in_b2, n);
+    ck_io(ck, a->ghost, n * sizeof(uint64_t));
+    ck_io(ck, a->gindex.slot, (a->gindex.mask + 1) * sizeof(int));
+    ck_io(ck, a->gfree, n * sizeof(int));
+    CK(ck, a->n_gfree);  CK(ck, a->p);  CK(ck, a->adapted);
+    CK(ck, a->b1_hits);  CK(ck, a->b2_hits);
+}
+
+
+const struct policy_ops policies[] = {
+    {"FIFO", sizeof(struct list_policy), 0, list_init, policy_find, fifo_hit, list_push,
+        list_pop, list_unlink, NULL, NULL, list_destroy, list_ckpt},
+    {"LRU", sizeof(struct list_policy), 0, list_init, policy_find, lru_hit, list_push,
+        list_pop, list_unlink, NULL, NULL, list_destroy, list_ckpt},
+    {"OPT", sizeof(struct heap_policy), 1, heap_policy_init, policy_find, opt_use, opt_use,
+        heap_policy_evict, heap_policy_remove, opt_use, NULL, heap_policy_destroy, heap_policy_ckpt},
+    {"CLOCK", sizeof(struct clock_policy), 0, clock_init, policy_find, clock_hit, clock_hit,
+        clock_evict, clock_remove, NULL, clock_stats, clock_destroy, clock_ckpt},
+    {"SC", sizeof(struct list_policy), 0, list_init, policy_find, sc_hit, sc_miss,
+        sc_evict, list_unlink, NULL, sc_stats, list_destroy, list_ckpt},
+    {"LFU", sizeof(struct heap_policy), 0, heap_policy_init, policy_find, lfu_hit, lfu_miss,
+        heap_policy_evict, heap_policy_remove, NULL, lfu_stats, heap_policy_destroy, heap_policy_ckpt},
+    {"ARC", sizeof(struct arc_policy), 0, arc_init, policy_find, arc_hit, arc_miss,
+        arc_evict, arc_remove, NULL, arc_stats, arc_destroy, arc_ckpt},
+};
+
+// Find a policy by name, in any case
+const struct policy_ops *find_policy(const char *name) {
+    int i;
+    for (i = 0; i < sizeof(policies) / sizeof(policies[0]); ++i)
+        if (strcasecmp(name, policies[i].name) == 0) return &policies[i];
+    if (strcasecmp(name, "second-chance") == 0) return find_policy("SC");
+    return NULL;
+}
+
+/***********************************************************
+*    Page tables. A page table maps logical pages to phy-  *
+*  sical pages and counts the memory references a hardware *
+*  walker would make to find a translation, so a TLB miss  *
+*  has a cost. Like the policies, each kind is a `struct   *
+*  page_table_ops`, with `struct page_table` at the head   *
+*  of its state:                                           *
+*    flat    one entry per logical page, one reference     *
+*    radixN  an N-level tree, one reference per level, as  *
+*            x86-64 walks 4 levels of 9 bits each          *
+*    hashed  an inverted table with one entry per physi-   *
+*            cal page, reached through a hash anchor       *
+*            table: one reference for the anchor and one   *
+*            per chain entry probed                        *
+************************************************************/
+struct page_table;
+
+struct page_table_ops {
+    const char *name;
+    int levels;  // Radix levels, 0 for the other kinds
+    struct page_table *(*new)(const struct page_table_ops *ops, int p_pages);
+    int (*lookup)(struct page_table *pt, uint64_t page);  // Physical page or -1
+    void (*map)(struct page_table *pt, uint64_t page, int phy);
+    void (*unmap)(struct page_table *pt, uint64_t page);
+    void (*destroy)(struct page_table *pt);
+    void (*ckpt)(struct page_table *pt, struct ckpt *ck);  // Save or restore the entries
+};
+
+struct page_table {
+    const struct page_table_ops *ops;
+    uint64_t walk_refs;  // Memory references made by lookups
+    uint64_t bytes;  // Memory taken by the table itself
+};
+
+// Flat: the original array indexed by logical page
+struct flat_table {
+    struct page_table base;
+    int *entry;  // Physical page of every logical page, -1 if not present
+};
+
+struct page_table *flat_new(const struct page_table_ops *ops, int p_pages) {
+    struct flat_table *t = calloc(1, sizeof(struct flat_table));
+    t->entry = malloc(V_PAGES * sizeof(int));
+    memset(t->entry, -1, V_PAGES * sizeof(int));
+    t->base.bytes = V_PAGES * sizeof(int);
+    return &t->base;
+}
+
+int flat_lookup(struct page_table *pt, uint64_t page) {
+    ++pt->walk_refs;
+    return ((struct flat_table *)pt)->entry[page];
+}
+
+void flat_map(struct page_table *pt, uint64_t page, int phy) {
+    ((struct flat_table *)pt)->entry[page] = phy;
+}
+
+void flat_unmap(struct page_table *pt, uint64_t page) {
+    ((struct flat_table *)pt)->entry[page] = -1;
+}
+
+void flat_destroy(struct page_table *pt) {
+    free(((struct flat_table *)pt)->entry);
+}
+
+void flat_ckpt(struct page_table *pt, struct ckpt *ck) {
+    ck_io(ck, ((struct flat_table *)pt)->entry, V_PAGES * sizeof(int));
+}
+
+/***********************************************************
+*    Radix: the logical page number is cut into `levels`   *
+*  indices, the first level taking any leftover bits. A    *
+*  node is an array of child pointers, or of physical      *
+*  pages at the last level, and is only allocated when a   *
+*  page below it is first mapped, so a sparse address      *
+*  space costs little.                                     *
+************************************************************/
+struct radix_table {
+    struct page_table base;
+    int levels;
+    int shift[4], bits[4];  // Position and width of every level's index
+    void *root;
+};
+
+struct page_table *radix_new(const struct page_table_ops *ops, int p_pages) {
+    struct radix_table *t = calloc(1, sizeof(struct radix_table));
+    int vbits = VA_BITS - OFFSET, i, pos = vbits;
+    t->levels = ops->levels;
+    for (i = 0; i < t->levels; ++i) {
+        t->bits[i] = vbits / t->levels + (i == 0 ? vbits % t->levels : 0);
+        pos -= t->bits[i];
+        t->shift[i] = pos;
+    }
+    return &t->base;
+}
+
+void *radix_node(struct radix_table *t, int level) {
+    size_t n = (size_t)1 << t->bits[level];
+    t->base.bytes += n * (level == t->levels - 1 ? sizeof(int) : sizeof(void *));
+    if (level < t->levels - 1) return calloc(n, sizeof(void *));
+    int *leaf = malloc(n * sizeof(int));
+    memset(leaf, -1, n * sizeof(int));
+    return leaf;
+}
+
+// Entry of `page` in its leaf, allocating the path if `create`
+int *radix_walk(struct radix_table *t, uint64_t page, int create) {
+    void **slot = &t->root;
+    int i;
+    for (i = 0; i < t->levels; ++i) {
+        ++t->base.walk_refs;
+        if (*slot == NULL) {
+            if (!create) return NULL;
+            *slot = radix_node(t, i);
+        }
+        uint64_t index = (page >> t->shift[i]) & ((1ULL << t->bits[i]) - 1);
+        if (i == t->levels - 1) return (int *)*slot + index;
+        slot = (void **)*slot + index;
+    }
+    return NULL;
+}
+
+int radix_lookup(struct page_table *pt, uint64_t page) {
+    int *e = radix_walk((struct radix_table *)pt, page, 0);
+    return e == NULL ? -1 : *e;
+}
+
+/* Mapping and unmapping are done by the OS, not the walker,
+ * so they do not count as walk references.
+ */
+void radix_map(struct page_table *pt, uint64_t page, int phy) {
+    uint64_t refs = pt->walk_refs;
+    *radix_walk((struct radix_table *)pt, page, 1) = phy;
+    pt->walk_refs = refs;
+}
+
+void radix_unmap(struct page_table *pt, uint64_t page) {
+    uint64_t refs = pt->walk_refs;
+    *radix_walk((struct radix_table *)pt, page, 0) = -1;
+    pt->walk_refs = refs;
+}
+
+void radix_free_node(struct radix_table *t, void *node, int level) {
+    size_t i, n = (size_t)1 << t->bits[level];
+    if (node == NULL) return;
+    if (level < t->levels - 1)
+        for (i = 0; i < n; ++i) radix_free_node(t, ((void **)node)[i], level + 1);
+    free(node);
+}
+
+void radix_destroy(struct page_table *pt) {
+    struct radix_table *t = (struct radix_table *)pt;
+    radix_free_node(t, t->root, 0);
+}
+
+// A node is a presence byte, then its leaf entries or its children in order
+void radix_ckpt_node(struct radix_table *t, void **node, int level, struct ckpt *ck) {
+    size_t i, n = (size_t)1 << t->bits[level];
+    char present = *node != NULL;
+    CK(ck, present);
+    if (!present || ck->bad) return;
+    if (*node == NULL) *node = radix_node(t, level);
+    if (level == t->levels - 1) ck_io(ck, *node, n * sizeof(int));
+    else for (i = 0; i < n; ++i) radix_ckpt_node(t, (void **)*node + i, level + 1, ck);
+}
+
+void radix_ckpt(struct page_table *pt, struct ckpt *ck) {
+    struct radix_table *t = (struct radix_table *)pt;
+    radix_ckpt_node(t, &t->root, 0, ck);
+}
+
+/***********************************************************
+*    Hashed (inverted): the table has one entry per phy-   *
+*  sical page holding the logical page mapped there, so    *
+*  its size follows memory, not the address space. Entries *
+*  whose pages hash alike are chained from one anchor.     *
+************************************************************/
+struct hashed_table {
+    struct page_table base;
+    int *anchor;  // First physical page of every hash chain, -1 if none
+    uint64_t mask;
+    uint64_t *page;  // Logical page held by every physical page
+    int *next;  // Next physical page on the same chain, -1 at the end
+    int size;  // Number of physical pages
+};
+
+struct page_table *hashed_new(const struct page_table_ops *ops, int p_pages) {
+    struct hashed_table *t = calloc(1, sizeof(struct hashed_table));
+    uint64_t n = 1;
+    while (n < (uint64_t)p_pages) n <<= 1;
+    t->anchor = malloc(n * sizeof(int));
+    memset(t->anchor, -1, n * sizeof(int));
+    t->mask = n - 1;
+    t->page = malloc(p_pages * sizeof(uint64_t));
+    t->next = malloc(p_pages * sizeof(int));
+    t->size = p_pages;
+    t->base.bytes = n * sizeof(int) + p_pages * (sizeof(uint64_t) + sizeof(int));
+    return &t->base;
+}
+
+int hashed_lookup(struct page_table *pt, uint64_t page) {
+    struct hashed_table *t = (struct hashed_table *)pt;
+    int phy = t->anchor[key_hash(page) & t->mask];
+    ++pt->walk_refs;
+    while (phy != -1) {
+        ++pt->walk_refs;
+        if (t->page[phy] == page) return phy;
+        phy = t->next[phy];
+    }
+    return -1;
+}
+
+void hashed_map(struct page_table *pt, uint64_t page, int phy) {
+    struct hashed_table *t = (struct hashed_table *)pt;
+    int *head = &t->anchor[key_hash(page) & t->mask];
+    t->page[phy] = page;
+    t->next[phy] = *head;
+    *head = phy;
+}
+
+void hashed_unmap(struct page_table *pt, uint64_t page) {
+    struct hashed_table *t = (struct hashed_table *)pt;
+    int *link = &t->anchor[key_hash(page) & t->mask];
+    while (*link != -1 && t->page[*link] != page) link = &t->next[*link];
+    if (*link != -1) *link = t->next[*link];
+}
+
+void hashed_destroy(struct page_table *pt) {
+    struct hashed_table *t = (struct hashed_table *)pt;
+    free(t->anchor);  free(t->page);  free(t->next);
+}
+
+void hashed_ckpt(struct page_table *pt, struct ckpt *ck) {
+    struct hashed_table *t = (struct hashed_table *)pt;
+    ck_io(ck, t->anchor, (t->mask + 1) * sizeof(int));
+    ck_io(ck, t->page, t->size * sizeof(uint64_t));
+    ck_io(ck, t->next, t->size * sizeof(int));
+}
+
+const struct page_table_ops page_tables[] = {
+    {"flat", 0, flat_new, flat_lookup, flat_map, flat_unmap, flat_destroy, flat_ckpt},
+    {"radix2", 2, radix_new, radix_lookup, radix_map, radix_unmap, radix_destroy, radix_ckpt},
+    {"radix3", 3, radix_new, radix_lookup, radix_map, radix_unmap, radix_destroy, radix_ckpt},
+    {"radix4", 4, radix_new, radix_lookup, radix_map, radix_unmap, radix_destroy, radix_ckpt},
+    {"hashed", 0, hashed_new, hashed_lookup, hashed_map, hashed_unmap, hashed_destroy, hashed_ckpt},
+};
+
+const struct page_table_ops *find_page_table(const char *name) {
+    int i;
+    for (i = 0; i < sizeof(page_tables) / sizeof(page_tables[0]); ++i)
+        if (strcasecmp(name, page_tables[i].name) == 0) return &page_tables[i];
+    return NULL;
+}
+
+void page_table_free(struct page_table *pt) {
+    pt->ops->destroy(pt);
+    free(pt);
+}
+
+/***********************************************************
+*    A TLB is either fully associative, with any policy    *
+*  from above managing its terms, or set-associative: the  *
+*  low bits of the logical page pick one of `sets` sets,   *
+*  and the page may only live in one of that set's `ways`  *
+*  terms, replaced by per-set LRU, tree pseudo-LRU or      *
+*  FIFO. A set is searched by comparing all of its tags at *
+*  once with SIMD, so lookup costs the same however large  *
+*  the TLB is, as in hardware.                             *
+************************************************************/
+enum { SET_LRU, SET_PLRU, SET_FIFO };
+const char *set_repl_names[] = {"LRU", "PLRU", "FIFO"};
+
+struct tlb {
+    int entries, sets, ways;  // `ways` is 0 for a fully-associative TLB
+    int repl;  // Replacement within a set
+    int *phy;  // Physical page of every term
+// Set-associative, terms are stored set by set
+    uint64_t *tag;  // Logical page of every term, NO_KEY if invalid
+    uint64_t *stamp;  // LRU: last use of every term
+    uint64_t clock;  // LRU: number of uses so far
+    uint64_t *plru;  // PLRU: tree bits of every set
+    int *next;  // FIFO: next term to replace in every set
+// Fully associative
+    struct policy *pol;
+    int *free, n_free;  // Unused terms
+};
+
+int find_set_repl(const char *name) {
+    int i;
+    for (i = 0; i < 3; ++i)
+        if (strcasecmp(name, set_repl_names[i]) == 0) return i;
+    return -1;
+}
+
+struct tlb *tlb_new(struct sim *s, int entries, int ways, int repl, const struct policy_ops *ops) {
+    struct tlb *t = calloc(1, sizeof(struct tlb));
+    int i;
+    t->entries = entries;  t->ways = ways;  t->repl = repl;
+    t->phy = malloc(entries * sizeof(int));
+    if (ways == 0) {
+        t->pol = policy_new(ops, s, entries, 1);
+        t->free = malloc(entries * sizeof(int));
+        for (i = 0; i < entries; ++i) t->free[i] = entries - 1 - i;
+        t->n_free = entries;
+        return t;
+    }
+    t->sets = entries / ways;
+    t->tag = malloc(entries * sizeof(uint64_t));
+    for (i = 0; i < entries; ++i) t->tag[i] = NO_KEY;
+    t->stamp = calloc(entries, sizeof(uint64_t));
+    t->plru = calloc(t->sets, sizeof(uint64_t));
+    t->next = calloc(t->sets, sizeof(int));
+    return t;
+}
+
+void tlb_free(struct tlb *t) {
+    if (t->pol != NULL) policy_free(t->pol);
+    free(t->phy);  free(t->free);  free(t->tag);  free(t->stamp);  free(t->plru);  free(t->next);
+    free(t);
+}
+
+// Way of `page` among the `ways` tags of a set, -1 if absent
+static inline int set_find(const uint64_t *tags, int ways, uint64_t page) {
+    int w = 0;
+#if defined(__AVX2__)
+    __m256i key = _mm256_set1_epi64x(page);
+    for (; w + 4 <= ways; w += 4) {
+        __m256i eq = _mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i *)(tags + w)), key);
+        int m = _mm256_movemask_pd(_mm256_castsi256_pd(eq));
+        if (m) return w + __builtin_ctz(m);
+    }
+#elif defined(__SSE2__)
+    __m128i key = _mm_set1_epi64x(page);
+    for (; w + 2 <= ways; w += 2) {
+    // SSE2 has no 64-bit compare: both 32-bit halves must match
+        __m128i eq = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(tags + w)), key);
+        eq = _mm_and_si128(eq, _mm_shuffle_epi32(eq, _MM_SHUFFLE(2, 3, 0, 1)));
+        int m = _mm_movemask_pd(_mm_castsi128_pd(eq));
+        if (m) return w + __builtin_ctz(m);
+    }
+#endif
+    for (; w < ways; ++w)
+        if (tags[w] == page) return w;
+    return -1;
+}
+
+/* Tree pseudo-LRU keeps ways - 1 bits per set, as a heap:
+ * node 1 is the root and node i has children 2i and 2i + 1.
+ * A bit points to the half holding the next victim, so a use
+ * turns the bits on its path away from the used way.
+ */
+void plru_use(struct tlb *t, int set, int way) {
+    uint64_t bits = t->plru[set];
+    int node = 1, half = t->ways >> 1;
+    while (half > 0) {
+        int right = (way & half) != 0;
+        if (right) bits &= ~(1ULL << node);
+        else bits |= 1ULL << node;
+        node = 2 * node + right;
+        half >>= 1;
+    }
+    t->plru[set] = bits;
+}
+
+int plru_victim(struct tlb *t, int set) {
+    int node = 1;
+    while (node < t->ways) node = 2 * node + ((t->plru[set] >> node) & 1);
+    return node - t->ways;
+}
+
+void set_use(struct tlb *t, int set, int way) {
+    if (t->repl == SET_LRU) t->stamp[set * t->ways + way] = ++t->clock;
+    else if (t->repl == SET_PLRU) plru_use(t, set, way);
+}
+
+// Physical page of `page`, -1 on a miss
+static inline int tlb_lookup(struct tlb *t, uint64_t page) {
+    if (t->ways == 0) {
+        int slot = t->pol->ops->lookup(t->pol, page);
+        if (slot == -1) return -1;
+        t->pol->ops->on_hit(t->pol, slot);
+        return t->phy[slot];
+    }
+    int set = page & (t->sets - 1), way = set_find(t->tag + set * t->ways, t->ways, page);
+    if (way == -1) return -1;
+    set_use(t, set, way);
+    return t->phy[set * t->ways + way];
+}
+
+void tlb_insert(struct tlb *t, uint64_t page, int phy) {
+    if (t->ways == 0) {
+        uint64_t victim;
+        int slot = t->n_free > 0 ? t->free[--t->n_free] : policy_evict(t->pol, page, &victim);
+        policy_insert(t->pol, slot, page);
+        t->phy[slot] = phy;
+        return;
+    }
+    int set = page & (t->sets - 1), way, w;
+    uint64_t *tags = t->tag + set * t->ways;
+// An invalid term first, otherwise the victim of the set
+    way = set_find(tags, t->ways, NO_KEY);
+    if (way == -1) {
+        if (t->repl == SET_LRU) {
+            for (way = 0, w = 1; w < t->ways; ++w)
+                if (t->stamp[set * t->ways + w] < t->stamp[set * t->ways + way]) way = w;
+        } else if (t->repl == SET_PLRU) {
+            way = plru_victim(t, set);
+        } else {
+            way = t->next[set];
+            t->next[set] = (way + 1) % t->ways;
+        }
+    }
+    tags[way] = page;
+    t->phy[set * t->ways + way] = phy;
+    set_use(t, set, way);
+}
+
+// Drop every term, as on a context switch without ASIDs
+void tlb_flush(struct tlb *t) {
+    int i;
+    for (i = 0; i < t->entries; ++i) {
+        if (t->ways) t->tag[i] = NO_KEY;
+        else if (t->pol->key[i] != NO_KEY) {
+            policy_remove(t->pol, i);
+            t->free[t->n_free++] = i;
+        }
+    }
+}
+
+void tlb_invalidate(struct tlb *t, uint64_t page) {
+    if (t->ways == 0) {
+        int slot = t->pol->ops->lookup(t->pol, page);
+        if (slot != -1) {
+            policy_remove(t->pol, slot);
+            t->free[t->n_free++] = slot;
+        }
+        return;
+    }
+    int set = page & (t->sets - 1), way = set_find(t->tag + set * t->ways, t->ways, page);
+    if (way != -1) t->tag[set * t->ways + way] = NO_KEY;
+}
+
+// Drop the terms of `n` pages from `first` on with one pass over the terms, for ranges longer than the TLB
+void tlb_invalidate_range(struct tlb *t, uint64_t first, uint64_t n) {
+    int i;
+    for (i = 0; i < t->entries; ++i) {
+        if (t->ways) {
+            if (t->tag[i] - first < n) t->tag[i] = NO_KEY;
+        } else if (t->pol->key[i] != NO_KEY && t->pol->key[i] - first < n) {
+            policy_remove(t->pol, i);
+            t->free[t->n_free++] = i;
+        }
+    }
+}
+
+void tlb_ckpt(struct tlb *t, struct ckpt *ck) {
+    ck_check(ck, t->entries);
+    ck_check(ck, t->ways);
+    ck_check(ck, t->repl);
+    ck_io(ck, t->phy, t->entries * sizeof(int));
+    if (t->ways == 0) {
+        policy_ckpt(t->pol, ck);
+        ck_io(ck, t->free, t->entries * sizeof(int));
+        CK(ck, t->n_free);
+        return;
+    }
+    ck_io(ck, t->tag, t->entries * sizeof(uint64_t));
+    ck_io(ck, t->stamp, t->entries * sizeof(uint64_t));
+    CK(ck, t->clock);
+    ck_io(ck, t->plru, t->sets * sizeof(uint64_t));
+    ck_io(ck, t->next, t->sets * sizeof(int));
+}
+
+/***********************************************************
+*    Data caches. With `--cache`, every translated access  *
+*  goes on to up to MAX_CACHES levels of set-associative   *
+*  cache, each a set-associative TLB as above whose keys   *
+*  are physical line numbers. A lookup walks down from L1  *
+*  to the first level that holds the line and fills every  *
+*  level above it, so the levels are mostly inclusive      *
+*  without back-invalidation; writes allocate like reads.  *
+*  Reading a page into a frame invalidates the frame's     *
+*  lines, as a coherent DMA would. `amat` turns the counts *
+*  into an average memory access time: STLB hits, page     *
+*  walk references, the latency of every level looked up   *
+*  (and of memory after the last one), and the stall of    *
+*  the page faults, per access.                            *
+************************************************************/
+static inline void cache_access(struct sim *s, uint64_t physical_address) {
+    uint64_t line = physical_address >> s->line_bits;
+    int i, hit = s->n_caches;
+    for (i = 0; i < s->n_caches; ++i) {
+        ++s->caches[i].accesses;
+        if (tlb_lookup(s->caches[i].t, line) != -1) {
+            ++s->caches[i].hits;
+            hit = i;
+            break;
+        }
+    }
+    for (i = 0; i < hit; ++i) tlb_insert(s->caches[i].t, line, 0);
+}
+
+// Drop the lines of `size` bytes of main memory from `start` on
+void cache_invalidate(struct sim *s, uint64_t start, uint64_t size) {
+    uint64_t first = start >> s->line_bits, n = size >> s->line_bits, l;
+    int i;
+    for (i = 0; i < s->n_caches; ++i) {
+        struct tlb *t = s->caches[i].t;
+    // A huge frame has more lines than a level holds, its sets are scanned once instead
+        if (n > (uint64_t)t->entries) tlb_invalidate_range(t, first, n);
+        else for (l = 0; l < n; ++l) tlb_invalidate(t, first + l);
+    }
+}
+
+// Name of a cache level, the last of several is the LLC
+const char *cache_name(const struct sim *s, int level) {
+    static const char *names[] = {"L1", "L2", "L3"};
+    return level > 0 && level == s->n_caches - 1 ? "LLC" : names[level];
+}
+
+// Average memory access time in ns, and its parts
+double amat(const struct sim *s, double *tlb, double *walk, double *caches, double *faults) {
+    double acc = s->accesses ? s->accesses : 1, ns = 0;
+    int i;
+    for (i = 0; i < s->n_caches; ++i) ns += s->caches[i].accesses * s->caches[i].ns;
+    ns += (s->caches[s->n_caches - 1].accesses - s->caches[s->n_caches - 1].hits) * s->mem_ns;
+    *tlb = s->stlb_hit * s->stlb_ns / acc;
+    *walk = s->walk_refs * s->walk_ns / acc;
+    *caches = ns / acc;
+    *faults = s->stall_us * 1000 / acc;
+    return *tlb + *walk + *caches + *faults;
+}
+
+/***********************************************************
+*    Huge pages. With `--huge-page`, some aligned regions  *
+*  of the address space are backed by huge pages of        *
+*  2^HUGE_BITS pages each instead, chosen by a region file *
+*  or by the density heuristic of `mark_dense_regions`.    *
+*  Physical memory is split statically: the top           *
+*  `huge_frames` huge frames hold huge pages, the pages    *
+*  below them small ones, each part with its own instance  *
+*  of the page table policy and its own page table of the  *
+*  same kind. TLB terms are shared, a huge page's key      *
+*  carrying HUGE_TAG, unless `--huge-tlb` gives huge pages *
+*  a TLB of their own as in x86 L1 dTLBs. A huge page      *
+*  fault copies the whole huge page from the backing       *
+*  store.                                                  *
+************************************************************/
+void mark_huge(uint64_t hpage) {
+    if (!((huge_map[hpage >> 6] >> (hpage & 63)) & 1)) ++n_huge_pages;
+    huge_map[hpage >> 6] |= 1ULL << (hpage & 63);
+}
+
+int huge_map_init() {
+    uint64_t n = V_PAGES >> HUGE_BITS;
+    if (n > (1ULL << 32)) return -1;
+    huge_map = calloc((n + 63) / 64, sizeof(uint64_t));
+    return huge_map == NULL ? -1 : 0;
+}
+
+/* A region file has one region per line, "start end" as byte
+ * addresses, in hex with 0x or decimal; '#' starts a comment.
+ * Only the huge pages that lie wholly inside [start, end) are
+ * marked, as a kernel only maps those huge.
+ */
+int load_huge_regions(const char *path) {
+    char line[256];
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) return -1;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        unsigned long long start, end;
+        uint64_t h, first, last;
+        if (line[0] == '#' || sscanf(line, "%lli %lli", &start, &end) != 2) continue;
+        first = (start + HUGE_SIZE - 1) / HUGE_SIZE;
+        last = end / HUGE_SIZE;
+        if (last > V_PAGES >> HUGE_BITS) last = V_PAGES >> HUGE_BITS;
+        for (h = first; h < last; ++h) mark_huge(h);
+    }
+    fclose(fp);
+    return 0;
+}
+
+/* The heuristic stands in for khugepaged: a huge page is used
+ * where the trace touches at least `fraction` of its pages,
+ * so sparse regions keep small pages and do not inflate I/O.
+ */
+void mark_dense_regions(const struct trace *t, double fraction) {
+    struct page_map seen, touched;  // Pages seen, and pages seen within every huge page
+    uint64_t buf[BATCH], pos, b;
+    int i;
+    pmap_init(&seen, 1024);
+    pmap_init(&touched, 1024);
+    for (pos = 0; pos < t->count; pos += BATCH) {
+        int n = t->count - pos < BATCH ? t->count - pos : BATCH;
+        trace_read_at(t, pos, buf, n);
+        for (i = 0; i < n; ++i) {
+            uint64_t page = (buf[i] >> OFFSET) & VPAGE_MASK;
+            int64_t *v = pmap_get(&seen, page, 0);
+            if (*v == 0) {
+                *v = 1;
+                ++*pmap_get(&touched, page >> HUGE_BITS, 0);
+            }
+        }
+    }
+    for (b = 0; b <= touched.mask; ++b)
+        if (touched.page[b] != NO_PAGE && touched.value[b] >= fraction * (1ULL << HUGE_BITS))
+            mark_huge(touched.page[b]);
+    pmap_free(&seen);
+    pmap_free(&touched);
+}
+
+// Count the small and huge pages held by a TLB
+void tlb_count(const struct tlb *t, uint64_t *small, uint64_t *huge) {
+    const uint64_t *key = t->ways ? t->tag : t->pol->key;
+    int i;
+    for (i = 0; i < t->entries; ++i)
+        if (key[i] != NO_KEY) ++*(key[i] & HUGE_TAG ? huge : small);
+}
+
+double now_secs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/***********************************************************
+*    LRU is a stack algorithm: memory with F frames always *
+*  holds the F most recently used pages. A reference hits  *
+*  with F frames iff its stack distance (the number of     *
+*  distinct pages touched since the previous reference to  *
+*  the same page, plus one) is at most F. So one pass that *
+*  histograms stack distances gives the page faults of     *
+*  LRU for every frame count at once.                      *
+*                                                          *
+*    To get the distance we give every reference a time-   *
+*  stamp and keep a Fenwick tree over timestamps, with a   *
+*  mark at the last access time of every page. The count   *
+*  of marks after the previous access of a page is then    *
+*  its stack distance minus one, in O(log n).              *
+*                                                          *
+*    There is one mark per distinct page at any time, so   *
+*  the timestamps are compacted to 1..k once they run out, *
+*  and the tree doubles when compaction leaves it more     *
+*  than half full. Its size follows the number of pages,   *
+*  not the trace length.                                   *
+************************************************************/
+int sweep_slots;  // Timestamps before compaction
+int *fen;  // Fenwick tree over timestamps
+uint64_t *owner;  // Page last accessed at each timestamp, NO_PAGE if none
+struct page_map last_use;  // Timestamp of the last access of each page, 0 if never
+int stack_now;  // Timestamp of the latest reference
+
+void fen_add(int i, int v) {
+    for (; i <= sweep_slots; i += i & -i) fen[i] += v;
+}
+
+int fen_sum(int i) {
+    int s = 0;
+    for (; i > 0; i -= i & -i) s += fen[i];
+    return s;
+}
+
+// Renumber the live timestamps to 1..k and rebuild the tree, return k
+int sweep_compact() {
+    int i, k = 0;
+    for (i = 1; i <= sweep_slots; ++i) {
+        if (owner[i] == NO_PAGE) continue;
+        owner[++k] = owner[i];
+        *pmap_get(&last_use, owner[k], 0) = k;
+    }
+    if (2 * k > sweep_slots) {
+        sweep_slots *= 2;
+        owner = realloc(owner, (sweep_slots + 1) * sizeof(uint64_t));
+        fen = realloc(fen, (sweep_slots + 1) * sizeof(int));
+    }
+    for (i = k + 1; i <= sweep_slots; ++i) owner[i] = NO_PAGE;
+    memset(fen, 0, (sweep_slots + 1) * sizeof(int));
+    for (i = 1; i <= k; ++i) fen_add(i, 1);
+    return k;
+}
+
+void stack_init() {
+    int i;
+    sweep_slots = 4096;
+    stack_now = 0;
+    fen = calloc(sweep_slots + 1, sizeof(int));
+    owner = malloc((sweep_slots + 1) * sizeof(uint64_t));
+    for (i = 0; i <= sweep_slots; ++i) owner[i] = NO_PAGE;
+    pmap_init(&last_use, 1024);
+}
+
+void stack_free() {
+    free(fen);  free(owner);
+    pmap_free(&last_use);
+}
+
+// Reference `page`, return its stack distance, 0 for a first reference
+int stack_access(uint64_t page) {
+    int d = 0;
+    if (stack_now == sweep_slots) stack_now = sweep_compact();
+    ++stack_now;
+    int64_t *last = pmap_get(&last_use, page, 0);
+    if (*last != 0) {
+        // Distinct pages touched strictly after the previous access
+        d = fen_sum(stack_now - 1) - fen_sum(*last) + 1;
+        fen_add(*last, -1);
+        owner[*last] = NO_PAGE;
+    }
+    fen_add(stack_now, 1);
+    owner[stack_now] = page;
+    *last = stack_now;
+    return d;
+}
+
+// Forget `page`, as if it had never been referenced
+void stack_remove(uint64_t page) {
+    int64_t last = *pmap_get(&last_use, page, 0);
+    if (last != 0) {
+        fen_add(last, -1);
+        owner[last] = NO_PAGE;
+    }
+    pmap_del(&last_use, page);
+}
+
+/***********************************************************
+*    Spatially hashed sampling (SHARDS) simulates only the *
+*  pages whose hash falls under a threshold T out of P,    *
+*  that is a fraction R = T / P of the pages, each with    *
+*  all of its references. The sample behaves like the      *
+*  whole trace shrunk by R: a stack distance d in it       *
+*  stands for d / R, and F frames for the trace are F * R  *
+*  frames for the sample.                                  *
+*                                                          *
+*    At a fixed rate the sample still grows with the foot- *
+*  print of the trace. At a fixed size it holds at most    *
+*  `budget` pages: when a new page overflows it, T drops   *
+*  to the largest hash in the sample and the pages with    *
+*  that hash leave it for good. Every reference counts for *
+*  1 / R of the R in force at the time.                    *
+************************************************************/
+#define SAMPLE_BITS 32
+#define SAMPLE_MODULUS (1ULL << SAMPLE_BITS)
+// Stack distances the curve keeps, 128 MiB of histogram at most
+#define MRC_MAX_DIST (1 << 24)
+
+static inline uint64_t sample_hash(uint64_t page) {
+// The splitmix64 finalizer, every bit of the page reaches the low bits
+    page ^= page >> 30;  page *= 0xBF58476D1CE4E5B9ULL;
+    page ^= page >> 27;  page *= 0x94D049BB133111EBULL;
+    page ^= page >> 31;
+    return page & (SAMPLE_MODULUS - 1);
+}
+
+uint64_t sample_threshold(double rate) {
+    uint64_t t = rate * SAMPLE_MODULUS;
+    return t < 1 ? 1 : t > SAMPLE_MODULUS ? SAMPLE_MODULUS : t;
+}
+
+/* Copy the references to sampled pages of `t` into `out`, a loaded
+ * trace, and count all the references of `t` in `total`.
+ */
+int trace_sample(struct trace *t, struct trace *out, uint64_t threshold, uint64_t *total) {
+    uint64_t buf[BATCH], cap = 1 << 16, *a = malloc(cap * sizeof(uint64_t));
+    int n, k;
+    memset(out, 0, sizeof(*out));
+    *total = 0;
+    while ((n = trace_read(t, buf, BATCH)) > 0) {
+        *total += n;
+        for (k = 0; k < n; ++k) {
+            if (sample_hash((buf[k] >> OFFSET) & VPAGE_MASK) >= threshold) continue;
+            if (out->count == cap) a = realloc(a, (cap *= 2) * sizeof(uint64_t));
+            if (a == NULL) return -1;
+            a[out->count++] = buf[k];
+        }
+    }
+    out->data = (const unsigned char *)a;
+    out->width = 8;
+    out->flags = TRACE_WRITES;
+    return 0;
+}
+
+// Pages of a fixed-size sample, a max-heap on their hash
+struct sample_set {
+    uint64_t *hash, *page;
+    int n;
+};
+
+void sample_swap(struct sample_set *ss, int i, int j) {
+    uint64_t h = ss->hash[i], p = ss->page[i];
+    ss->hash[i] = ss->hash[j];  ss->page[i] = ss->page[j];
+    ss->hash[j] = h;  ss->page[j] = p;
+}
+
+void sample_push(struct sample_set *ss, uint64_t hash, uint64_t page) {
+    int i = ss->n++;
+    ss->hash[i] = hash;
+    ss->page[i] = page;
+    for (; i > 0 && ss->hash[(i - 1) / 2] < ss->hash[i]; i = (i - 1) / 2) sample_swap(ss, i, (i - 1) / 2);
+}
+
+// Take out the page with the largest hash
+uint64_t sample_pop(struct sample_set *ss) {
+    uint64_t page = ss->page[0];
+    int i = 0, c;
+    sample_swap(ss, 0, --ss->n);
+    while ((c = 2 * i + 1) < ss->n) {
+        if (c + 1 < ss->n && ss->hash[c + 1] > ss->hash[c]) ++c;
+        if (ss->hash[i] >= ss->hash[c]) break;
+        sample_swap(ss, i, c);
+        i = c;
+    }
+    return page;
+}
+
+// A miss ratio curve, from stack distances weighted by 1 / R
+struct mrc {
+    double *hist;  // Weight of the references at each scaled stack distance
+    int size, max_dist;
+    double weight;  // Weight of all sampled references, first ones included
+    uint64_t accesses, sampled;  // References in the trace and in the sample
+    uint64_t threshold;  // Sampling threshold at the end
+    double secs;
+};
+
+// Count a reference that hits with `d` frames or more; those beyond MRC_MAX_DIST miss all along the curve
+void mrc_add(struct mrc *c, int d, double w) {
+    if (d >= MRC_MAX_DIST) {
+        c->max_dist = MRC_MAX_DIST - 1;
+        return;
+    }
+    if (d >= c->size) {
+        int size = c->size;
+        while (size <= d) size *= 2;
+        c->hist = realloc(c->hist, size * sizeof(double));
+        memset(c->hist + c->size, 0, (size - c->size) * sizeof(double));
+        c->size = size;
+    }
+    c->hist[d] += w;
+    if (d > c->max_dist) c->max_dist = d;
+}
+
+/* One pass of the stack over `t`, sampling the pages under `threshold`
+ * (all of them at SAMPLE_MODULUS), at most `budget` at a time unless 0.
+ */
+void sweep_pass(struct trace *t, struct mrc *c, uint64_t threshold, int budget) {
+    uint64_t buf[BATCH];
+    struct sample_set ss = {NULL, NULL, 0};
+    int n, k, all = threshold == SAMPLE_MODULUS && budget == 0;
+    double t0 = now_secs();
+    memset(c, 0, sizeof(*c));
+    c->size = 4096;
+    c->hist = calloc(c->size, sizeof(double));
+    if (budget) {
+        ss.hash = malloc((budget + 1) * sizeof(uint64_t));
+        ss.page = malloc((budget + 1) * sizeof(uint64_t));
+    }
+    stack_init();
+    while ((n = trace_read(t, buf, BATCH)) > 0) {
+        c->accesses += n;
+        for (k = 0; k < n; ++k) {
+            uint64_t page = (buf[k] >> OFFSET) & VPAGE_MASK, h = 0;
+            if (!all && (h = sample_hash(page)) >= threshold) continue;
+            double scale = (double)SAMPLE_MODULUS / threshold;
+            int d = stack_access(page);
+            ++c->sampled;
+            c->weight += scale;
+            if (d != 0) {
+                double sd = d * scale + 0.5;
+                mrc_add(c, sd < MRC_MAX_DIST ? (int)sd : MRC_MAX_DIST, scale);
+                continue;
+            }
+            if (!budget) continue;
+            sample_push(&ss, h, page);
+            if (ss.n <= budget) continue;
+        // The largest hash leaves the sample, with every page that shares it
+            threshold = ss.hash[0];
+            while (ss.n > 0 && ss.hash[0] >= threshold) stack_remove(sample_pop(&ss));
+        }
+    }
+    c->threshold = threshold;
+    c->secs = now_secs() - t0;
+    stack_free();
+    free(ss.hash);  free(ss.page);
+}
+
+/* The curve is printed up to the largest stack distance seen:
+ * from there on every frame count has just the cold misses.
+ * Sampled misses are divided by the references of the whole
+ * trace rather than by the weight of the sample (SHARDS-adj):
+ * a sample that caught a very hot page or missed one drew more
+ * or fewer hits than its share, but about its share of misses.
+ */
+int lru_sweep(struct trace *t, uint64_t threshold, int budget, int check) {
+    struct mrc c, exact;
+    if (check) {
+        if (trace_load(t) != 0) {
+            printf("Out of memory loading the trace\n");
+            return 1;
+        }
+        sweep_pass(t, &exact, SAMPLE_MODULUS, 0);
+        t->pos = 0;
+    }
+    sweep_pass(t, &c, threshold, budget);
+    double miss = c.weight, exact_miss = 0, err, sum_err = 0, max_err = 0;
+    int f, max_dist = c.max_dist;
+    if (check) {
+        exact_miss = exact.weight;
+        if (exact.max_dist > max_dist) max_dist = exact.max_dist;
+    }
+    if (max_dist < 1) max_dist = 1;
+    printf("frames,faults,miss_ratio%s\n", check ? ",exact_faults,exact_miss_ratio" : "");
+    for (f = 1; f <= max_dist; ++f) {
+    // Faults with F frames are the cold misses plus references farther than F
+        if (f < c.size) miss -= c.hist[f];
+        double ratio = c.accesses && miss > 0 ? miss / c.accesses : 0.0;
+        if (ratio > 1) ratio = 1;  // A sample that drew more than its share
+        printf("%d,%.0f,%.6f", f, ratio * c.accesses, ratio);
+        if (check) {
+            if (f < exact.size) exact_miss -= exact.hist[f];
+            double exact_ratio = exact.accesses ? exact_miss / exact.accesses : 0.0;
+            printf(",%.0f,%.6f", exact_miss, exact_ratio);
+            err = ratio > exact_ratio ? ratio - exact_ratio : exact_ratio - ratio;
+            sum_err += err;
+            if (err > max_err) max_err = err;
+        }
+        printf("\n");
+    }
+    // The summary goes to stderr, to keep the curve plain CSV
+    if (threshold != SAMPLE_MODULUS || budget)
+        fprintf(stderr, "Sampled %llu of %llu accesses at rate %.6f%s in %.3f s\n",
+            (unsigned long long)c.sampled, (unsigned long long)c.accesses,
+            (double)c.threshold / SAMPLE_MODULUS, budget ? " (at the end of a fixed-size sample)" : "", c.secs);
+    if (check) {
+        fprintf(stderr, "Exact pass in %.3f s, miss ratio error %.6f on average, %.6f at most, over %d frame counts\n",
+            exact.secs, sum_err / max_dist, max_err, max_dist);
+        free(exact.hist);
+    }
+    free(c.hist);
+    return 0;
+}
+
+/***********************************************************
+*    `Init` opens the backing store and the trace, both    *
+*  shared by all simulations. `sim_init` sets up one simu- *
+*  lation from its configuration fields; it maps the back- *
+*  ing store copy-on-write, so write-backs stay private to *
+*  the simulation and cost nothing until they happen.      *
+************************************************************/
+void Init(const char *bs_file, const char *trace_file, struct trace *t) {
+    struct stat st;
+    bs_fd = open(bs_file, O_RDONLY);
+    if (bs_fd < 0 || fstat(bs_fd, &st) != 0) {
+        perror(bs_file);
+        exit(1);
+    }
+    bs_size = st.st_size;
+
+    if (trace_open(t, trace_file) != 0) {
+        perror(trace_file);
+        exit(1);
+    }
+}
+
+void sim_init(struct sim *s) {
+// Initialize page table and TLB, every term and physical page starts out free
+    int i = 0, small = s->p_pages - (s->huge_frames << HUGE_BITS);
+    s->pt = s->pt_type->new(s->pt_type, s->p_pages);
+    s->pt->ops = s->pt_type;
+    s->frames = policy_new(s->pt_ops, s, small, 0);
+    if (s->n_procs > 1) {
+        s->procs = calloc(s->n_procs, sizeof(struct proc));
+        s->proc_stats = calloc(s->n_procs, sizeof(struct proc));
+        for (i = 0; i < s->n_procs; ++i) {
+            struct proc *p = &s->procs[i];
+            p->pt = i == 0 ? s->pt : s->pt_type->new(s->pt_type, s->p_pages);
+            p->pt->ops = s->pt_type;
+            p->frames = i == 0 || !s->local ? s->frames : policy_new(s->pt_ops, s, small, 0);
+        }
+        s->cur = 0;
+        s->page_tag = s->tlb_tag = 0;
+        s->switches = 0;
+        memset(s->mark, 0, sizeof(s->mark));
+    }
+    s->free_frames = malloc(small * sizeof(int));
+    for (i = 0; i < small; ++i) s->free_frames[i] = small - 1 - i;
+    s->n_free_frames = small;
+    if (s->huge_frames) {
+        s->hpt = s->pt_type->new(s->pt_type, s->huge_frames);
+        s->hpt->ops = s->pt_type;
+        s->hframes = policy_new(s->pt_ops, s, s->huge_frames, 0);
+        s->free_hframes = malloc(s->huge_frames * sizeof(int));
+        for (i = 0; i < s->huge_frames; ++i) s->free_hframes[i] = s->huge_frames - 1 - i;
+        s->n_free_hframes = s->huge_frames;
+        s->huge_base = small;
+        if (s->htlb_entries) s->htlb = tlb_new(s, s->htlb_entries, 0, 0, find_policy("LRU"));
+    }
+
+    s->tlb = tlb_new(s, s->tlb_entries, s->tlb_ways, s->tlb_repl, s->tlb_ops);
+    s->stlb = s->stlb_entries ? tlb_new(s, s->stlb_entries, s->stlb_ways, s->stlb_repl, NULL) : NULL;
+    for (i = 0; i < s->n_caches; ++i) {
+        struct cache *c = &s->caches[i];
+        c->t = tlb_new(s, c->size >> s->line_bits, c->ways, c->repl, NULL);
+        c->accesses = c->hits = 0;
+    }
+
+	s->mm = malloc(MM_SIZE(s));
+	s->dirty = calloc(small, 1);
+	s->hdirty = calloc(s->huge_frames, 1);
+    // mmap(start, length, prot, flags, fd, offset)
+	s->bs = bs_size ? mmap(0, bs_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, bs_fd, 0) : NULL;
+	if (s->bs == MAP_FAILED) {
+	    perror("backing store");
+	    exit(1);
+	}
+	s->writes = s->wb_sync = s->wb_async = s->wb_bytes = 0;
+	s->stall_us = s->background_us = 0;
+	s->accesses = s->tlb_hit = s->stlb_hit = s->page_fault = 0;
+	s->huge_accesses = s->huge_tlb_hit = s->huge_fault = 0;
+	s->pf_issued = s->pf_used = s->pf_polluted = 0;
+	s->alloc = s->local ? small / s->n_procs : small;
+	s->peak_alloc = 0;
+	s->alloc_accesses = s->resize_faults = 0;
+	s->resize_at = s->resize_interval;
+	if (s->resize == RESIZE_WS) {
+	    s->ws = malloc(sizeof(struct wset));
+	    wset_init(s->ws, s->ws_tau);
+	}
+	if (s->prefetch) {
+	    s->pf_flag = calloc(small, 1);
+	    memset(s->streams, 0, sizeof(s->streams));
+	    s->ra_start = s->ra_marker = s->ra_prev = 0;
+	    s->ra_size = 0;
+	}
+}
+
+void sim_free(struct sim *s) {
+    int i;
+    s->walk_refs = s->pt->walk_refs;
+    s->pt_bytes = s->pt->bytes;
+    if (s->n_procs > 1) {
+        int i;
+        s->walk_refs = s->pt_bytes = 0;
+        memcpy(s->proc_stats, s->procs, sizeof(struct proc) * s->n_procs);
+        for (i = 0; i < s->n_procs; ++i) {
+            s->walk_refs += s->procs[i].pt->walk_refs;
+            s->pt_bytes += s->procs[i].pt->bytes;
+            if (i != s->cur) page_table_free(s->procs[i].pt);
+            if (s->local && i != s->cur) policy_free(s->procs[i].frames);
+        }
+        free(s->procs);
+        s->procs = s->proc_stats;  // Only the counters are left
+    }
+    if (s->huge_frames) {
+        s->walk_refs += s->hpt->walk_refs;
+        s->pt_bytes += s->hpt->bytes;
+        if (s->htlb != NULL) tlb_free(s->htlb);
+        policy_free(s->hframes);
+        free(s->free_hframes);
+        page_table_free(s->hpt);
+    }
+    tlb_free(s->tlb);
+    if (s->stlb != NULL) tlb_free(s->stlb);
+    for (i = 0; i < s->n_caches; ++i) tlb_free(s->caches[i].t);
+    policy_free(s->frames);
+    free(s->free_frames);
+    free(s->pf_flag);
+    if (s->ws != NULL) {
+        wset_free(s->ws);
+        free(s->ws);
+        s->ws = NULL;
+    }
+    free(s->dirty);  free(s->hdirty);
+    if (s->bs != NULL) munmap(s->bs, bs_size);
+    page_table_free(s->pt);
+    free(s->mm);
+}
+
+// Main memory of a physical page, or of a huge frame
+static inline char *frame_data(struct sim *s, int huge, int phy) {
+    return s->mm + (huge ? s->huge_base + ((uint64_t)phy << HUGE_BITS) : phy) * PAGE_SIZE;
+}
+
+// Write a dirty page back to the backing store, on eviction (`sync`) or in the background
+void write_back(struct sim *s, int huge, int phy, uint64_t log, int sync) {
+    uint64_t size = huge ? HUGE_SIZE : PAGE_SIZE, dst = log * size, n = dst < bs_size ? bs_size - dst : 0;
+    double cost = s->write_cost * (size / PAGE_SIZE);
+    if (n > size) n = size;  // Pages past the end of the backing store are dropped
+    memcpy(s->bs + dst, frame_data(s, huge, phy), n);
+    (huge ? s->hdirty : s->dirty)[phy] = 0;
+    s->wb_bytes += size;
+    if (sync) {
+        ++s->wb_sync;
+        s->stall_us += cost;
+    } else {
+        ++s->wb_async;
+        s->background_us += cost;
+    }
+}
+
+/***********************************************************
+*    With `clean_first`, up to that many victims are drawn *
+*  from the policy until a clean one comes up. The dirty   *
+*  ones drawn before it are written back in the back-      *
+*  ground and go back to the policy as if newly brought    *
+*  in, as Linux rotates dirty pages while writing them     *
+*  out. If all of them are dirty, the last one drawn is    *
+*  the victim and is written back on the spot.             *
+************************************************************/
+#define MAX_CLEAN_SCAN 64
+
+int choose_victim(struct sim *s, int huge, uint64_t log, uint64_t *victim) {
+    struct policy *frames = huge ? s->hframes : s->frames;
+    unsigned char *dirty = huge ? s->hdirty : s->dirty;
+    int slot[MAX_CLEAN_SCAN], n = 0, i;
+    uint64_t key[MAX_CLEAN_SCAN];
+    int phy = policy_evict(frames, log, victim);
+    while (dirty[phy] && n < s->clean_first - 1 && n < frames->cap - 1) {
+        slot[n] = phy;
+        key[n++] = *victim;
+        phy = policy_evict(frames, log, victim);
+    }
+    for (i = 0; i < n; ++i) {
+        write_back(s, huge, slot[i], key[i] & PAGE_KEY_MASK, 0);
+        policy_insert(frames, slot[i], key[i]);
+    }
+    return phy;
+}
+
+/***********************************************************
+*    On a page fault we take a free physical page, or the  *
+*  victim of the page table policy. The victim's transla-  *
+*  tion must also leave the TLB, or later accesses would   *
+*  hit a physical page that now holds another page. A      *
+*  huge page is handled alike, from the huge frames, and   *
+*  `log` is then its huge page number. Small pages are     *
+*  held to the `alloc` frames the process is given, which  *
+*  only changes with `--resize`.                           *
+************************************************************/
+// Evict a page to make room for `incoming`, return its physical page
+int evict(struct sim *s, int huge, uint64_t incoming) {
+    struct page_table *pt = huge ? s->hpt : s->pt;
+    uint64_t victim;
+    int phy = choose_victim(s, huge, incoming, &victim);
+    uint64_t page = victim, tlb_key = huge ? HUGE_TAG | victim : victim;
+    if (s->n_procs > 1) {
+    // With global replacement the victim may belong to another process
+        int pid = victim >> PID_SHIFT;
+        page = victim & PAGE_KEY_MASK;
+        pt = s->procs[pid].pt;
+        tlb_key = s->asid ? victim : pid == s->cur ? page : NO_KEY;  // A flushed TLB only holds `cur`
+    }
+    pt->ops->unmap(pt, page);
+    if ((huge ? s->hdirty : s->dirty)[phy]) write_back(s, huge, phy, page, 1);
+    if (!huge && s->pf_flag != NULL && s->pf_flag[phy]) {
+        ++s->pf_polluted;
+        s->pf_flag[phy] = 0;
+    }
+    // TLB shootdown
+    if (tlb_key != NO_KEY) {
+        tlb_invalidate(huge && s->htlb != NULL ? s->htlb : s->tlb, tlb_key);
+        if (s->stlb != NULL) tlb_invalidate(s->stlb, tlb_key);
+    }
+    return phy;
+}
+
+int page_in(struct sim *s, uint64_t log, int huge) {
+    struct policy *frames = huge ? s->hframes : s->frames;
+    struct page_table *pt = huge ? s->hpt : s->pt;
+    int *free_frames = huge ? s->free_hframes : s->free_frames;
+    int *n_free = huge ? &s->n_free_hframes : &s->n_free_frames;
+    uint64_t size = huge ? HUGE_SIZE : PAGE_SIZE;
+    int phy;
+    // Small pages may not take more than the frames allocated to them
+    if (*n_free > 0 && (huge || frames->used < s->alloc)) phy = free_frames[--*n_free];
+    else phy = evict(s, huge, log);
+    policy_insert(frames, phy, huge ? log : s->page_tag | log);
+    if (!huge && frames->used > s->peak_alloc) s->peak_alloc = frames->used;
+    pt->ops->map(pt, log, phy);
+    // memcpy(dst, src, n)
+    char *dst = frame_data(s, huge, phy);
+    uint64_t src = log * size, n = src < bs_size ? bs_size - src : 0;
+    if (n > size) n = size;
+    memcpy(dst, s->bs + src, n);  // Copy data to main memory
+    memset(dst + n, 0, size - n);
+    if (s->n_caches) cache_invalidate(s, dst - s->mm, size);
+    return phy;
+}
+
+/***********************************************************
+*    Readahead. On a page fault a prefetcher may pick more *
+*  pages to bring in along with the faulting one; they go  *
+*  through `page_in` like any other page, so the page      *
+*  table policy manages them, but not into the TLB. A      *
+*  prefetched page keeps a flag until its first access,    *
+*  which counts it as used and, as Linux does with its     *
+*  PG_readahead mark, lets the prefetcher run again, so a  *
+*  stream that prefetching serves keeps being followed. A  *
+*  flagged page evicted unused is pollution.               *
+*    next      the `prefetch_depth` pages after the fault  *
+*    stride    a small table of streams, each remembering  *
+*              its last page and stride; once a stride is  *
+*              seen twice, `prefetch_depth` pages along it *
+*    adaptive  Linux-style windows: a sequential fault or  *
+*              a hit on the window's marker page reads the *
+*              next window, doubling it up to              *
+*              `prefetch_depth` pages; a random fault      *
+*              starts over at 4 pages                      *
+************************************************************/
+enum { PF_NONE, PF_NEXT, PF_STRIDE, PF_ADAPTIVE };
+const char *prefetch_names[] = {"none", "next", "stride", "adaptive"};
+// Pages from the last page of a stream that still belong to it
+#define STREAM_DISTANCE 64
+
+int find_prefetcher(const char *name) {
+    int i;
+    for (i = 0; i < 4; ++i)
+        if (strcasecmp(name, prefetch_names[i]) == 0) return i;
+    return -1;
+}
+
+// Whether `page` is mapped, the OS asking, so not a page walk
+int pt_present(struct page_table *pt, uint64_t page) {
+    uint64_t refs = pt->walk_refs;
+    int phy = pt->ops->lookup(pt, page);
+    pt->walk_refs = refs;
+    return phy != -1;
+}
+
+void prefetch_page(struct sim *s, uint64_t page) {
+    if (page >= V_PAGES || is_huge(page) || pt_present(s->pt, page)) return;
+    s->pf_flag[page_in(s, page, 0)] = 1;
+    ++s->pf_issued;
+    s->background_us += s->read_cost;
+}
+
+// Prefetch `n` pages from `page` on, `stride` pages apart
+void prefetch_run(struct sim *s, uint64_t page, int64_t stride, int n) {
+    int i;
+    for (i = 0; i < n; ++i, page += stride) prefetch_page(s, page);
+}
+
+void stride_trigger(struct sim *s, uint64_t page) {
+    struct stream *st = s->streams, *e = NULL;
+    uint64_t best = STREAM_DISTANCE + 1;
+    int i, match = 0;
+    for (i = 0; i < N_STREAMS && !match; ++i) {
+        uint64_t d = st[i].last > page ? st[i].last - page : page - st[i].last;
+        if (!st[i].used) continue;
+        match = st[i].stride != 0 && st[i].last + st[i].stride == page;
+        if (match || d < best) { e = &st[i]; best = d; }
+    }
+    if (e == NULL) {
+    // No stream nearby: replace the least recently used one
+        for (e = st, i = 1; i < N_STREAMS; ++i)
+            if (st[i].used < e->used) e = &st[i];
+        e->stride = 0;
+        e->conf = 0;
+    } else if (match) {
+        ++e->conf;
+    } else {
+        e->stride = (int64_t)(page - e->last);
+        e->conf = 0;
+    }
+    e->last = page;
+    e->used = s->now + 1;
+    if (e->conf > 0) prefetch_run(s, page + e->stride, e->stride, s->prefetch_depth);
+}
+
+void adaptive_window(struct sim *s, uint64_t start, int size) {
+    s->ra_start = start;
+    s->ra_size = size;
+    s->ra_marker = start + size / 2;  // Reaching it reads the next window early
+    prefetch_run(s, start, 1, size);
+}
+
+/* Run the prefetcher for an access to `page` that either
+ * faulted or was the first use of a prefetched page.
+ */
+void prefetch(struct sim *s, uint64_t page, int fault) {
+    if (s->prefetch == PF_NEXT) {
+        if (fault || page == s->ra_marker) {
+        // Next window once the last one is half used, as with a fault
+            prefetch_run(s, page + 1, 1, s->prefetch_depth);
+            s->ra_marker = page + 1 + s->prefetch_depth / 2;
+        }
+    } else if (s->prefetch == PF_STRIDE) {
+        stride_trigger(s, page);
+    } else if (fault) {
+        int size = page == s->ra_prev + 1 && s->ra_size ? 2 * s->ra_size : 4;
+        adaptive_window(s, page + 1, size < s->prefetch_depth ? size : s->prefetch_depth);
+    } else if (page == s->ra_marker) {
+        int size = 2 * s->ra_size;
+        adaptive_window(s, s->ra_start + s->ra_size, size < s->prefetch_depth ? size : s->prefetch_depth);
+    }
+    s->ra_prev = page;
+}
+
+// First access to a prefetched page
+void prefetch_used(struct sim *s, uint64_t page, int phy) {
+    s->pf_flag[phy] = 0;
+    ++s->pf_used;
+    prefetch(s, page, 0);
+}
+
+/* The huge page path of `translate`, kept out of line so that
+ * runs without huge pages pay one predictable branch for it.
+ * Returns the physical address.
+ */
+uint64_t translate_huge(struct sim *s, uint64_t logical_page, uint64_t offset) {
+    uint64_t hpage = logical_page >> HUGE_BITS, key = HUGE_TAG | hpage;
+    struct tlb *tlb = s->htlb != NULL ? s->htlb : s->tlb;
+    struct policy *frames = s->hframes;
+    ++s->huge_accesses;
+    int phy = tlb_lookup(tlb, key);
+    if (phy != -1) {
+        ++s->tlb_hit;
+        ++s->huge_tlb_hit;
+        if (frames->ops->touch != NULL) frames->ops->touch(frames, phy);
+    } else if (s->stlb != NULL && (phy = tlb_lookup(s->stlb, key)) != -1) {
+        ++s->stlb_hit;
+        if (frames->ops->touch != NULL) frames->ops->touch(frames, phy);
+        tlb_insert(tlb, key, phy);
+    } else {
+        phy = s->hpt->ops->lookup(s->hpt, hpage);
+        if (phy == -1) {
+            ++s->page_fault;
+            ++s->huge_fault;
+            s->stall_us += s->read_cost * (HUGE_SIZE / PAGE_SIZE);
+            phy = page_in(s, hpage, 1);
+        } else {
+            frames->ops->on_hit(frames, phy);
+        }
+        if (s->stlb != NULL) tlb_insert(s->stlb, key, phy);
+        tlb_insert(tlb, key, phy);
+    }
+    uint64_t frame = s->huge_base + ((uint64_t)phy << HUGE_BITS) + (logical_page & ((1ULL << HUGE_BITS) - 1));
+    return (frame << OFFSET) | offset;
+}
+
+/***********************************************************
+*    `translate` translates a batch of logical addresses.  *
+*  It is the hot loop of the simulator. The geometry comes *
+*  in as arguments so that `SIMULATE_FOR` can stamp out    *
+*  copies for common geometries in which the shifts and    *
+*  masks are constants; the other geometries go through   *
+*  `simulate_any`, which reads them from the globals.      *
+************************************************************/
+static inline __attribute__((always_inline))
+void translate(struct sim *s, const uint64_t *buf, int n, int offset_bits, int va_bits) {
+    struct policy *frames = s->frames;  // Only changes on context switches, between batches
+    uint64_t offset_mask = (1ULL << offset_bits) - 1;
+    uint64_t vpage_mask = (1ULL << (va_bits - offset_bits)) - 1;
+    int k;
+    uint64_t base = s->accesses;
+    s->accesses += n;
+    for (k = 0; k < n; ++k) {
+        s->now = base + k;
+        uint64_t logical_address = buf[k];
+        uint64_t offset = logical_address & offset_mask;  // Take offset
+        uint64_t logical_page = (logical_address >> offset_bits) & vpage_mask;  // Take logical page
+        if (huge_map != NULL && is_huge(logical_page)) {
+            uint64_t physical_address = translate_huge(s, logical_page, offset);
+            if (s->n_caches) cache_access(s, physical_address);
+            if (logical_address & WRITE_BIT) {
+                ++s->writes;
+                s->hdirty[((physical_address >> offset_bits) - s->huge_base) >> HUGE_BITS] = 1;
+                ++s->mm[physical_address];
+            } else {
+                char val = s->mm[physical_address];
+            }
+            continue;
+        }
+        uint64_t tlb_key = logical_page | s->tlb_tag;
+        int physical_page = tlb_lookup(s->tlb, tlb_key);  // Find physical page in TLB
+        // TLB hit
+        if (physical_page != -1) {
+            ++s->tlb_hit;
+            if (frames->ops->touch != NULL) frames->ops->touch(frames, physical_page);
+        }
+        // Second-level TLB hit
+        else if (s->stlb != NULL && (physical_page = tlb_lookup(s->stlb, tlb_key)) != -1) {
+            ++s->stlb_hit;
+            if (frames->ops->touch != NULL) frames->ops->touch(frames, physical_page);
+            tlb_insert(s->tlb, tlb_key, physical_page);  // Update TLB
+        }
+        // TLB miss
+        else {
+            physical_page = s->pt->ops->lookup(s->pt, logical_page);  // Walk the page table
+            // page fault
             if (physical_page == -1) {
-                ++page_fault;
-                pt_replace(logical_page);  // Update page table
-                physical_page = pt[logical_page].phy;  // Get physical page
-                // memcpy(dst, src, n)
-                memcpy(mm + physical_page * PAGE_SIZE, bs + logical_page * PAGE_SIZE, PAGE_SIZE);  // Copy data to main memory
+                ++s->page_fault;
+                s->stall_us += s->read_cost;
+                if (s->prefetch) prefetch(s, logical_page, 1);  // Readahead first, the faulting page stays newest
+                physical_page = page_in(s, logical_page, 0);  // Update page table
+            } else {
+                frames->ops->on_hit(frames, physical_page);
+            }
+            if (s->stlb != NULL) tlb_insert(s->stlb, tlb_key, physical_page);
+            tlb_insert(s->tlb, tlb_key, physical_page);  // Update TLB
+            if (s->pf_flag != NULL && s->pf_flag[physical_page]) prefetch_used(s, logical_page, physical_page);
+        }
+        uint64_t physical_address = ((uint64_t)physical_page << offset_bits) | offset;  // Calc physical address
+        if (s->n_caches) cache_access(s, physical_address);
+        if (logical_address & WRITE_BIT) {
+            ++s->writes;
+            s->dirty[physical_page] = 1;
+            ++s->mm[physical_address];  // Change the value
+        } else {
+            char val = s->mm[physical_address];  // Get the value
+        }
+        // printf("l: %llu, p: %llu\n", logical_address, physical_address);
+        // printf("%d %d\n", s->tlb_hit, s->page_fault);
+    }
+}
+
+#define SIMULATE_FOR(offset_bits, va_bits) \
+void simulate_##offset_bits##_##va_bits(struct sim *s, const uint64_t *buf, int n) { \
+    translate(s, buf, n, offset_bits, va_bits); \
+}
+
+SIMULATE_FOR(8, 16)  // 256-byte pages, 16-bit addresses, the default
+SIMULATE_FOR(12, 32)  // 4 KiB pages, 32-bit addresses
+SIMULATE_FOR(12, 48)  // 4 KiB pages, 48-bit addresses
+
+void simulate_any(struct sim *s, const uint64_t *buf, int n) {
+    translate(s, buf, n, OFFSET, VA_BITS);
+}
+
+// The loop for the current geometry, chosen by `choose_simulate`
+void (*simulate)(struct sim *, const uint64_t *, int) = simulate_8_16;
+
+void choose_simulate() {
+    if (OFFSET == 8 && VA_BITS == 16) simulate = simulate_8_16;
+    else if (OFFSET == 12 && VA_BITS == 32) simulate = simulate_12_32;
+    else if (OFFSET == 12 && VA_BITS == 48) simulate = simulate_12_48;
+    else simulate = simulate_any;
+}
+
+/***********************************************************
+*    Time series. With `--series`, a single run emits one  *
+*  CSV or JSON line per `window` accesses:                 *
+*    faults, fault rate and TLB hit rate of the window     *
+*    the working set W(t, tau) at the end of the window,   *
+*      the distinct pages among the last `tau` accesses    *
+*    the distinct pages touched within the window          *
+*    the reuse (stack) distances within the window, in     *
+*      power-of-two buckets, and the first references      *
+*  The hot loop is not instrumented: `observed_feed` cuts  *
+*  the batches at window ends and takes the trace-side     *
+*  metrics in a second look at each batch, so a run        *
+*  without `--series` pays one branch per batch.           *
+************************************************************/
+#define RD_BUCKETS 32  // The last bucket takes every distance from 2^31 on
+
+struct series {
+    FILE *out;
+    int json;
+    uint64_t window;
+    uint64_t index, start, end;  // Current window, and the accesses it starts and ends at
+    uint64_t faults, tlb_hit;  // Counters of the simulation at the start of the window
+    struct wset ws;
+    struct page_map seen;  // Last window (plus one) that touched every page
+    uint64_t distinct, cold, hist[RD_BUCKETS];
+};
+
+struct series *series_new(const char *path, int json, uint64_t window, uint64_t tau) {
+    struct series *sr = calloc(1, sizeof(struct series));
+    int b;
+    sr->out = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+    if (sr->out == NULL) {
+        perror(path);
+        exit(1);
+    }
+    sr->json = json;
+    sr->window = window;
+    sr->end = window;
+    wset_init(&sr->ws, tau);
+    pmap_init(&sr->seen, 1024);
+    stack_init();
+    if (!json) {
+        fprintf(sr->out, "window,start,accesses,faults,fault_rate,tlb_hit_rate,working_set,distinct_pages,cold");
+        for (b = 0; b < RD_BUCKETS; ++b) fprintf(sr->out, ",rd_%llu", 1ULL << b);
+        fprintf(sr->out, "\n");
+    }
+    return sr;
+}
+
+void series_page(struct series *sr, uint64_t page) {
+    int d = stack_access(page);
+    if (d == 0) {
+        ++sr->cold;
+    } else {
+        int b = 63 - __builtin_clzll(d);
+        ++sr->hist[b < RD_BUCKETS ? b : RD_BUCKETS - 1];
+    }
+    int64_t *w = pmap_get(&sr->seen, page, 0);
+    if (*w != sr->index + 1) {
+        *w = sr->index + 1;
+        ++sr->distinct;
+    }
+    wset_add(&sr->ws, page);
+}
+
+void series_emit(struct sim *s) {
+    struct series *sr = s->series;
+    uint64_t acc = s->accesses - sr->start, faults = s->page_fault - sr->faults;
+    uint64_t hits = s->tlb_hit - sr->tlb_hit;
+    int b, last = RD_BUCKETS - 1;
+    if (sr->json) {
+        fprintf(sr->out, "{\"window\":%llu,\"start\":%llu,\"accesses\":%llu,\"faults\":%llu,"
+            "\"fault_rate\":%.6f,\"tlb_hit_rate\":%.6f,\"working_set\":%llu,\"distinct_pages\":%llu,"
+            "\"cold\":%llu,\"reuse_log2\":[", (unsigned long long)sr->index,
+            (unsigned long long)sr->start, (unsigned long long)acc, (unsigned long long)faults,
+            (double)faults / acc, (double)hits / acc, (unsigned long long)sr->ws.size,
+            (unsigned long long)sr->distinct, (unsigned long long)sr->cold);
+        while (last > 0 && sr->hist[last] == 0) --last;
+        for (b = 0; b <= last; ++b) fprintf(sr->out, "%s%llu", b ? "," : "", (unsigned long long)sr->hist[b]);
+        fprintf(sr->out, "]}\n");
+    } else {
+        fprintf(sr->out, "%llu,%llu,%llu,%llu,%.6f,%.6f,%llu,%llu,%llu", (unsigned long long)sr->index,
+            (unsigned long long)sr->start, (unsigned long long)acc, (unsigned long long)faults,
+            (double)faults / acc, (double)hits / acc, (unsigned long long)sr->ws.size,
+            (unsigned long long)sr->distinct, (unsigned long long)sr->cold);
+        for (b = 0; b < RD_BUCKETS; ++b) fprintf(sr->out, ",%llu", (unsigned long long)sr->hist[b]);
+        fprintf(sr->out, "\n");
+    }
+    ++sr->index;
+    sr->start = s->accesses;
+    sr->end = s->accesses + sr->window;
+    sr->faults = s->page_fault;
+    sr->tlb_hit = s->tlb_hit;
+    sr->distinct = sr->cold = 0;
+    memset(sr->hist, 0, sizeof(sr->hist));
+}
+
+
+// Emit the last, partial window and close the output
+void series_finish(struct sim *s) {
+    struct series *sr = s->series;
+    if (s->accesses > sr->start) series_emit(s);
+    if (sr->out != stdout) fclose(sr->out);
+    wset_free(&sr->ws);
+    pmap_free(&sr->seen);
+    stack_free();
+    free(sr);
+    s->series = NULL;
+}
+
+/***********************************************************
+*    Dynamic frame allocation. With `--resize`, the frames *
+*  given to small pages (`alloc`) are revised every        *
+*  `resize_interval` accesses, between 1 and the `-n`      *
+*  frames of the machine:                                  *
+*    pff  Page-Fault-Frequency: the interval's fault rate  *
+*         above `pff_high` grows the allocation by an      *
+*         eighth, below `pff_low` shrinks it by an eighth  *
+*    ws   working set: the allocation becomes W(t, tau),   *
+*         the distinct pages among the last `tau` accesses *
+*  Shrinking evicts through the same path as a fault, so   *
+*  the replacement policy picks the pages given up.        *
+************************************************************/
+void resize_frames(struct sim *s) {
+    int max = s->p_pages - (s->huge_frames << HUGE_BITS), step = s->alloc / 8 > 1 ? s->alloc / 8 : 1;
+    if (s->resize == RESIZE_PFF) {
+        double rate = (double)(s->page_fault - s->resize_faults) / s->resize_interval;
+        if (rate > s->pff_high) s->alloc += step;
+        else if (rate < s->pff_low) s->alloc -= step;
+    } else {
+        s->alloc = s->ws->size;
+    }
+    if (s->alloc > max) s->alloc = max;
+    if (s->alloc < 1) s->alloc = 1;
+    while (s->frames->used > s->alloc) s->free_frames[s->n_free_frames++] = evict(s, 0, NO_KEY);
+    s->resize_faults = s->page_fault;
+    s->resize_at = s->accesses + s->resize_interval;
+}
+
+/* Without a time series or resizing, a batch goes straight to
+ * `simulate`; with them it is cut where they have work to do.
+ */
+void observed_feed(struct sim *s, const uint64_t *buf, int n) {
+    struct series *sr = s->series;
+    int i;
+    while (n > 0) {
+        uint64_t stop = sr != NULL ? sr->end : UINT64_MAX;
+        if (s->resize && s->resize_at < stop) stop = s->resize_at;
+        int m = stop - s->accesses < (uint64_t)n ? stop - s->accesses : n;
+        simulate(s, buf, m);
+        s->alloc_accesses += (uint64_t)s->alloc * m;
+        for (i = 0; i < m; ++i) {
+            uint64_t page = s->page_tag | ((buf[i] >> OFFSET) & VPAGE_MASK);
+            if (sr != NULL) series_page(sr, page);
+            if (s->ws != NULL) wset_add(s->ws, page);
+        }
+        if (sr != NULL && s->accesses == sr->end) series_emit(s);
+        if (s->resize && s->accesses == s->resize_at) resize_frames(s);
+        buf += m;
+        n -= m;
+    }
+}
+
+static inline void feed(struct sim *s, const uint64_t *buf, int n) {
+    if (s->series != NULL || s->resize) observed_feed(s, buf, n);
+    else simulate(s, buf, n);
+}
+
+/***********************************************************
+*    Multiprogramming. With several traces, each is a      *
+*  process with its own page table, and a round-robin      *
+*  scheduler runs them `quantum` accesses at a time until  *
+*  all are done. All processes page from the same backing  *
+*  store. Replacement is either global, one policy over    *
+*  all frames, or local, every process holding an equal    *
+*  share of the frames under a policy of its own. On a     *
+*  context switch the TLBs are flushed, unless their terms *
+*  are tagged with the process id as ASIDs are.            *
+************************************************************/
+struct trace *traces;  // One trace per process
+int n_traces = 1;
+
+// Charge the counters since the last context switch to the running process
+void account(struct sim *s) {
+    struct proc *p = &s->procs[s->cur];
+    p->accesses += s->accesses - s->mark[0];
+    p->tlb_hit += s->tlb_hit - s->mark[1];
+    p->stlb_hit += s->stlb_hit - s->mark[2];
+    p->page_fault += s->page_fault - s->mark[3];
+    s->mark[0] = s->accesses;
+    s->mark[1] = s->tlb_hit;
+    s->mark[2] = s->stlb_hit;
+    s->mark[3] = s->page_fault;
+}
+
+void switch_to(struct sim *s, int pid) {
+    account(s);
+    s->cur = pid;
+    s->pt = s->procs[pid].pt;
+    s->frames = s->procs[pid].frames;
+    s->page_tag = (uint64_t)pid << PID_SHIFT;
+    if (s->asid) {
+        s->tlb_tag = s->page_tag;
+    } else {
+        tlb_flush(s->tlb);
+        if (s->stlb != NULL) tlb_flush(s->stlb);
+    }
+    ++s->switches;
+}
+
+void run_multi(struct sim *s) {
+    uint64_t buf[BATCH], *pos = calloc(n_traces, sizeof(uint64_t));
+    int live = n_traces, p;
+    double t0 = now_secs();
+    for (p = 0; live > 0; p = (p + 1) % n_traces) {
+        const struct trace *t = &traces[p];
+        if (pos[p] == t->count) continue;
+        uint64_t end = t->count - pos[p] < s->quantum ? t->count : pos[p] + s->quantum;
+        if (p != s->cur) switch_to(s, p);
+        while (pos[p] < end) {
+            int n = end - pos[p] < BATCH ? end - pos[p] : BATCH;
+            trace_read_at(t, pos[p], buf, n);
+            feed(s, buf, n);
+            pos[p] += n;
+        }
+        if (pos[p] == t->count) --live;
+    }
+    account(s);
+    s->secs = now_secs() - t0;
+    free(pos);
+}
+
+// Replay the whole of a loaded trace on one simulation
+void run_sim(struct sim *s, const struct trace *t) {
+    uint64_t buf[BATCH], pos;
+    if (s->n_procs > 1) {
+        run_multi(s);
+        return;
+    }
+    double t0 = now_secs();
+    for (pos = 0; pos < t->count; pos += BATCH) {
+        int n = t->count - pos < BATCH ? t->count - pos : BATCH;
+        trace_read_at(t, pos, buf, n);
+        feed(s, buf, n);
+    }
+    s->secs = now_secs() - t0;
+}
+
+/***********************************************************
+*    Streaming runs. `run_stream` feeds one simulation     *
+*  from a trace as it is read, and prints a progress line  *
+*  every `report` accesses, and on SIGUSR1 once the batch  *
+*  in hand is done. With a checkpoint file, SIGINT and     *
+*  SIGTERM stop it after that batch so the state can be    *
+*  saved: the run is paused, and `--restore` picks it up   *
+*  again, on the rest of the same trace file or on a new   *
+*  segment.                                                *
+************************************************************/
+#define CKPT_MAGIC 0x31544B434D56ULL  // "VMCKT1"
+
+volatile sig_atomic_t report_signal, stop_signal;
+
+void on_signal(int sig) {
+    if (sig == SIGUSR1) report_signal = 1;
+    else stop_signal = 1;
+}
+
+void catch_signals(int stop) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sa.sa_flags = SA_RESTART;  // A progress line does not cut a read short
+    sigaction(SIGUSR1, &sa, NULL);
+    if (!stop) return;
+    sa.sa_flags = 0;  // A stop does, a read blocked on an idle pipe ends
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+}
+
+// Counters at the last progress line
+struct progress {
+    uint64_t accesses, faults;
+    double secs;
+};
+
+void print_progress(const struct sim *s, struct progress *last) {
+    double now = now_secs(), acc = s->accesses ? s->accesses : 1;
+    uint64_t n = s->accesses - last->accesses, f = s->page_fault - last->faults;
+    printf("Progress: Accesses = %llu, Page Faults = %llu (%.4f, %.4f since the last line),"
+        " TLB Hits = %llu (%.4f), %.0f accesses/sec\n", (unsigned long long)s->accesses,
+        (unsigned long long)s->page_fault, s->page_fault / acc, n ? (double)f / n : 0.0,
+        (unsigned long long)s->tlb_hit, s->tlb_hit / acc,
+        now > last->secs ? n / (now - last->secs) : 0.0);
+    fflush(stdout);
+    last->accesses = s->accesses;
+    last->faults = s->page_fault;
+    last->secs = now;
+}
+
+// Run `s` on what is left of `t`, return the number of records read
+uint64_t run_stream(struct sim *s, struct trace *t, uint64_t report) {
+    uint64_t buf[BATCH], read = 0;
+    uint64_t next = report ? (s->accesses / report + 1) * report : UINT64_MAX;
+    struct progress last = {s->accesses, s->page_fault, now_secs()};
+    double t0 = last.secs;
+    int n, k, m;
+    while (!stop_signal && (n = trace_read(t, buf, BATCH)) > 0) {
+        read += n;
+        for (k = 0; k < n; k += m) {
+            m = next - s->accesses < (uint64_t)(n - k) ? next - s->accesses : n - k;
+            feed(s, buf + k, m);
+            if (s->accesses == next) {
+                print_progress(s, &last);
+                next += report;
+            }
+        }
+        if (report_signal) {
+            report_signal = 0;
+            print_progress(s, &last);
+        }
+    }
+    s->secs += now_secs() - t0;
+    return read;
+}
+
+/* Only the pages of the private backing store that differ from
+ * the file are saved, each behind its offset, up to NO_PAGE.
+ */
+void bs_ckpt(struct sim *s, struct ckpt *ck) {
+    uint64_t off, n;
+    char *orig = malloc(PAGE_SIZE);
+    if (ck->save) {
+        for (off = 0; s->bs != NULL && off < bs_size; off += PAGE_SIZE) {
+            n = bs_size - off < PAGE_SIZE ? bs_size - off : PAGE_SIZE;
+            if (pread(bs_fd, orig, n, off) == (ssize_t)n && memcmp(orig, s->bs + off, n) == 0) continue;
+            CK(ck, off);
+            ck_io(ck, s->bs + off, n);
+        }
+        off = NO_PAGE;
+        CK(ck, off);
+    } else {
+        for (;;) {
+            CK(ck, off);
+            if (ck->bad || off == NO_PAGE) break;
+            if (s->bs == NULL || off >= bs_size) {
+                ck->bad = 1;
+                break;
+            }
+            n = bs_size - off < PAGE_SIZE ? bs_size - off : PAGE_SIZE;
+            ck_io(ck, s->bs + off, n);
+        }
+    }
+    free(orig);
+}
+
+// The state of a single-process simulation without huge pages or OPT
+void sim_ckpt(struct sim *s, struct ckpt *ck) {
+    int small = s->p_pages - (s->huge_frames << HUGE_BITS), i;
+    ck_check(ck, OFFSET);
+    ck_check(ck, VA_BITS);
+    ck_check(ck, s->pt_type - page_tables);
+    ck_check(ck, s->p_pages);
+    ck_check(ck, s->stlb_entries);
+    ck_check(ck, s->prefetch);
+    ck_check(ck, s->resize);
+    ck_check(ck, bs_size);
+    tlb_ckpt(s->tlb, ck);
+    if (s->stlb != NULL) tlb_ckpt(s->stlb, ck);
+    ck_check(ck, s->n_caches);
+    ck_check(ck, s->line_bits);
+    for (i = 0; i < s->n_caches; ++i) {
+        tlb_ckpt(s->caches[i].t, ck);
+        CK(ck, s->caches[i].accesses);  CK(ck, s->caches[i].hits);
+    }
+    policy_ckpt(s->frames, ck);
+    ck_io(ck, s->free_frames, small * sizeof(int));
+    CK(ck, s->n_free_frames);
+    ck_io(ck, s->dirty, small);
+    ck_io(ck, s->mm, MM_SIZE(s));
+    bs_ckpt(s, ck);
+    if (s->pf_flag != NULL) {
+        ck_io(ck, s->pf_flag, small);
+        CK(ck, s->streams);
+        CK(ck, s->ra_start);  CK(ck, s->ra_marker);  CK(ck, s->ra_prev);  CK(ck, s->ra_size);
+    }
+    CK(ck, s->alloc);  CK(ck, s->peak_alloc);
+    CK(ck, s->resize_at);  CK(ck, s->resize_faults);  CK(ck, s->alloc_accesses);
+    if (s->ws != NULL) wset_ckpt(s->ws, ck);
+    CK(ck, s->accesses);  CK(ck, s->tlb_hit);  CK(ck, s->stlb_hit);  CK(ck, s->page_fault);
+    CK(ck, s->pf_issued);  CK(ck, s->pf_used);  CK(ck, s->pf_polluted);
+    CK(ck, s->writes);  CK(ck, s->wb_sync);  CK(ck, s->wb_async);  CK(ck, s->wb_bytes);
+    CK(ck, s->stall_us);  CK(ck, s->background_us);
+    CK(ck, s->secs);
+    CK(ck, s->pt->walk_refs);
+    s->pt->ops->ckpt(s->pt, ck);
+}
+
+/* Save the state of `s` to `path` (through a temporary file, so a
+ * crash never leaves half a checkpoint), or restore it. The trace
+ * name and how many of its records were read go along.
+ */
+int checkpoint(struct sim *s, const char *path, int save, char *trace_name, uint64_t *trace_pos) {
+    char tmp[4096];
+    struct ckpt ck = {NULL, save, 0};
+    uint32_t len = save ? strlen(trace_name) : 0;
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    ck.fp = fopen(save ? tmp : path, save ? "w" : "r");
+    if (ck.fp == NULL) {
+        perror(save ? tmp : path);
+        return -1;
+    }
+    ck_check(&ck, CKPT_MAGIC);
+    CK(&ck, len);
+    if (len >= sizeof(tmp)) ck.bad = 1;
+    ck_io(&ck, trace_name, len);
+    if (!ck.bad) trace_name[len] = 0;
+    CK(&ck, *trace_pos);
+    sim_ckpt(s, &ck);
+    if (fclose(ck.fp) != 0) ck.bad = 1;
+    if (ck.bad) {
+        printf("%s: %s\n", path, save ? "cannot write the checkpoint"
+            : "not a checkpoint of this configuration");
+        return -1;
+    }
+    if (save && rename(tmp, path) != 0) {
+        perror(path);
+        return -1;
+    }
+    return 0;
+}
+
+// Per-process results of a multiprogrammed run, after `sim_free`
+void print_procs(const struct sim *s, char **names) {
+    int i;
+    printf("Processes = %d (quantum %llu, %s replacement, %s TLB), Context Switches = %llu\n",
+        s->n_procs, (unsigned long long)s->quantum, s->local ? "local" : "global",
+        s->asid ? "ASID-tagged" : "flushed", (unsigned long long)s->switches);
+    for (i = 0; i < s->n_procs; ++i) {
+        const struct proc *p = &s->procs[i];
+        printf("  %d %s: Accesses = %llu, Page Faults = %llu (%.4f), TLB Hits = %llu (%.4f)\n", i, names[i],
+            (unsigned long long)p->accesses, (unsigned long long)p->page_fault,
+            p->accesses ? (double)p->page_fault / p->accesses : 0.0, (unsigned long long)p->tlb_hit,
+            p->accesses ? (double)p->tlb_hit / p->accesses : 0.0);
+    }
+}
+
+/* Accuracy is the share of prefetched pages that were used,
+ * coverage the share of would-be faults that prefetching
+ * saved, pollution the share evicted before any use.
+ */
+void print_prefetch_stats(const struct sim *s) {
+    uint64_t covered = s->pf_used + s->page_fault - s->huge_fault;
+    printf("Prefetch (%s, depth %d): Issued = %llu, Used = %llu, Polluted = %llu\n",
+        prefetch_names[s->prefetch], s->prefetch_depth, (unsigned long long)s->pf_issued,
+        (unsigned long long)s->pf_used, (unsigned long long)s->pf_polluted);
+    printf("Prefetch Accuracy = %.4f, Coverage = %.4f, Pollution = %.4f\n",
+        s->pf_issued ? (double)s->pf_used / s->pf_issued : 0.0,
+        covered ? (double)s->pf_used / covered : 0.0,
+        s->pf_issued ? (double)s->pf_polluted / s->pf_issued : 0.0);
+}
+
+/* Per page size: how well the TLB did and what faults cost.
+ * The reach is what the TLBs map at the end of the run.
+ */
+void print_cache_stats(const struct sim *s) {
+    double tlb, walk, caches, faults, total = amat(s, &tlb, &walk, &caches, &faults);
+    int i;
+    for (i = 0; i < s->n_caches; ++i) {
+        const struct cache *c = &s->caches[i];
+        printf("%s Hits = %llu of %llu (%.4f; %llu bytes, %d-way %s, %d-byte lines, %g ns)\n",
+            cache_name(s, i), (unsigned long long)c->hits, (unsigned long long)c->accesses,
+            c->accesses ? (double)c->hits / c->accesses : 0.0, (unsigned long long)c->size,
+            c->ways, set_repl_names[c->repl], 1 << s->line_bits, c->ns);
+    }
+    printf("AMAT = %.2f ns (%.2f TLB + %.2f page walks + %.2f caches and memory + %.2f page faults)\n",
+        total, tlb, walk, caches, faults);
+}
+
+void print_huge_stats(const struct sim *s) {
+    uint64_t small_acc = s->accesses - s->huge_accesses, small_fault = s->page_fault - s->huge_fault;
+    uint64_t small = 0, huge = 0;
+    printf("Huge Pages = %llu regions of %llu bytes, %d huge frames\n", (unsigned long long)n_huge_pages,
+        (unsigned long long)HUGE_SIZE, s->huge_frames);
+    printf("Small Pages: Accesses = %llu, TLB Hit Rate = %.4f, Faults = %llu, Bytes Moved = %llu (%llu per fault)\n",
+        (unsigned long long)small_acc, small_acc ? (double)(s->tlb_hit - s->huge_tlb_hit) / small_acc : 0.0,
+        (unsigned long long)small_fault, (unsigned long long)(small_fault * PAGE_SIZE),
+        (unsigned long long)PAGE_SIZE);
+    printf("Huge Pages: Accesses = %llu, TLB Hit Rate = %.4f, Faults = %llu, Bytes Moved = %llu (%llu per fault)\n",
+        (unsigned long long)s->huge_accesses,
+        s->huge_accesses ? (double)s->huge_tlb_hit / s->huge_accesses : 0.0,
+        (unsigned long long)s->huge_fault, (unsigned long long)(s->huge_fault * HUGE_SIZE),
+        (unsigned long long)HUGE_SIZE);
+    tlb_count(s->tlb, &small, &huge);
+    if (s->htlb != NULL) tlb_count(s->htlb, &small, &huge);
+    printf("TLB Reach = %llu bytes (%llu small and %llu huge terms)\n",
+        (unsigned long long)(small * PAGE_SIZE + huge * HUGE_SIZE),
+        (unsigned long long)small, (unsigned long long)huge);
+    if (s->stlb != NULL) {
+        small = huge = 0;
+        tlb_count(s->stlb, &small, &huge);
+        printf("STLB Reach = %llu bytes (%llu small and %llu huge terms)\n",
+            (unsigned long long)(small * PAGE_SIZE + huge * HUGE_SIZE),
+            (unsigned long long)small, (unsigned long long)huge);
+    }
+}
+
+// Entries, or sets x ways for a set-associative TLB
+void tlb_shape(char *buf, int entries, int ways) {
+    if (ways == 0) sprintf(buf, "%d", entries);
+    else sprintf(buf, "%dx%d", entries / ways, ways);
+}
+
+const char *tlb_policy_name(const struct sim *s) {
+    return s->tlb_ways ? set_repl_names[s->tlb_repl] : s->tlb_ops->name;
+}
+
+/***********************************************************
+*    A sweep runs one simulation per configuration on a    *
+*  pool of worker threads. The trace is loaded (or mapped) *
+*  once and every worker walks it with its own cursor, so  *
+*  the workers share nothing writable but the job counter. *
+************************************************************/
+struct sweep {
+    struct sim *sims;
+    int n_sims;
+    int next;  // Next configuration to run
+    const struct trace *t;
+};
+
+void *sweep_worker(void *arg) {
+    struct sweep *sw = arg;
+    int i;
+    while ((i = __atomic_fetch_add(&sw->next, 1, __ATOMIC_RELAXED)) < sw->n_sims) {
+        sim_init(&sw->sims[i]);
+        run_sim(&sw->sims[i], sw->t);
+        sim_free(&sw->sims[i]);
+    }
+    return NULL;
+}
+
+void run_sweep(struct sim *sims, int n_sims, const struct trace *t, int n_threads) {
+    struct sweep sw = {sims, n_sims, 0, t};
+    pthread_t *tid = malloc(n_threads * sizeof(pthread_t));
+    int i;
+    if (n_threads > n_sims) n_threads = n_sims;
+    for (i = 0; i < n_threads; ++i) pthread_create(&tid[i], NULL, sweep_worker, &sw);
+    for (i = 0; i < n_threads; ++i) pthread_join(tid[i], NULL);
+    free(tid);
+    printf("%-7s %-7s %8s %8s %12s %10s %12s %10s %10s %9s %10s %10s %10s", "tlb_pol", "pt_pol",
+        "frames", "tlb", "faults", "fault_rate", "tlb_hits", "tlb_rate", "stlb_rate",
+        "walk/miss", "ns/access", "writebacks", "stall_ms");
+    if (sims[0].n_procs > 1) printf(" %10s", "switches");
+    if (sims[0].resize) printf(" %6s %10s %9s", "resize", "avg_frames", "peak_held");
+    if (sims[0].prefetch) printf(" %8s %8s %8s %8s", "prefetch", "pf_acc", "pf_cov", "pf_poll");
+    if (HUGE_BITS) printf(" %12s %10s %10s", "huge_faults", "huge_tlb", "MB_moved");
+    if (sims[0].n_caches) {
+        char name[16];
+        for (i = 0; i < sims[0].n_caches; ++i) {
+            snprintf(name, sizeof(name), "%s_rate", cache_name(&sims[0], i));
+            printf(" %8s", name);
+        }
+        printf(" %9s", "amat_ns");
+    }
+    printf("\n");
+    for (i = 0; i < n_sims; ++i) {
+        struct sim *s = &sims[i];
+        double acc = s->accesses ? s->accesses : 1;
+        uint64_t misses = s->accesses - s->tlb_hit - s->stlb_hit;
+        char shape[32];
+        tlb_shape(shape, s->tlb_entries, s->tlb_ways);
+        printf("%-7s %-7s %8d %8s %12llu %10.4f %12llu %10.4f %10.4f %9.2f %10.1f %10llu %10.1f",
+            tlb_policy_name(s), s->pt_ops->name, s->p_pages, shape,
+            (unsigned long long)s->page_fault, s->page_fault / acc,
+            (unsigned long long)s->tlb_hit, s->tlb_hit / acc, s->stlb_hit / acc,
+            misses ? (double)s->walk_refs / misses : 0.0, s->secs * 1e9 / acc,
+            (unsigned long long)(s->wb_sync + s->wb_async), s->stall_us / 1000);
+        if (s->n_procs > 1) printf(" %10llu", (unsigned long long)s->switches);
+        if (s->resize)
+            printf(" %6s %10.1f %9d", resize_names[s->resize], s->alloc_accesses / acc, s->peak_alloc);
+        if (s->prefetch) {
+            uint64_t covered = s->pf_used + s->page_fault - s->huge_fault;
+            printf(" %8s %8.4f %8.4f %8.4f", prefetch_names[s->prefetch],
+                s->pf_issued ? (double)s->pf_used / s->pf_issued : 0.0,
+                covered ? (double)s->pf_used / covered : 0.0,
+                s->pf_issued ? (double)s->pf_polluted / s->pf_issued : 0.0);
+        }
+        if (HUGE_BITS)
+            printf(" %12llu %10.4f %10.1f", (unsigned long long)s->huge_fault,
+                s->huge_accesses ? (double)s->huge_tlb_hit / s->huge_accesses : 0.0,
+                ((s->page_fault - s->huge_fault) * PAGE_SIZE + s->huge_fault * HUGE_SIZE) / 1048576.0);
+        if (s->n_caches) {
+            double tlb, walk, caches, faults;
+            int j;
+            for (j = 0; j < s->n_caches; ++j)
+                printf(" %8.4f", s->caches[j].accesses ? (double)s->caches[j].hits / s->caches[j].accesses : 0.0);
+            printf(" %9.2f", amat(s, &tlb, &walk, &caches, &faults));
+        }
+        printf("\n");
+    }
+}
+
+/* A set-associative TLB needs a power-of-two number of sets,
+ * and PLRU a power-of-two number of ways, its tree of at most
+ * 63 bits kept in one word.
+ */
+int valid_tlb_shape(int entries, int ways, int repl) {
+    int sets = ways > 0 ? entries / ways : 0;
+    return ways > 0 && ways <= 64 && sets * ways == entries && (sets & (sets - 1)) == 0
+        && (repl != SET_PLRU || (ways & (ways - 1)) == 0);
+}
+
+// Parse a byte count with an optional K, M or G suffix
+uint64_t parse_size(const char *arg) {
+    char *end;
+    uint64_t v = strtoull(arg, &end, 0);
+    if (*end == 'k' || *end == 'K') v <<= 10;
+    else if (*end == 'm' || *end == 'M') v <<= 20;
+    else if (*end == 'g' || *end == 'G') v <<= 30;
+    return v;
+}
+
+// Split a comma-separated option value, return the number of items
+int split_list(char *arg, char **items, int max) {
+    int n = 0;
+    char *tok = strtok(arg, ",");
+    while (tok != NULL && n < max) {
+        items[n++] = tok;
+        tok = strtok(NULL, ",");
+    }
+    return n;
+}
+
+/* Parse `--cache size[:ways[:policy]],...`, L1 first, into
+ * `caches`. Return the number of levels, or -1 when a level
+ * does not make a valid set-associative cache of such lines.
+ */
+int parse_caches(char *arg, struct cache *caches, int line_bits) {
+    char *items[MAX_CACHES + 1], *ways, *repl;
+    int n = split_list(arg, items, MAX_CACHES + 1), i;
+    if (n > MAX_CACHES) return -1;
+    for (i = 0; i < n; ++i) {
+        struct cache *c = &caches[i];
+        c->size = parse_size(items[i]);
+        c->ways = 8;
+        c->repl = SET_LRU;
+        if ((ways = strchr(items[i], ':')) != NULL) {
+            c->ways = atoi(ways + 1);
+            if ((repl = strchr(ways + 1, ':')) != NULL) c->repl = find_set_repl(repl + 1);
+        }
+        if (c->repl == -1 || c->size >> line_bits > 1 << 30 || (c->size & ((1ULL << line_bits) - 1))
+            || !valid_tlb_shape(c->size >> line_bits, c->ways, c->repl))
+            return -1;
+    }
+    return n;
+}
+
+void usage() {
+	printf("usage:./vm bs addresses.txt -p replacement_strategy -n n_physical_pages [-t tlb_entries]\n");
+	printf("      ./vm bs addresses.txt --tlb-policy lru --pt-policy clock ...\n");
+	printf("      ./vm bs addresses.txt -p FIFO,LRU -n 64,128,256 -t 8,16 [-j threads]\n");
+	printf("      replacement strategies: fifo, lru, opt, clock, sc (second chance), lfu, arc\n");
+	printf("      geometry: --page-size bytes (default 256), --va-bits bits (default 16),\n");
+	printf("                -t/--tlb-entries n (default 16)\n");
+	printf("      set-associative TLB: --tlb-ways w, with --tlb-policy lru|plru|fifo per set\n");
+	printf("      second-level TLB: --stlb-entries n [--stlb-ways w (default 8)] [--stlb-policy lru|plru|fifo]\n");
+	printf("      huge pages: --huge-page bytes --huge-regions file|auto[=fraction (default 0.5)]\n");
+	printf("                  [--huge-frames n (default half of memory)] [--huge-tlb n (default shared)]\n");
+	printf("      readahead: --prefetch next|stride|adaptive [--prefetch-depth n (default 8)]\n");
+	printf("      dirty pages: --clean-first[=n (default 8)] --read-cost us --write-cost us (default 100, 200)\n");
+	printf("      dynamic frames: --resize pff|ws [--resize-interval n (default 10000)]\n");
+	printf("                      [--pff high,low (default 0.05,0.01)] [--tau n (default interval)]\n");
+	printf("      processes: ./vm bs trace1 trace2 ... [--quantum n (default 10000)]\n");
+	printf("                 [--replacement global|local] [--tlb-switch flush|asid]\n");
+	printf("      sampling (SHARDS): --sample rate | --sample-size pages (with --sweep) [--sample-check]\n");
+	printf("      streaming: a trace of - (standard input) or a FIFO is read as it comes\n");
+	printf("                 [--report n] [--checkpoint file] [--restore file], SIGUSR1 prints progress\n");
+	printf("      time series: --series file|- [--window n (default 100000)] [--tau n (default window)]\n");
+	printf("                   [--series-format csv|json]\n");
+	printf("      data caches: --cache size[:ways (default 8)[:lru|plru|fifo]],... (L1 first, up to %d)\n", MAX_CACHES);
+	printf("                   [--line-size bytes (default 64)] [--cache-latency l1,...,memory (ns)]\n");
+	printf("                   [--tlb-latency stlb,walk (ns, default 2,10)], reports hit rates and AMAT\n");
+	printf("      page table: --page-table flat|radix2|radix3|radix4|hashed (default flat,\n");
+	printf("                  or radix4 when the address space is too large for flat)\n");
+	printf("      ./vm bs addresses.txt -p LRU --sweep\n");
+	printf("      ./vm -c addresses.txt addresses.bin [-w record_width]\n");
+}
+
+#define MAX_LIST 64
+
+int main(int argc, char *argv[]) {
+	int opt, convert = 0, width = 4, sweep = 0, n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	int va_bits = 16, page_bits, tlb_ways = 0, stlb_entries = 0, stlb_ways = 8, stlb_repl = SET_LRU;
+	int huge_frames = -1, htlb_entries = 0, prefetcher = PF_NONE, prefetch_depth = 8, clean_first = 0;
+	double read_cost = 100, write_cost = 200;
+	char *series_path = NULL;
+	int series_json = 0;
+	uint64_t window = 100000, tau = 0, resize_interval = 10000;
+	int resize = RESIZE_NONE, local = 0, asid = 0;
+	uint64_t quantum = 10000;
+	double pff_high = 0.05, pff_low = 0.01;
+	double sample_rate = 0;
+	int sample_size = 0, sample_check = 0;
+	char *checkpoint_path = NULL, *restore_path = NULL;
+	uint64_t report = 0;
+	uint64_t page_size = 256, huge_size = 0, line_size = 64;
+	char *huge_arg = NULL;
+	char *cache_arg = NULL, *cache_lat_arg = NULL, *tlb_lat_arg = NULL;
+	char *string = "n:p:t:j:cw:";
+	char *pt_type_arg = NULL, *rs_arg = NULL, *n_arg = NULL, *t_arg = NULL, *tlb_rs_arg = NULL, *pt_rs_arg = NULL;
+	struct option long_opts[] = {
+		{"sweep", no_argument, 0, 'S'},
+		{"tlb-policy", required_argument, 0, 'T'},
+		{"pt-policy", required_argument, 0, 'P'},
+		{"page-size", required_argument, 0, 'G'},
+		{"va-bits", required_argument, 0, 'V'},
+		{"tlb-entries", required_argument, 0, 't'},
+		{"page-table", required_argument, 0, 'R'},
+		{"tlb-ways", required_argument, 0, 'W'},
+		{"stlb-entries", required_argument, 0, 'E'},
+		{"stlb-ways", required_argument, 0, 'X'},
+		{"stlb-policy", required_argument, 0, 'Y'},
+		{"huge-page", required_argument, 0, 'H'},
+		{"huge-regions", required_argument, 0, 'U'},
+		{"huge-frames", required_argument, 0, 'F'},
+		{"huge-tlb", required_argument, 0, 'B'},
+		{"prefetch", required_argument, 0, 'A'},
+		{"prefetch-depth", required_argument, 0, 'D'},
+		{"clean-first", optional_argument, 0, 'K'},
+		{"read-cost", required_argument, 0, 'I'},
+		{"write-cost", required_argument, 0, 'O'},
+		{"series", required_argument, 0, 'Q'},
+		{"window", required_argument, 0, 'Z'},
+		{"tau", required_argument, 0, 'M'},
+		{"series-format", required_argument, 0, 'J'},
+		{"resize", required_argument, 0, 'z'},
+		{"quantum", required_argument, 0, 'q'},
+		{"replacement", required_argument, 0, 'L'},
+		{"tlb-switch", required_argument, 0, 'a'},
+		{"resize-interval", required_argument, 0, 'i'},
+		{"pff", required_argument, 0, 'f'},
+		{"sample", required_argument, 0, 'r'},
+		{"sample-size", required_argument, 0, 'N'},
+		{"sample-check", no_argument, 0, 'C'},
+		{"report", required_argument, 0, 'e'},
+		{"checkpoint", required_argument, 0, 'k'},
+		{"restore", required_argument, 0, 'g'},
+		{"cache", required_argument, 0, 'y'},
+		{"line-size", required_argument, 0, 'l'},
+		{"cache-latency", required_argument, 0, 'm'},
+		{"tlb-latency", required_argument, 0, 'x'},
+		{0, 0, 0, 0}
+	};
+	while((opt = getopt_long(argc, argv, string, long_opts, NULL))!= -1)
+	{
+		// printf("%c %s\n", opt, optarg);
+		if (opt == 'n')
+			n_arg = optarg;
+		else if (opt == 'p')
+			rs_arg = optarg;
+		else if (opt == 't')
+			t_arg = optarg;
+		else if (opt == 'j')
+			n_threads = atoi(optarg);
+		else if (opt == 'c')
+			convert = 1;
+		else if (opt == 'w')
+			width = atoi(optarg);
+		else if (opt == 'S')
+			sweep = 1;
+		else if (opt == 'T')
+			tlb_rs_arg = optarg;
+		else if (opt == 'P')
+			pt_rs_arg = optarg;
+		else if (opt == 'G')
+			page_size = parse_size(optarg);
+		else if (opt == 'V')
+			va_bits = atoi(optarg);
+		else if (opt == 'R')
+			pt_type_arg = optarg;
+		else if (opt == 'W')
+			tlb_ways = atoi(optarg);
+		else if (opt == 'E')
+			stlb_entries = atoi(optarg);
+		else if (opt == 'X')
+			stlb_ways = atoi(optarg);
+		else if (opt == 'Y')
+			stlb_repl = find_set_repl(optarg);
+		else if (opt == 'H')
+			huge_size = parse_size(optarg);
+		else if (opt == 'U')
+			huge_arg = optarg;
+		else if (opt == 'F')
+			huge_frames = atoi(optarg);
+		else if (opt == 'B')
+			htlb_entries = atoi(optarg);
+		else if (opt == 'A')
+			prefetcher = find_prefetcher(optarg);
+		else if (opt == 'D')
+			prefetch_depth = atoi(optarg);
+		else if (opt == 'K')
+			clean_first = optarg != NULL ? atoi(optarg) : 8;
+		else if (opt == 'I')
+			read_cost = atof(optarg);
+		else if (opt == 'O')
+			write_cost = atof(optarg);
+		else if (opt == 'Q')
+			series_path = optarg;
+		else if (opt == 'Z')
+			window = strtoull(optarg, NULL, 0);
+		else if (opt == 'M')
+			tau = strtoull(optarg, NULL, 0);
+		else if (opt == 'q')
+			quantum = strtoull(optarg, NULL, 0);
+		else if (opt == 'L')
+			local = strcasecmp(optarg, "local") == 0 ? 1 : strcasecmp(optarg, "global") == 0 ? 0 : -1;
+		else if (opt == 'a')
+			asid = strcasecmp(optarg, "asid") == 0 ? 1 : strcasecmp(optarg, "flush") == 0 ? 0 : -1;
+		else if (opt == 'z')
+			resize = strcasecmp(optarg, "pff") == 0 ? RESIZE_PFF : strcasecmp(optarg, "ws") == 0 ? RESIZE_WS : -1;
+		else if (opt == 'i')
+			resize_interval = strtoull(optarg, NULL, 0);
+		else if (opt == 'f') {
+			if (sscanf(optarg, "%lf,%lf", &pff_high, &pff_low) != 2) pff_high = -1;
+		}
+		else if (opt == 'r')
+			sample_rate = atof(optarg);
+		else if (opt == 'N')
+			sample_size = atoi(optarg);
+		else if (opt == 'C')
+			sample_check = 1;
+		else if (opt == 'e')
+			report = strtoull(optarg, NULL, 0);
+		else if (opt == 'k')
+			checkpoint_path = optarg;
+		else if (opt == 'g')
+			restore_path = optarg;
+		else if (opt == 'y')
+			cache_arg = optarg;
+		else if (opt == 'l')
+			line_size = parse_size(optarg);
+		else if (opt == 'm')
+			cache_lat_arg = optarg;
+		else if (opt == 'x')
+			tlb_lat_arg = optarg;
+		else if (opt == 'J')
+			series_json = strcasecmp(optarg, "json") == 0 ? 1 : strcasecmp(optarg, "csv") == 0 ? 0 : -1;
+		else {
+			usage();
+			return 1;
+		}
+	}
+    // getopt has moved the file arguments behind the options
+    if (argc - optind < 2) {
+		usage();
+        return 1;
+    }
+    if (convert) {
+        if (width != 1 && width != 2 && width != 4 && width != 8) {
+            printf("Record width must be 1, 2, 4 or 8\n");
+            return 1;
+        }
+        return convert_trace(argv[optind], argv[optind + 1], width);
+    }
+
+    for (page_bits = 0; page_bits < 63 && (1ULL << page_bits) < page_size; ++page_bits);
+    if ((1ULL << page_bits) != page_size || page_bits < 4 || va_bits <= page_bits || va_bits > 63) {
+        printf("Page size must be a power of two of at least 16, below 2^va_bits (va_bits at most 63)\n");
+        return 1;
+    }
+    set_geometry(page_bits, va_bits);
+    choose_simulate();
+    const struct page_table_ops *pt_type = find_page_table(pt_type_arg != NULL ? pt_type_arg
+        : V_PAGES > MAX_FLAT_PAGES ? "radix4" : "flat");
+    if (pt_type == NULL) {
+        printf("Invalid page table!\n");
+        return 1;
+    }
+    if (pt_type == &page_tables[0] && V_PAGES > MAX_FLAT_PAGES) {
+        printf("The address space has too many pages for a flat page table\n");
+        return 1;
+    }
+    if (huge_size) {
+        for (HUGE_BITS = 0; (page_size << HUGE_BITS) < huge_size && HUGE_BITS < 32; ++HUGE_BITS);
+        HUGE_SIZE = huge_size;
+        if ((page_size << HUGE_BITS) != huge_size || HUGE_BITS == 0 || huge_size > V_PAGES * page_size
+            || huge_arg == NULL || htlb_entries < 0) {
+            printf("Huge pages must be a power of two larger than a page, with --huge-regions\n");
+            return 1;
+        }
+        if (huge_map_init() != 0) {
+            printf("The address space has too many huge pages\n");
+            return 1;
+        }
+    }
+
+/* Every combination of the listed policies, frame counts and TLB sizes is
+ * one simulation. `-p` names the policy of both the TLB and the page table;
+ * `--tlb-policy` and `--pt-policy` override it for one of them.
+ */
+    char *rs_list[MAX_LIST] = {"FIFO"}, *n_list[MAX_LIST] = {"256"}, *t_list[MAX_LIST] = {"16"};
+    char *tlb_rs_list[MAX_LIST], *pt_rs_list[MAX_LIST];
+    int n_rs = 1, n_n = 1, n_t = 1, n_tlb_rs, n_pt_rs, i, j, k, l;
+    if (rs_arg != NULL) n_rs = split_list(rs_arg, rs_list, MAX_LIST);
+    if (n_arg != NULL) n_n = split_list(n_arg, n_list, MAX_LIST);
+    if (t_arg != NULL) n_t = split_list(t_arg, t_list, MAX_LIST);
+    n_tlb_rs = tlb_rs_arg != NULL ? split_list(tlb_rs_arg, tlb_rs_list, MAX_LIST) : n_rs;
+    n_pt_rs = pt_rs_arg != NULL ? split_list(pt_rs_arg, pt_rs_list, MAX_LIST) : n_rs;
+    for (i = 0; i < n_rs; ++i)
+        if (find_policy(rs_list[i]) == NULL && (tlb_ways == 0 || find_set_repl(rs_list[i]) == -1)) {
+            printf("Invalid strategy!\n");
+            return 1;
+        }
+    if (clean_first < 0 || clean_first > MAX_CLEAN_SCAN || read_cost < 0 || write_cost < 0) {
+        printf("--clean-first takes 0 to %d victims, I/O costs must not be negative\n", MAX_CLEAN_SCAN);
+        return 1;
+    }
+    if (local == -1 || asid == -1 || quantum < 1) {
+        printf("Invalid replacement scope, TLB switching or quantum!\n");
+        return 1;
+    }
+    if (resize == -1 || resize_interval < 1 || pff_low < 0 || pff_high < pff_low) {
+        printf("Invalid frame resizing!\n");
+        return 1;
+    }
+    if (series_json == -1 || window < 1) {
+        printf("Invalid time series format or window!\n");
+        return 1;
+    }
+    if (prefetcher == -1 || prefetch_depth < 1) {
+        printf("Invalid prefetcher!\n");
+        return 1;
+    }
+    if (stlb_repl == -1 || (stlb_entries && !valid_tlb_shape(stlb_entries, stlb_ways, stlb_repl))) {
+        printf("Invalid second-level TLB!\n");
+        return 1;
+    }
+    // Each level is 4 times slower than the one above it, memory 80 ns
+    struct cache caches[MAX_CACHES];
+    int n_caches = 0, line_bits;
+    double latency[] = {1, 4, 15, 80}, mem_ns, stlb_ns = 2, walk_ns = 10;
+    for (line_bits = 0; line_bits < 63 && (1ULL << line_bits) < line_size; ++line_bits);
+    if ((1ULL << line_bits) != line_size || line_size > page_size) {
+        printf("The line size must be a power of two no larger than a page\n");
+        return 1;
+    }
+    if (cache_arg != NULL && (n_caches = parse_caches(cache_arg, caches, line_bits)) < 1) {
+        printf("Invalid caches! Give at most %d levels of size:ways[:policy], a power-of-two number of sets each\n",
+            MAX_CACHES);
+        return 1;
+    }
+    if (cache_lat_arg != NULL) {
+        char *items[MAX_CACHES + 2];
+        if (split_list(cache_lat_arg, items, MAX_CACHES + 2) != n_caches + 1) {
+            printf("--cache-latency takes one latency per cache level and one for memory\n");
+            return 1;
+        }
+        for (i = 0; i <= n_caches; ++i) latency[i] = atof(items[i]);
+    }
+    else latency[n_caches] = 80;
+    for (i = 0; i < n_caches; ++i) caches[i].ns = latency[i];
+    mem_ns = latency[n_caches];
+    if (tlb_lat_arg != NULL && sscanf(tlb_lat_arg, "%lf,%lf", &stlb_ns, &walk_ns) != 2) stlb_ns = -1;
+    if (stlb_ns < 0 || walk_ns < 0 || mem_ns < 0) {
+        printf("Invalid latencies!\n");
+        return 1;
+    }
+
+    if (sample_rate < 0 || sample_rate > 1 || sample_size < 0 || (sample_rate > 0 && sample_size > 0)
+        || (sample_check && sample_rate == 0 && sample_size == 0)) {
+        printf("Sample at a rate in (0, 1] or of a number of pages, not both\n");
+        return 1;
+    }
+    if (sample_size > 0 && !sweep) {
+        printf("--sample-size needs --sweep\n");
+        return 1;
+    }
+
+    struct trace trace;
+    if (sweep) {
+        if (n_rs != 1 || strcasecmp(rs_list[0], "LRU") != 0) {
+            printf("--sweep needs -p LRU\n");
+            return 1;
+        }
+        if (trace_open(&trace, argv[optind + 1]) != 0) {
+            perror(argv[optind + 1]);
+            return 1;
+        }
+        int ret = lru_sweep(&trace, sample_rate > 0 ? sample_threshold(sample_rate) : SAMPLE_MODULUS,
+            sample_size, sample_check);
+        trace_close(&trace);
+        return ret;
+    }
+	//printf("%s %s\n", argv[optind], argv[optind + 1]);
+    Init(argv[optind], argv[optind + 1], &trace);
+    n_traces = argc - optind - 1;
+    if (n_traces > 1) {
+        int pid_bits = 0;
+        while ((1 << pid_bits) < n_traces) ++pid_bits;
+        if (HUGE_BITS || VA_BITS - OFFSET + pid_bits > 62) {
+            printf("Several processes need no huge pages and %d bits of page number to spare\n", pid_bits);
+            return 1;
+        }
+        PID_SHIFT = VA_BITS - OFFSET;
+        PAGE_KEY_MASK = (1ULL << PID_SHIFT) - 1;
+    }
+
+    // Without overrides, each -p policy runs on both, paired rather than crossed
+    int paired = tlb_rs_arg == NULL && pt_rs_arg == NULL;
+    if (tlb_rs_arg == NULL) memcpy(tlb_rs_list, rs_list, sizeof(rs_list));
+    if (pt_rs_arg == NULL) memcpy(pt_rs_list, rs_list, sizeof(rs_list));
+    int n_sims = (paired ? n_rs : n_tlb_rs * n_pt_rs) * n_n * n_t;
+    struct sim *sims = calloc(n_sims, sizeof(struct sim)), *s = sims;
+    for (i = 0; i < n_tlb_rs; ++i)
+        for (l = 0; l < n_pt_rs; ++l)
+            for (j = 0; j < n_n && (!paired || i == l); ++j)
+                for (k = 0; k < n_t; ++k, ++s) {
+                    s->tlb_ops = find_policy(tlb_rs_list[i]);
+                    s->tlb_repl = find_set_repl(tlb_rs_list[i]);
+                    s->pt_ops = find_policy(pt_rs_list[l]);
+                    if (s->pt_ops == NULL || (tlb_ways ? s->tlb_repl == -1 : s->tlb_ops == NULL)) {
+                        printf("Invalid strategy!%s\n", tlb_ways && s->tlb_repl == -1
+                            ? " A set-associative TLB takes LRU, PLRU or FIFO." : "");
+                        return 1;
+                    }
+                    if (tlb_ways) s->tlb_ops = NULL;
+                    s->tlb_ways = tlb_ways;
+                    s->stlb_entries = stlb_entries;
+                    s->stlb_ways = stlb_ways;
+                    s->stlb_repl = stlb_repl;
+                    s->n_caches = n_caches;
+                    s->line_bits = line_bits;
+                    memcpy(s->caches, caches, sizeof(caches));
+                    s->mem_ns = mem_ns;
+                    s->stlb_ns = stlb_ns;
+                    s->walk_ns = walk_ns;
+                    s->pt_type = pt_type;
+                    s->p_pages = atoi(n_list[j]);
+                    s->tlb_entries = atoi(t_list[k]);
+                    if (s->p_pages < 1 || s->p_pages > V_PAGES || s->tlb_entries < 1
+                        || (tlb_ways && !valid_tlb_shape(s->tlb_entries, tlb_ways, s->tlb_repl))) {
+                        printf("Invalid number of physical pages or TLB entries!\n");
+                        return 1;
+                    }
+                    s->prefetch = prefetcher;
+                    s->prefetch_depth = prefetch_depth;
+                    s->n_procs = n_traces;
+                    s->local = local;
+                    s->asid = asid;
+                    s->quantum = quantum;
+                    if (n_traces > 1 && (s->pt_ops->needs_next_use || (local && resize)
+                        || s->p_pages < n_traces)) {
+                        printf("Several processes rule out OPT and resizing with local replacement,"
+                            " and need a frame each\n");
+                        return 1;
+                    }
+                    s->resize = resize;
+                    s->resize_interval = resize_interval;
+                    s->ws_tau = tau ? tau : resize_interval;
+                    s->pff_high = pff_high;
+                    s->pff_low = pff_low;
+                    s->clean_first = clean_first;
+                    s->read_cost = read_cost;
+                    s->write_cost = write_cost;
+                    if ((prefetcher || clean_first) && s->pt_ops->needs_next_use) {
+                        printf("OPT cannot know the next use of prefetched or rotated pages!\n");
+                        return 1;
+                    }
+                    if (HUGE_BITS) {
+                    // Small pages keep at least one frame
+                        s->huge_frames = huge_frames >= 0 ? huge_frames : (s->p_pages >> HUGE_BITS) / 2;
+                        s->htlb_entries = htlb_entries;
+                        if (s->huge_frames < 1 || (uint64_t)s->huge_frames << HUGE_BITS >= s->p_pages) {
+                            printf("Not enough physical pages for %d huge frames!\n", s->huge_frames);
+                            return 1;
+                        }
+                    }
+                }
+
+    if (sample_rate > 0 && (n_sims > 1 || n_traces > 1 || tlb_ways || stlb_entries || HUGE_BITS
+        || prefetcher || resize || series_path != NULL || n_caches)) {
+        printf("A sampled run takes a single configuration, with a fully associative TLB and"
+            " without huge pages, several processes, readahead, resizing, a time series or caches\n");
+        return 1;
+    }
+    if ((report || checkpoint_path != NULL || restore_path != NULL) && n_sims > 1) {
+        printf("--report, --checkpoint and --restore need a single configuration\n");
+        return 1;
+    }
+    if ((checkpoint_path != NULL || restore_path != NULL) && (n_traces > 1 || HUGE_BITS
+        || series_path != NULL || sample_rate > 0 || sims[0].pt_ops->needs_next_use
+        || (sims[0].tlb_ops != NULL && sims[0].tlb_ops->needs_next_use))) {
+        printf("Checkpoints rule out several processes, huge pages, time series, sampling and OPT\n");
+        return 1;
+    }
+    if (report && n_traces > 1) {
+        printf("--report needs a single process\n");
+        return 1;
+    }
+    int text = trace.fp != NULL || (trace.stream && trace.width == 0);
+    if (n_traces > 1) {
+    // Processes are interleaved, so every trace is loaded
+        traces = calloc(n_traces, sizeof(struct trace));
+        traces[0] = trace;
+        for (i = 0; i < n_traces; ++i) {
+            if (i > 0 && trace_open(&traces[i], argv[optind + 1 + i]) != 0) {
+                perror(argv[optind + 1 + i]);
+                return 1;
+            }
+            if (trace_load(&traces[i]) != 0) {
+                printf("Out of memory loading the trace\n");
+                return 1;
+            }
+        }
+        trace = traces[0];
+    }
+// Huge page regions come first, OPT keys its next-use index by them
+    if (HUGE_BITS) {
+        if (strncmp(huge_arg, "auto", 4) == 0) {
+            if (trace_load(&trace) != 0) {
+                printf("Out of memory loading the trace\n");
+                return 1;
+            }
+            mark_dense_regions(&trace, huge_arg[4] == '=' ? atof(huge_arg + 5) : 0.5);
+        } else if (load_huge_regions(huge_arg) != 0) {
+            perror(huge_arg);
+            return 1;
+        }
+    }
+
+/* A sampled run replays the references to sampled pages only, with
+ * the frames and the TLB scaled down by the sampling rate. With
+ * --sample-check the whole trace is kept for an exact run after it.
+ */
+    struct trace full;
+    struct sim exact;
+    uint64_t full_count = 0;
+    double rate = 1;
+    if (sample_rate > 0) {
+        struct trace sampled;
+        uint64_t threshold = sample_threshold(sample_rate);
+        if ((sample_check && trace_load(&trace) != 0)
+            || trace_sample(&trace, &sampled, threshold, &full_count) != 0) {
+            printf("Out of memory loading the trace\n");
+            return 1;
+        }
+        full = trace;
+        full.pos = 0;
+        if (!sample_check) trace_close(&full);
+        trace = sampled;
+        rate = (double)threshold / SAMPLE_MODULUS;
+        exact = sims[0];
+        sims[0].p_pages = sims[0].p_pages * rate + 0.5;
+        sims[0].tlb_entries = sims[0].tlb_entries * rate + 0.5;
+        if (sims[0].p_pages < 1) sims[0].p_pages = 1;
+        if (sims[0].tlb_entries < 1) sims[0].tlb_entries = 1;
+    }
+
+// OPT needs the whole trace up front for its next-use index
+    uint32_t *next_use = NULL;
+    for (i = 0; i < n_sims; ++i)
+        if (((sims[i].tlb_ops != NULL && sims[i].tlb_ops->needs_next_use)
+            || sims[i].pt_ops->needs_next_use) && next_use == NULL) {
+            if (trace_load(&trace) != 0) {
+                printf("Out of memory loading the trace\n");
+                return 1;
             }
-            tlb_replace(logical_page, physical_page);  // Update TLB
+            next_use = build_next_use(&trace);
+        }
+    for (i = 0; i < n_sims; ++i) sims[i].next_use = next_use;
+
+    if (n_sims > 1 && series_path != NULL) {
+        printf("--series needs a single configuration\n");
+        return 1;
+    }
+    if (n_sims > 1) {
+        if (trace_load(&trace) != 0) {
+            printf("Out of memory loading the trace\n");
+            return 1;
+        }
+        run_sweep(sims, n_sims, &trace, n_threads > 0 ? n_threads : 1);
+        trace_close(&trace);
+        return 0;
+    }
+
+// A single simulation streams its trace, so a text trace is never held in memory
+    s = sims;
+    sim_init(s);
+    if (series_path != NULL) s->series = series_new(series_path, series_json, window, tau ? tau : window);
+    char ckpt_trace[4096];
+    uint64_t trace_pos = 0;
+    if (restore_path != NULL) {
+        if (checkpoint(s, restore_path, 0, ckpt_trace, &trace_pos) != 0) return 1;
+    // The same trace file resumes where it stopped, anything else extends the run
+        if (strcmp(ckpt_trace, argv[optind + 1]) != 0 || trace.stream) trace_pos = 0;
+        printf("Restored %llu accesses from %s, reading %s from record %llu\n",
+            (unsigned long long)s->accesses, restore_path, argv[optind + 1], (unsigned long long)trace_pos);
+        trace_skip(&trace, trace_pos);
+    }
+    if (s->n_procs > 1) {
+        run_sim(s, &trace);
+    } else {
+        catch_signals(checkpoint_path != NULL);
+        trace_pos += run_stream(s, &trace, report);
+    }
+    trace_close(&trace);
+    if (checkpoint_path != NULL) {
+        if (checkpoint(s, checkpoint_path, 1, argv[optind + 1], &trace_pos) != 0) return 1;
+        printf("Checkpoint = %s (%llu accesses, %s at record %llu%s)\n", checkpoint_path,
+            (unsigned long long)s->accesses, argv[optind + 1], (unsigned long long)trace_pos,
+            stop_signal ? ", paused" : "");
+    }
+    if (s->series != NULL) series_finish(s);
+    printf("Page Faults = %llu\n", (unsigned long long)s->page_fault);
+    printf("TLB Hits = %llu\n", (unsigned long long)s->tlb_hit);
+    if (s->stlb_entries) printf("STLB Hits = %llu\n", (unsigned long long)s->stlb_hit);
+    printf("Accesses = %llu (%s trace, %.0f accesses/sec)\n", (unsigned long long)s->accesses,
+        text ? "text" : "binary", s->secs > 0 ? s->accesses / s->secs : 0.0);
+    if (s->tlb->pol != NULL && s->tlb->pol->ops->stats != NULL)
+        s->tlb->pol->ops->stats(s->tlb->pol, stdout, "TLB");
+    if (s->frames->ops->stats != NULL) s->frames->ops->stats(s->frames, stdout, "Page table");
+    if (HUGE_BITS) print_huge_stats(s);
+    if (s->prefetch) print_prefetch_stats(s);
+    if (s->resize)
+        printf("Frames = %.1f allocated on average, %d held at peak, of %d (%s, revised every %llu accesses)\n",
+            s->accesses ? (double)s->alloc_accesses / s->accesses : 0.0, s->peak_alloc,
+            s->p_pages - (s->huge_frames << HUGE_BITS), resize_names[s->resize],
+            (unsigned long long)s->resize_interval);
+    printf("Writes = %llu, Dirty Write-backs = %llu on eviction + %llu in the background (%llu bytes)\n",
+        (unsigned long long)s->writes, (unsigned long long)s->wb_sync,
+        (unsigned long long)s->wb_async, (unsigned long long)s->wb_bytes);
+    printf("Estimated I/O Time = %.3f ms stalled + %.3f ms in the background (%g us/page read, %g us/page written)\n",
+        s->stall_us / 1000, s->background_us / 1000, s->read_cost, s->write_cost);
+    sim_free(s);
+    uint64_t misses = s->accesses - s->tlb_hit - s->stlb_hit;
+    printf("Page Walk References = %llu (%.2f per TLB miss, %s page table of %llu bytes)\n",
+        (unsigned long long)s->walk_refs, misses ? (double)s->walk_refs / misses : 0.0,
+        s->pt_type->name, (unsigned long long)s->pt_bytes);
+    if (s->n_caches) print_cache_stats(s);
+    if (n_traces > 1) print_procs(s, argv + optind + 1);
+    if (sample_rate > 0) {
+        double estimate = s->page_fault / rate;
+        printf("Sampled Accesses = %llu of %llu (rate %.6f, %d of %d frames, %d of %d TLB entries),"
+            " Estimated Page Faults = %.0f (miss ratio %.6f)\n", (unsigned long long)s->accesses,
+            (unsigned long long)full_count, rate, s->p_pages, exact.p_pages, s->tlb_entries,
+            exact.tlb_entries, estimate, full_count ? estimate / full_count : 0.0);
+        if (sample_check) {
+            if ((exact.tlb_ops != NULL && exact.tlb_ops->needs_next_use) || exact.pt_ops->needs_next_use)
+                exact.next_use = build_next_use(&full);
+            sim_init(&exact);
+            run_sim(&exact, &full);
+            sim_free(&exact);
+            printf("Exact Page Faults = %llu (miss ratio %.6f), estimate off by %+.2f%%,"
+                " %.3f s sampled against %.3f s exact\n", (unsigned long long)exact.page_fault,
+                full_count ? (double)exact.page_fault / full_count : 0.0,
+                exact.page_fault ? 100 * (estimate - exact.page_fault) / exact.page_fault : 0.0,
+                s->secs, exact.secs);
+            trace_close(&full);
         }
-        int physical_address = (physical_page << OFFSET) | offset;  // Calc physical address
-        char val = mm[physical_address];  // Get the value
-        // printf("l: %d, p: %d\n", logical_address, physical_address);
-        // printf("%d %d\n", tlb_hit, page_fault);
     }
-    printf("Page Faults = %d\n", page_fault);
-    printf("TLB Hits = %d\n", tlb_hit);
-}
\ No newline at end of file
+    free(sims);
+    return 0;
+}
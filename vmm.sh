@@ -1,9 +1,5 @@
-gcc vm.c -o vm -w
-echo "256 physical pages with FIFO replacement: "
-./vm BACKING_STORE.bin addresses.txt -p FIFO -n 256
-echo "256 physical pages with LRU replacement: "
-./vm BACKING_STORE.bin addresses.txt -p LRU -n 256
-echo "128 physical pages with FIFO replacement: "
-./vm BACKING_STORE.bin addresses.txt -p FIFO -n 128
-echo "128 physical pages with LRU replacement: "
-./vm BACKING_STORE.bin addresses.txt -p LRU -n 128
+gcc -O2 vm.c -o vm -w -lpthread
+echo "FIFO, LRU, CLOCK, ARC and OPT replacement with 256 and 128 physical pages: "
+./vm BACKING_STORE.bin addresses.txt -p FIFO,LRU,CLOCK,ARC,OPT -n 256,128
+echo "LRU page faults for every number of physical pages: "
+./vm BACKING_STORE.bin addresses.txt -p LRU --sweep
@@ -1,11 +1,13 @@
-gcc locality.c -o loc
-./loc
-gcc vm.c -o vm -w
-echo "256 physical pages with FIFO replacement: "
-./vm BACKING_STORE.bin addresses_locality.txt -p FIFO -n 256
-echo "256 physical pages with LRU replacement: "
-./vm BACKING_STORE.bin addresses_locality.txt -p LRU -n 256
-echo "128 physical pages with FIFO replacement: "
-./vm BACKING_STORE.bin addresses_locality.txt -p FIFO -n 128
-echo "128 physical pages with LRU replacement: "
-./vm BACKING_STORE.bin addresses_locality.txt -p LRU -n 128
+gcc -O2 locality.c -o loc -lm
+./loc -p ijk -N 64 addresses_locality.txt
+gcc -O2 vm.c -o vm -w -lpthread
+echo "FIFO, LRU, CLOCK, ARC and OPT replacement with 256 and 128 physical pages: "
+./vm BACKING_STORE.bin addresses_locality.txt -p FIFO,LRU,CLOCK,ARC,OPT -n 256,128
+echo "LRU page faults for every number of physical pages: "
+./vm BACKING_STORE.bin addresses_locality.txt -p LRU --sweep
+echo "LRU with 32 physical pages for the ijk, ikj and tiled matrix multiply: "
+for order in ijk ikj tiled; do
+	./loc -p $order -N 64 addresses_$order.bin
+	echo "$order:"
+	./vm BACKING_STORE.bin addresses_$order.bin -p LRU -n 32
+done